@@ -148,6 +148,7 @@ macro(configure_headers headerDir)
 
         include(CheckIncludeFiles)
         check_include_files(iconv.h HAVE_ICONV)
+        check_include_files(linux/io_uring.h HAVE_LINUX_IO_URING_H)
 
         set(CONFIG_HEADERS_DIR ${headerDir})
         set(CONFIG_HEADERS on)
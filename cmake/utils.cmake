@@ -122,6 +122,10 @@ macro(setStandardCompilerSettings)
             set(CMAKE_EXE_LINKER_FLAGS_DEBUG "${CMAKE_EXE_LINKER_FLAGS_DEBUG} --coverage")
         endif()
 
+        if (MORDOR_UCONTEXT_FIBERS)
+            add_definitions(-DMORDOR_UCONTEXT_FIBERS)
+        endif()
+
         if (CMAKE_HOST_APPLE)
             set(CMAKE_CXX_FLAGS "-stdlib=libc++ ${CMAKE_CXX_FLAGS}")
             set(CMAKE_EXE_LINKER_FLAGS "-stdlib=libc++ ${CMAKE_EXE_LINKER_FLAGS}")
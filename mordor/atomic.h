@@ -250,6 +250,35 @@ atomicCompareAndSwap(volatile T &t, T newvalue, T comparand) {
 }
 #endif
 
+/// Read t before any memory access that follows; pairs with
+/// atomicStoreRelease, to see everything stored before it
+#if defined(__clang__) || (defined(__GNUC__) && \
+    (__GNUC__ > 4 || __GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+template <class T>
+T atomicLoadAcquire(const volatile T &t)
+{ return __atomic_load_n(&t, __ATOMIC_ACQUIRE); }
+/// Store v into t after every memory access that precedes it
+template <class T>
+void atomicStoreRelease(volatile T &t, T v)
+{ __atomic_store_n(&t, v, __ATOMIC_RELEASE); }
+#elif defined(_MSC_VER)
+// x86 and x64 only reorder stores after loads, so all that's needed is to
+// stop the compiler reordering
+template <class T>
+T atomicLoadAcquire(const volatile T &t)
+{ T v = t; _ReadWriteBarrier(); return v; }
+template <class T>
+void atomicStoreRelease(volatile T &t, T v)
+{ _ReadWriteBarrier(); t = v; }
+#elif defined(__GNUC__)
+template <class T>
+T atomicLoadAcquire(const volatile T &t)
+{ T v = t; __sync_synchronize(); return v; }
+template <class T>
+void atomicStoreRelease(volatile T &t, T v)
+{ __sync_synchronize(); t = v; }
+#endif
+
 template <typename T>
 class Atomic
 {
@@ -15,6 +15,11 @@ struct DummyVoid;
 
 struct CoroutineAbortedException : virtual OperationAbortedException {};
 
+/// Runs dg on a Fiber of its own, passing values back and forth with the
+/// caller each time one side yields
+/// @note Every Coroutine has its own stack; pass a small stacksize when a
+/// great many of them are alive at once, or see generator.h for stages that
+/// need no stack at all
 template <class Result, class Arg = DummyVoid>
 class Coroutine : boost::noncopyable
 {
@@ -24,10 +29,12 @@ public:
         m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this)));
     }
 
-    Coroutine(boost::function<void (Coroutine &, Arg)> dg)
+    Coroutine(boost::function<void (Coroutine &, Arg)> dg,
+        size_t stacksize = 0)
         : m_dg(dg)
     {
-        m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this)));
+        m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this),
+            stacksize));
     }
 
     ~Coroutine()
@@ -99,10 +106,11 @@ public:
         m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this)));
     }
 
-    Coroutine(boost::function<void (Coroutine &)> dg)
+    Coroutine(boost::function<void (Coroutine &)> dg, size_t stacksize = 0)
         : m_dg(dg)
     {
-        m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this)));
+        m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this),
+            stacksize));
     }
 
     ~Coroutine()
@@ -170,10 +178,12 @@ public:
         m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this)));
     }
 
-    Coroutine(boost::function<void (Coroutine &, Arg)> dg)
+    Coroutine(boost::function<void (Coroutine &, Arg)> dg,
+        size_t stacksize = 0)
         : m_dg(dg)
     {
-        m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this)));
+        m_fiber = Fiber::ptr(new Fiber(boost::bind(&Coroutine::run, this),
+            stacksize));
     }
 
     ~Coroutine()
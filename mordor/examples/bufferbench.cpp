@@ -0,0 +1,118 @@
+//
+// Mordor Buffer benchmark app.
+//
+// Streams data through a Buffer the way a protocol parser does: copy a chunk
+// in, then consume it, so nearly every iteration allocates and frees a
+// segment.  Also measures sharing segments between Buffers, which is what
+// copyIn(const Buffer &) and Buffer copies do, creating short-lived
+// Buffers, and scanning for delimiters with find().
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+#include <vector>
+
+#include "mordor/assert.h"
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/statistics.h"
+#include "mordor/streams/buffer.h"
+#include "mordor/timer.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_iterations = Config::lookup<size_t>(
+    "bufferbench.iterations", 1000000u, "Number of iterations per test");
+static ConfigVar<size_t>::ptr g_chunkSize = Config::lookup<size_t>(
+    "bufferbench.chunksize", 4000u,
+    "Bytes copied in and consumed per iteration");
+static ConfigVar<size_t>::ptr g_depth = Config::lookup<size_t>(
+    "bufferbench.depth", 16u,
+    "Chunks kept buffered (and so segments alive) in the pipelined test");
+
+static void report(const char *name, size_t iterations,
+    unsigned long long elapsed)
+{
+    std::cout << name << ": " << iterations << " iterations in " << elapsed
+        << " us (" << (elapsed * 1000.0 / iterations) << " ns/iteration)"
+        << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        size_t iterations = g_iterations->val();
+        size_t chunkSize = g_chunkSize->val();
+        size_t depth = g_depth->val();
+        std::vector<char> chunk(chunkSize, 'x');
+
+        // Every chunk lands in a fresh segment, and is freed right away
+        Buffer buffer;
+        unsigned long long start = TimerManager::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            buffer.copyIn(&chunk[0], chunkSize);
+            buffer.consume(chunkSize);
+        }
+        report("copyin/consume", iterations, TimerManager::now() - start);
+
+        // Several segments alive at once, as when a reader runs ahead of
+        // the parser
+        start = TimerManager::now();
+        for (size_t i = 0; i < depth; ++i)
+            buffer.copyIn(&chunk[0], chunkSize);
+        for (size_t i = 0; i < iterations; ++i) {
+            buffer.copyIn(&chunk[0], chunkSize);
+            buffer.consume(chunkSize);
+        }
+        report("pipelined", iterations, TimerManager::now() - start);
+        buffer.clear();
+
+        // Slicing shares segments instead of copying their bytes
+        Buffer source;
+        for (size_t i = 0; i < depth; ++i)
+            source.copyIn(&chunk[0], chunkSize);
+        start = TimerManager::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            Buffer copy;
+            copy.copyIn(source, chunkSize, (i % depth) * chunkSize);
+            copy.consume(chunkSize / 2);
+        }
+        report("share/consume", iterations, TimerManager::now() - start);
+
+        // Short-lived Buffers, like a parsed header line
+        start = TimerManager::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            Buffer line(&chunk[0], chunkSize);
+            line.consume(chunkSize / 2);
+        }
+        report("construct", iterations, TimerManager::now() - start);
+
+        // Scanning for delimiters that are only at the very end, as when
+        // looking for the end of headers or a multipart boundary
+        source.copyIn("\r\n--boundary\r\n");
+        size_t findIterations = (std::max<size_t>)(iterations / depth, 1u);
+        start = TimerManager::now();
+        for (size_t i = 0; i < findIterations; ++i)
+            MORDOR_VERIFY(source.find('\r') >= 0);
+        report("find char", findIterations, TimerManager::now() - start);
+        start = TimerManager::now();
+        for (size_t i = 0; i < findIterations; ++i)
+            MORDOR_VERIFY(source.find("--boundary\r\n") >= 0);
+        report("find string", findIterations, TimerManager::now() - start);
+        // ... and where the delimiter's first byte is everywhere
+        start = TimerManager::now();
+        for (size_t i = 0; i < findIterations; ++i)
+            MORDOR_VERIFY(source.find("x\r\n--boundary") >= 0);
+        report("find string, common prefix", findIterations,
+            TimerManager::now() - start);
+
+        Statistics::dump(std::cout);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,90 @@
+//
+// Mordor Fiber switch benchmark app.
+//
+// Ping-pongs between two fibers and reports the cost of a single context
+// switch, both for a bare Fiber::call/yield pair and through a Scheduler.
+// Also reports the cost of creating, running and destroying a Fiber.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include "mordor/config.h"
+#include "mordor/fiber.h"
+#include "mordor/main.h"
+#include "mordor/statistics.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_iterations = Config::lookup<size_t>(
+    "fiberbench.iterations", 10000000u, "Number of round trips per test");
+
+static void pong(size_t iterations)
+{
+    for (size_t i = 0; i < iterations; ++i)
+        Fiber::yield();
+}
+
+static void nop()
+{
+}
+
+static void schedulerPong(size_t iterations)
+{
+    for (size_t i = 0; i < iterations; ++i)
+        Scheduler::yield();
+}
+
+static void report(const char *name, size_t switches,
+    unsigned long long elapsed)
+{
+    std::cout << name << ": " << switches << " switches in " << elapsed
+        << " us (" << (elapsed * 1000.0 / switches) << " ns/switch)"
+        << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        size_t iterations = g_iterations->val();
+
+        Fiber::ptr fiber(new Fiber(boost::bind(&pong, iterations)));
+        unsigned long long start = TimerManager::now();
+        for (size_t i = 0; i <= iterations; ++i)
+            fiber->call();
+        report("call/yield", iterations * 2, TimerManager::now() - start);
+
+        size_t fibers = iterations / 10;
+        start = TimerManager::now();
+        for (size_t i = 0; i < fibers; ++i) {
+            Fiber::ptr shortLived(new Fiber(&nop));
+            shortLived->call();
+        }
+        unsigned long long elapsed = TimerManager::now() - start;
+        std::cout << "create: " << fibers << " fibers in " << elapsed
+            << " us (" << (elapsed * 1000.0 / fibers) << " ns/fiber)"
+            << std::endl;
+
+        // Two fibers yielding to each other on a single thread, so every
+        // yield switches to the scheduler fiber and then to the other fiber
+        WorkerPool pool(1, false);
+        start = TimerManager::now();
+        pool.schedule(boost::bind(&schedulerPong, iterations / 2));
+        pool.schedule(boost::bind(&schedulerPong, iterations / 2));
+        pool.stop();
+        report("scheduler", (iterations / 2) * 2 * 2,
+            TimerManager::now() - start);
+        Statistics::dump(std::cout);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
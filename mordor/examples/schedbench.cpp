@@ -0,0 +1,111 @@
+//
+// Mordor Scheduler benchmark app.
+//
+// Measures how long it takes for scheduled work to start running, both when
+// it is scheduled from inside the Scheduler and when it is injected from a
+// thread that doesn't belong to it.
+//
+
+#include "mordor/predef.h"
+
+#include <iostream>
+
+#include <boost/bind.hpp>
+
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/main.h"
+#include "mordor/semaphore.h"
+#include "mordor/statistics.h"
+#include "mordor/thread.h"
+#include "mordor/timer.h"
+#include "mordor/workerpool.h"
+
+using namespace Mordor;
+
+static ConfigVar<size_t>::ptr g_threads = Config::lookup<size_t>(
+    "schedbench.threads", 4u, "Number of threads in the Scheduler");
+static ConfigVar<size_t>::ptr g_iterations = Config::lookup<size_t>(
+    "schedbench.iterations", 1000000u, "Number of items to schedule per test");
+static ConfigVar<bool>::ptr g_workStealing = Config::lookup<bool>(
+    "schedbench.workstealing", false, "Use per-thread work stealing queues");
+
+static AverageMinMaxStatistic<unsigned long long> &g_chainLatency =
+    Statistics::registerStatistic("schedbench.chain",
+    AverageMinMaxStatistic<unsigned long long>("us"));
+static AverageMinMaxStatistic<unsigned long long> &g_injectLatency =
+    Statistics::registerStatistic("schedbench.inject",
+    AverageMinMaxStatistic<unsigned long long>("us"));
+
+namespace {
+
+struct Chain
+{
+    Scheduler *scheduler;
+    size_t remaining;
+    Semaphore done;
+};
+
+}
+
+// Each hop schedules the next one from inside the Scheduler
+static void hop(Chain &chain, unsigned long long scheduledAt)
+{
+    unsigned long long now = TimerManager::now();
+    g_chainLatency.update(now - scheduledAt);
+    if (--chain.remaining == 0) {
+        chain.done.notify();
+        return;
+    }
+    chain.scheduler->schedule(boost::bind(&hop, boost::ref(chain), now));
+}
+
+static void injected(Atomic<size_t> &remaining, Semaphore &done,
+    unsigned long long scheduledAt)
+{
+    g_injectLatency.update(TimerManager::now() - scheduledAt);
+    if (--remaining == 0)
+        done.notify();
+}
+
+static void report(const char *name, size_t iterations,
+    unsigned long long elapsed)
+{
+    std::cout << name << ": " << iterations << " items in " << elapsed
+        << " us (" << (elapsed * 1000.0 / iterations) << " ns/item)"
+        << std::endl;
+}
+
+MORDOR_MAIN(int argc, char *argv[])
+{
+    try {
+        Config::loadFromEnvironment();
+        size_t iterations = g_iterations->val();
+        WorkerPool pool(g_threads->val(), false, 1, g_workStealing->val());
+
+        Chain chain;
+        chain.scheduler = &pool;
+        chain.remaining = iterations;
+        unsigned long long start = TimerManager::now();
+        pool.schedule(boost::bind(&hop, boost::ref(chain), start));
+        chain.done.wait();
+        report("chain", iterations, TimerManager::now() - start);
+
+        Atomic<size_t> remaining(iterations);
+        Semaphore done;
+        start = TimerManager::now();
+        for (size_t i = 0; i < iterations; ++i)
+            pool.schedule(boost::bind(&injected, boost::ref(remaining),
+                boost::ref(done), TimerManager::now()));
+        done.wait();
+        report("inject", iterations, TimerManager::now() - start);
+
+        pool.stop();
+        Statistics::dump(std::cout);
+        return 0;
+    } catch (...) {
+        std::cerr << "caught: "
+                  << boost::current_exception_diagnostic_information() << "\n";
+        return 1;
+    }
+}
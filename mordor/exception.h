@@ -51,6 +51,7 @@ struct StreamException : virtual Exception {};
 struct UnexpectedEofException : virtual StreamException {};
 struct WriteBeyondEofException : virtual StreamException {};
 struct BufferOverflowException : virtual StreamException {};
+struct BufferLimitExceededException : virtual Exception {};
 
 struct NativeException : virtual Exception {};
 
@@ -2,12 +2,16 @@
 
 #include "fiber.h"
 
+#include <deque>
+#include <map>
+
 #include <boost/thread/tss.hpp>
 
 #include "assert.h"
 #include "mordor/config.h"
 #include "exception.h"
 #include "statistics.h"
+#include "timer.h"
 #include "version.h"
 
 #ifdef WINDOWS
@@ -30,6 +34,19 @@ static AverageMinMaxStatistic<unsigned int> &g_statFree=
 static volatile unsigned int g_cntFibers = 0; // Active fibers
 static MaxStatistic<unsigned int> &g_statMaxFibers=Statistics::registerStatistic("fiber.max",
     MaxStatistic<unsigned int>());
+static CountStatistic<unsigned long long> &g_statStackCacheHits =
+    Statistics::registerStatistic("fiber.stackcache.hits",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statStackCacheMisses =
+    Statistics::registerStatistic("fiber.stackcache.misses",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statStackCacheTrims =
+    Statistics::registerStatistic("fiber.stackcache.trims",
+    CountStatistic<unsigned long long>());
+static HistogramStatistic<size_t> &g_statStackWatermark =
+    Statistics::registerStatistic("fiber.stackwatermark",
+    HistogramStatistic<size_t>("bytes"),
+    "Stack high-watermarks of measured fibers that have run");
 
 #ifdef SETJMP_FIBERS
 #ifdef OSX
@@ -38,6 +55,88 @@ static MaxStatistic<unsigned int> &g_statMaxFibers=Statistics::registerStatistic
 #endif
 #endif
 
+#ifdef ASM_FIBERS
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in *from, then switches to the stack in to and restores the
+// registers saved there.  Everything else is already clobbered by the call
+// as far as the compiler is concerned, and the signal mask is left alone.
+extern "C" void mordor_fiber_switch(void **from, void *to)
+    __attribute__((visibility("hidden")));
+
+#ifdef X86_64
+// Frame (from the saved stack pointer up): mxcsr and x87 control word, r15,
+// r14, r13, r12, rbx, rbp, return address
+__asm__ (
+    ".text\n"
+    ".p2align 4\n"
+    ".globl mordor_fiber_switch\n"
+    ".hidden mordor_fiber_switch\n"
+    ".type mordor_fiber_switch,@function\n"
+"mordor_fiber_switch:\n"
+    "pushq %rbp\n"
+    "pushq %rbx\n"
+    "pushq %r12\n"
+    "pushq %r13\n"
+    "pushq %r14\n"
+    "pushq %r15\n"
+    "subq $8, %rsp\n"
+    "stmxcsr (%rsp)\n"
+    "fnstcw 4(%rsp)\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "ldmxcsr (%rsp)\n"
+    "fldcw 4(%rsp)\n"
+    "addq $8, %rsp\n"
+    "popq %r15\n"
+    "popq %r14\n"
+    "popq %r13\n"
+    "popq %r12\n"
+    "popq %rbx\n"
+    "popq %rbp\n"
+    "ret\n"
+    ".size mordor_fiber_switch,.-mordor_fiber_switch\n"
+);
+#elif defined(ARM64)
+// Frame (from the saved stack pointer up): x19-x28, x29 (fp), x30 (lr),
+// d8-d15
+__asm__ (
+    ".text\n"
+    ".p2align 4\n"
+    ".globl mordor_fiber_switch\n"
+    ".hidden mordor_fiber_switch\n"
+    ".type mordor_fiber_switch,%function\n"
+"mordor_fiber_switch:\n"
+    "sub sp, sp, #160\n"
+    "stp x19, x20, [sp, #0]\n"
+    "stp x21, x22, [sp, #16]\n"
+    "stp x23, x24, [sp, #32]\n"
+    "stp x25, x26, [sp, #48]\n"
+    "stp x27, x28, [sp, #64]\n"
+    "stp x29, x30, [sp, #80]\n"
+    "stp d8, d9, [sp, #96]\n"
+    "stp d10, d11, [sp, #112]\n"
+    "stp d12, d13, [sp, #128]\n"
+    "stp d14, d15, [sp, #144]\n"
+    "mov x2, sp\n"
+    "str x2, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0]\n"
+    "ldp x21, x22, [sp, #16]\n"
+    "ldp x23, x24, [sp, #32]\n"
+    "ldp x25, x26, [sp, #48]\n"
+    "ldp x27, x28, [sp, #64]\n"
+    "ldp x29, x30, [sp, #80]\n"
+    "ldp d8, d9, [sp, #96]\n"
+    "ldp d10, d11, [sp, #112]\n"
+    "ldp d12, d13, [sp, #128]\n"
+    "ldp d14, d15, [sp, #144]\n"
+    "add sp, sp, #160\n"
+    "ret\n"
+    ".size mordor_fiber_switch,.-mordor_fiber_switch\n"
+);
+#endif
+#endif
+
 static size_t g_pagesize;
 
 namespace {
@@ -66,6 +165,24 @@ static ConfigVar<size_t>::ptr g_defaultStackSize = Config::lookup<size_t>(
 #endif
     "Default stack size for new fibers.  This is the virtual size; physical "
     "memory isn't consumed until it is actually referenced.");
+static ConfigVar<bool>::ptr g_guardPages = Config::lookup<bool>(
+    "fiber.guardpages", false,
+    "Put an inaccessible page below each new fiber stack, so that "
+    "overflowing it faults instead of corrupting memory.");
+static ConfigVar<bool>::ptr g_measureStacks = Config::lookup<bool>(
+    "fiber.stackwatermark", false,
+    "Zero each new fiber stack so that its high-watermark can be measured "
+    "(see the fiber.stackwatermark statistic).  Costs a memset of the used "
+    "part of the stack each time a fiber is reset or freed.");
+static ConfigVar<size_t>::ptr g_stackCacheSize = Config::lookup<size_t>(
+    "fiber.stackcache.size", 64u,
+    "Maximum number of freed stacks of each size that each thread keeps for "
+    "reuse by new fibers.  0 disables the cache.");
+static ConfigVar<unsigned long long>::ptr g_stackCacheTrimDelay =
+    Config::lookup<unsigned long long>("fiber.stackcache.trimdelay",
+    1000000ull,
+    "Microseconds a cached stack can sit unused before its memory is given "
+    "back to the OS.  The address range stays cached.");
 
 // t_fiber is the Fiber currently executing on this thread
 // t_threadFiber is the Fiber that represents the thread's original stack
@@ -74,8 +191,153 @@ static ConfigVar<size_t>::ptr g_defaultStackSize = Config::lookup<size_t>(
 // ThreadLocalStorage does not
 // t_fiber is a ThreadLocalStorage, because it's faster than boost::tss
 ThreadLocalStorage<Fiber *> Fiber::t_fiber;
+// Mirrors fiber.stackwatermark, so Scheduler::schedule can check it inline
+bool Fiber::s_measureStacks = Fiber::monitorMeasureStacks();
 static boost::thread_specific_ptr<Fiber::ptr> t_threadFiber;
 
+#ifdef POSIX
+namespace {
+
+struct CachedStack
+{
+    void *stack;
+    unsigned long long freed;
+    // How many bytes from the top of the stack might not be zero
+    size_t dirty;
+};
+
+// Freed stacks of a single size class, oldest first.  The first trimmed
+// entries have already had their memory given back to the OS.
+struct StackList
+{
+    StackList() : trimmed(0) {}
+
+    std::deque<CachedStack> stacks;
+    size_t trimmed;
+};
+
+struct StackCache
+{
+    // Keyed by stack size and whether the stack has a guard page
+    typedef std::map<std::pair<size_t, bool>, StackList> Lists;
+
+    ~StackCache();
+
+    Lists lists;
+};
+
+}
+
+// Never destroyed, so that fibers freed during static destruction can still
+// look it up; each thread's cache is freed when the thread exits
+static boost::thread_specific_ptr<StackCache> & t_stackCache()
+{
+    static boost::thread_specific_ptr<StackCache> *cache =
+        new boost::thread_specific_ptr<StackCache>();
+    return *cache;
+}
+
+static void unmapStack(void *stack, size_t stacksize, bool guardPage)
+{
+    if (guardPage)
+        munmap((char *)stack - g_pagesize, stacksize + g_pagesize);
+    else
+        munmap(stack, stacksize);
+}
+
+StackCache::~StackCache()
+{
+    for (Lists::iterator it = lists.begin(); it != lists.end(); ++it) {
+        for (size_t i = 0; i < it->second.stacks.size(); ++i)
+            unmapStack(it->second.stacks[i].stack, it->first.first,
+                it->first.second);
+    }
+}
+
+static void trimStacks(StackList &list, size_t stacksize,
+    unsigned long long now)
+{
+    unsigned long long delay = g_stackCacheTrimDelay->val();
+    while (list.trimmed < list.stacks.size() &&
+        now - list.stacks[list.trimmed].freed >= delay) {
+        void *stack = list.stacks[list.trimmed].stack;
+        // MADV_FREE is cheaper, but not every kernel that defines it
+        // supports it
+#ifdef MADV_FREE
+        if (madvise(stack, stacksize, MADV_FREE))
+#endif
+            madvise(stack, stacksize, MADV_DONTNEED);
+        ++list.trimmed;
+        g_statStackCacheTrims.increment();
+    }
+}
+
+static void trimAllStacks(StackCache &cache, unsigned long long now)
+{
+    for (StackCache::Lists::iterator it = cache.lists.begin();
+        it != cache.lists.end(); ++it)
+        trimStacks(it->second, it->first.first, now);
+}
+
+static void *popCachedStack(size_t stacksize, bool guardPage, size_t &dirty)
+{
+    StackCache *cache = t_stackCache().get();
+    if (!cache)
+        return NULL;
+    StackCache::Lists::iterator it =
+        cache->lists.find(std::make_pair(stacksize, guardPage));
+    if (it == cache->lists.end() || it->second.stacks.empty())
+        return NULL;
+    StackList &list = it->second;
+    trimStacks(list, stacksize, TimerManager::now());
+    void *stack = list.stacks.back().stack;
+    dirty = list.stacks.back().dirty;
+    list.stacks.pop_back();
+    if (list.trimmed > list.stacks.size())
+        list.trimmed = list.stacks.size();
+    return stack;
+}
+
+static bool pushCachedStack(void *stack, size_t stacksize, bool guardPage,
+    size_t dirty)
+{
+    size_t limit = g_stackCacheSize->val();
+    if (limit == 0)
+        return false;
+    StackCache *cache = t_stackCache().get();
+    if (!cache) {
+        cache = new StackCache();
+        t_stackCache().reset(cache);
+    }
+    StackList &list = cache->lists[std::make_pair(stacksize, guardPage)];
+    unsigned long long now = TimerManager::now();
+    // Every size, so stacks of one nobody allocates any more still go back
+    trimAllStacks(*cache, now);
+    // Evict the coldest stack to make room for this (still warm) one
+    while (list.stacks.size() >= limit) {
+        unmapStack(list.stacks.front().stack, stacksize, guardPage);
+        list.stacks.pop_front();
+        if (list.trimmed > 0)
+            --list.trimmed;
+    }
+    CachedStack cached = { stack, now, dirty };
+    list.stacks.push_back(cached);
+    return true;
+}
+
+// Zero the top dirty bytes of a stack
+static void zeroStack(void *stack, size_t stacksize, size_t dirty)
+{
+#ifdef LINUX
+    // Dropping the pages is cheaper than touching every one of them, and
+    // private anonymous memory reads back as zeros afterwards
+    if (dirty == stacksize && madvise(stack, stacksize, MADV_DONTNEED) == 0)
+        return;
+#endif
+    memset((char *)stack + stacksize - dirty, 0, dirty);
+}
+#endif
+
 static boost::mutex & g_flsMutex()
 {
     static boost::mutex mutex;
@@ -95,6 +357,10 @@ Fiber::Fiber()
     m_stack = NULL;
     m_stacksize = 0;
     m_sp = NULL;
+#if defined(POSIX) && !defined(NATIVE_WINDOWS_FIBERS)
+    m_guardPage = m_measureStack = false;
+    m_stackWatermark = 0;
+#endif
     setThis(this);
 #ifdef NATIVE_WINDOWS_FIBERS
     if (!pIsThreadAFiber())
@@ -161,6 +427,16 @@ Fiber::reset(boost::function<void ()> dg)
     MORDOR_ASSERT(m_stack);
     MORDOR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
     m_dg = dg;
+#if defined(POSIX) && !defined(NATIVE_WINDOWS_FIBERS)
+    // A fiber that hasn't run since its stack was last zeroed only has
+    // initStack's frame on it, which initStack is about to rewrite anyway
+    if (m_measureStack && m_state != INIT) {
+        size_t used = stackHighWatermark();
+        g_statStackWatermark.update(used);
+        zeroStack(m_stack, m_stacksize, used);
+    }
+    m_stackWatermark = 0;
+#endif
     initStack();
     m_state = INIT;
 }
@@ -382,12 +658,10 @@ Fiber::allocStack()
 {
     if (m_stacksize == 0)
         m_stacksize = g_defaultStackSize->val();
-#ifndef NATIVE_WINDOWS_FIBERS
-    TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statAlloc);
-#endif
 #ifdef NATIVE_WINDOWS_FIBERS
     // Fibers are allocated in initStack
 #elif defined(WINDOWS)
+    TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statAlloc);
     m_stack = VirtualAlloc(NULL, m_stacksize + g_pagesize, MEM_RESERVE, PAGE_NOACCESS);
     if (!m_stack)
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("VirtualAlloc");
@@ -396,9 +670,30 @@ Fiber::allocStack()
     VirtualAlloc((char*)m_stack + g_pagesize, m_stacksize, MEM_COMMIT, PAGE_READWRITE);
     m_sp = (char*)m_stack + m_stacksize + g_pagesize;
 #elif defined(POSIX)
-    m_stack = mmap(NULL, m_stacksize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (m_stack == MAP_FAILED)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+    m_guardPage = g_guardPages->val();
+    m_measureStack = g_measureStacks->val();
+    m_stackWatermark = 0;
+    size_t dirty = 0;
+    m_stack = popCachedStack(m_stacksize, m_guardPage, dirty);
+    if (m_stack) {
+        g_statStackCacheHits.increment();
+        if (m_measureStack)
+            zeroStack(m_stack, m_stacksize, dirty);
+    } else {
+        g_statStackCacheMisses.increment();
+        TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statAlloc);
+        size_t guardsize = m_guardPage ? g_pagesize : 0;
+        void *base = mmap(NULL, m_stacksize + guardsize,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (base == MAP_FAILED)
+            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("mmap");
+        if (m_guardPage && mprotect(base, g_pagesize, PROT_NONE)) {
+            error_t error = lastError();
+            munmap(base, m_stacksize + guardsize);
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mprotect");
+        }
+        m_stack = (char *)base + guardsize;
+    }
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     m_valgrindStackId = VALGRIND_STACK_REGISTER(m_stack, (char *)m_stack + m_stacksize);
 #endif
@@ -409,17 +704,28 @@ Fiber::allocStack()
 void
 Fiber::freeStack()
 {
-    TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statFree);
 #ifdef NATIVE_WINDOWS_FIBERS
+    TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statFree);
     MORDOR_ASSERT(m_stack == &m_sp);
     DeleteFiber(m_sp);
 #elif defined(WINDOWS)
+    TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statFree);
     VirtualFree(m_stack, 0, MEM_RELEASE);
 #elif defined(POSIX)
 #if defined(VALGRIND) && (defined(LINUX) || defined(OSX))
     VALGRIND_STACK_DEREGISTER(m_valgrindStackId);
 #endif
-    munmap(m_stack, m_stacksize);
+    // Unmeasured stacks could have been dirtied anywhere
+    size_t dirty = m_stacksize;
+    if (m_measureStack) {
+        dirty = stackHighWatermark();
+        if (m_state != INIT)
+            g_statStackWatermark.update(dirty);
+    }
+    if (!pushCachedStack(m_stack, m_stacksize, m_guardPage, dirty)) {
+        TimeStatistic<AverageMinMaxStatistic<unsigned int> > time(g_statFree);
+        unmapStack(m_stack, m_stacksize, m_guardPage);
+    }
 #endif
 }
 
@@ -436,6 +742,12 @@ Fiber::switchContext(Fiber *to)
     if (swapcontext((ucontext_t*)(this->m_sp), (ucontext_t*)to->m_sp))
         MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("swapcontext");
 
+#elif defined(ASM_FIBERS)
+#  if defined(CXXABIV1_EXCEPTION)
+    this->m_eh.swap(to->m_eh);
+#  endif
+    mordor_fiber_switch(&this->m_sp, to->m_sp);
+
 #elif defined(SETJMP_FIBERS)
     if (!setjmp(*(jmp_buf*)this->m_sp)) {
 #  if defined(CXXABIV1_EXCEPTION)
@@ -470,6 +782,26 @@ Fiber::initStack()
     m_ctx.uc_mcontext = (mcontext_t)m_mctx;
 #endif
     makecontext(&m_ctx, &Fiber::entryPoint, 0);
+#elif defined(ASM_FIBERS)
+    // Build a frame that mordor_fiber_switch will "return" from into
+    // entryPoint, with a zero return address above it to end backtraces
+    void **top = (void **)(((uintptr_t)m_stack + m_stacksize) & ~(uintptr_t)15);
+    *--top = NULL;
+#ifdef X86_64
+    *--top = (void *)&Fiber::entryPoint;
+    for (int i = 0; i < 6; ++i)
+        *--top = NULL; // rbp, rbx, r12-r15
+    uint32_t *control = (uint32_t *)--top;
+    control[0] = 0x1f80; // mxcsr
+    control[1] = 0x037f; // x87 control word
+#elif defined(ARM64)
+    // Keep the stack 16-byte aligned; the zero return address is unused
+    *--top = NULL;
+    top -= 20;
+    memset(top, 0, 20 * sizeof(void *));
+    top[11] = (void *)&Fiber::entryPoint; // x30
+#endif
+    m_sp = top;
 #elif defined(SETJMP_FIBERS)
     if (setjmp(m_env)) {
         Fiber::entryPoint();
@@ -520,6 +852,70 @@ Fiber::initStack()
 #endif
 }
 
+size_t
+Fiber::defaultStackSize()
+{
+    return g_defaultStackSize->val();
+}
+
+void
+Fiber::trimStackCache()
+{
+#ifdef POSIX
+    if (StackCache *cache = t_stackCache().get())
+        trimAllStacks(*cache, TimerManager::now());
+#endif
+}
+
+bool
+Fiber::monitorMeasureStacks()
+{
+    g_measureStacks->monitor(&Fiber::updateMeasureStacks);
+    return g_measureStacks->val();
+}
+
+void
+Fiber::updateMeasureStacks()
+{
+    s_measureStacks = g_measureStacks->val();
+}
+
+size_t
+Fiber::stackHighWatermark() const
+{
+#if defined(POSIX) && !defined(NATIVE_WINDOWS_FIBERS)
+    if (!m_measureStack || !m_stack)
+        return 0;
+    if (m_stackWatermark)
+        return m_stackWatermark;
+    // The stack grows down, so nothing below the lowest page that has ever
+    // been touched can have been used
+    size_t pages = m_stacksize / g_pagesize, page = 0;
+    std::vector<unsigned char> resident(pages);
+#ifdef LINUX
+    if (mincore(m_stack, m_stacksize, &resident[0]) == 0) {
+#else
+    if (mincore(m_stack, m_stacksize, (char *)&resident[0]) == 0) {
+#endif
+        while (page < pages && !(resident[page] & 1))
+            ++page;
+    }
+    const uintptr_t *word =
+        (const uintptr_t *)((const char *)m_stack + page * g_pagesize);
+    const uintptr_t *top =
+        (const uintptr_t *)((const char *)m_stack + m_stacksize);
+    while (word < top && *word == 0)
+        ++word;
+    size_t used = (const char *)top - (const char *)word;
+    // Nothing can touch a terminated fiber's stack until it's reset
+    if (m_state == TERM || m_state == EXCEPT)
+        m_stackWatermark = used;
+    return used;
+#else
+    return 0;
+#endif
+}
+
 #ifdef WINDOWS
 static bool g_doesntHaveOSFLS;
 #endif
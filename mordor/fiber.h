@@ -15,11 +15,16 @@
 
 // Fiber impl selection
 
+// ASM_FIBERS switch by saving and restoring only the callee-saved registers;
+// unlike swapcontext they don't make a sigprocmask syscall on every switch.
+// Define MORDOR_UCONTEXT_FIBERS to fall back to swapcontext.
 #ifdef X86_64
 #   ifdef WINDOWS
 #       define NATIVE_WINDOWS_FIBERS
 #   elif defined(OSX)
 #       define SETJMP_FIBERS
+#   elif defined(LINUX) && defined(GCC) && !defined(MORDOR_UCONTEXT_FIBERS)
+#       define ASM_FIBERS
 #   elif defined(POSIX)
 #       define UCONTEXT_FIBERS
 #   endif
@@ -35,6 +40,12 @@
 #   define UCONTEXT_FIBERS
 #elif defined(ARM)
 #   define UCONTEXT_FIBERS
+#elif defined(ARM64)
+#   if defined(LINUX) && defined(GCC) && !defined(MORDOR_UCONTEXT_FIBERS)
+#       define ASM_FIBERS
+#   else
+#       define UCONTEXT_FIBERS
+#   endif
 #else
 #   error Platform not supported
 #endif
@@ -156,11 +167,35 @@ public:
     /// @pre state() != EXEC
     std::vector<void *> backtrace();
 
+    /// How much of this fiber's stack has been used since it was last reset
+
+    /// Stacks are only measured if fiber.stackwatermark was enabled when they
+    /// were allocated; otherwise this returns 0.  Measured stacks start out
+    /// zeroed, and the watermark is the highest word that isn't zero any
+    /// more, so it can be off by a few words.  Once the fiber has terminated
+    /// the measurement is kept until reset(), so asking again (or resetting
+    /// or freeing the fiber) doesn't scan the stack again.
+    size_t stackHighWatermark() const;
+
+    /// The stack size new fibers get if they don't ask for one
+    /// (fiber.defaultstacksize)
+    static size_t defaultStackSize();
+
+    /// Whether new fibers' stacks are measured (fiber.stackwatermark)
+    static bool measuringStacks() { return s_measureStacks; }
+
+    /// Give the memory of this thread's cached stacks that have gone unused
+    /// for fiber.stackcache.trimdelay back to the OS; Schedulers do this
+    /// whenever a thread runs out of work
+    static void trimStackCache();
+
 private:
     Fiber::ptr yieldTo(bool yieldToCallerOnTerminate, State targetState);
     static void setThis(Fiber *f);
     static void entryPoint();
     static void exitPoint(Fiber::ptr &cur, State targetState);
+    static bool monitorMeasureStacks();
+    static void updateMeasureStacks();
 
     void allocStack();
     void freeStack();
@@ -172,6 +207,10 @@ private:
     boost::function<void ()> m_dg;
     void *m_stack, *m_sp;
     size_t m_stacksize;
+#if defined(POSIX) && !defined(NATIVE_WINDOWS_FIBERS)
+    bool m_guardPage, m_measureStack;
+    mutable size_t m_stackWatermark;
+#endif
 #ifdef UCONTEXT_FIBERS
     ucontext_t m_ctx;
 #ifdef OSX
@@ -192,6 +231,7 @@ private:
     boost::exception_ptr m_exception;
 
     static ThreadLocalStorage<Fiber *> t_fiber;
+    static bool s_measureStacks;
 
     // FLS Support
     static size_t flsAlloc();
@@ -0,0 +1,223 @@
+#ifndef __MORDOR_FIBERCHANNEL_H__
+#define __MORDOR_FIBERCHANNEL_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "assert.h"
+#include "fibersynchronization.h"
+#include "scheduler.h"
+
+namespace Mordor {
+
+/// Bounded multi-producer, multi-consumer queue for Fibers
+
+/// send() waits while the channel is full, and recv() while it is empty;
+/// waiting yields to the Scheduler instead of blocking the thread, so a slow
+/// consumer naturally throttles its producers.  Any number of Fibers, on any
+/// number of Schedulers and threads, may send and receive concurrently.
+/// Storage for capacity values is allocated up front, and waiting Fibers
+/// park on their own stacks, so passing a message never allocates.
+/// @note T must be default constructible and assignable; received slots are
+/// reset to T() so the channel doesn't keep values alive
+template <class T>
+class FiberChannel : boost::noncopyable
+{
+public:
+    /// @param capacity How many values can be sent without being received
+    FiberChannel(size_t capacity)
+        : m_buffer(capacity),
+          m_head(0),
+          m_size(0),
+          m_closed(false)
+    {
+        MORDOR_ASSERT(capacity > 0);
+    }
+
+    ~FiberChannel()
+    {
+#ifndef NDEBUG
+        boost::mutex::scoped_lock lock(m_mutex);
+        MORDOR_NOTHROW_ASSERT(m_senders.empty());
+        MORDOR_NOTHROW_ASSERT(m_receivers.empty());
+#endif
+    }
+
+    size_t capacity() const { return m_buffer.size(); }
+
+    /// Send value, waiting for room if the channel is full
+    /// @pre Scheduler::getThis() != NULL
+    /// @return false if the channel is (or became, while waiting) closed;
+    /// value was not sent
+    bool send(const T &value)
+    {
+        MORDOR_ASSERT(Scheduler::getThis());
+        boost::mutex::scoped_lock lock(m_mutex);
+        while (!m_closed && m_size == m_buffer.size()) {
+            FiberWaiter waiter;
+            m_senders.push(waiter);
+            lock.unlock();
+            Scheduler::yieldTo();
+            lock.lock();
+        }
+        if (m_closed)
+            return false;
+        push(value);
+        wakeOne(m_receivers, lock);
+        return true;
+    }
+
+    /// Send value only if there is room for it right now
+    /// @return If value was sent
+    bool trySend(const T &value)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_closed || m_size == m_buffer.size())
+            return false;
+        push(value);
+        wakeOne(m_receivers, lock);
+        return true;
+    }
+
+    /// Receive the oldest value, waiting for one if the channel is empty
+    /// @pre Scheduler::getThis() != NULL
+    /// @return false if the channel is closed and everything sent before
+    /// it was closed has been received
+    bool recv(T &value)
+    {
+        MORDOR_ASSERT(Scheduler::getThis());
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!waitForValues(lock))
+            return false;
+        pop(value);
+        wakeOne(m_senders, lock);
+        return true;
+    }
+
+    /// Receive the oldest value only if there is one right now
+    /// @return If value was received
+    bool tryRecv(T &value)
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (m_size == 0)
+            return false;
+        pop(value);
+        wakeOne(m_senders, lock);
+        return true;
+    }
+
+    /// Receive up to max values, appending them to values; waits only for
+    /// the first
+    /// @pre Scheduler::getThis() != NULL
+    /// @return How many values were received; 0 only if the channel is
+    /// closed and drained
+    size_t recvMany(std::vector<T> &values, size_t max)
+    {
+        MORDOR_ASSERT(Scheduler::getThis());
+        MORDOR_ASSERT(max > 0);
+        boost::mutex::scoped_lock lock(m_mutex);
+        if (!waitForValues(lock))
+            return 0;
+        size_t count = (std::min)(max, m_size);
+        values.reserve(values.size() + count);
+        for (size_t i = 0; i < count; ++i) {
+            values.push_back(T());
+            pop(values.back());
+        }
+        // Every freed slot may let another sender in
+        FiberWaitQueue senders;
+        for (size_t i = 0; i < count; ++i) {
+            FiberWaiter *sender = m_senders.pop();
+            if (!sender)
+                break;
+            senders.push(*sender);
+        }
+        lock.unlock();
+        while (FiberWaiter *sender = senders.pop())
+            sender->wake();
+        return count;
+    }
+
+    /// Refuse any further values, and release all waiting Fibers; values
+    /// already sent can still be received
+    void close()
+    {
+        FiberWaitQueue senders, receivers;
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_closed = true;
+            senders.swap(m_senders);
+            receivers.swap(m_receivers);
+        }
+        while (FiberWaiter *waiter = senders.pop())
+            waiter->wake();
+        while (FiberWaiter *waiter = receivers.pop())
+            waiter->wake();
+    }
+
+    bool closed()
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        return m_closed;
+    }
+
+private:
+    /// @return false if the channel is closed and empty
+    bool waitForValues(boost::mutex::scoped_lock &lock)
+    {
+        while (m_size == 0) {
+            if (m_closed)
+                return false;
+            FiberWaiter waiter;
+            m_receivers.push(waiter);
+            lock.unlock();
+            Scheduler::yieldTo();
+            lock.lock();
+        }
+        return true;
+    }
+
+    void push(const T &value)
+    {
+        MORDOR_ASSERT(m_size < m_buffer.size());
+        m_buffer[(m_head + m_size) % m_buffer.size()] = value;
+        ++m_size;
+    }
+
+    void pop(T &value)
+    {
+        MORDOR_ASSERT(m_size > 0);
+        T &slot = m_buffer[m_head];
+        using std::swap;
+        swap(value, slot);
+        slot = T();
+        m_head = (m_head + 1) % m_buffer.size();
+        --m_size;
+    }
+
+    /// Wake the longest waiting Fiber in waiters, if any; unlocks lock
+    static void wakeOne(FiberWaitQueue &waiters,
+        boost::mutex::scoped_lock &lock)
+    {
+        FiberWaiter *waiter = waiters.pop();
+        lock.unlock();
+        if (waiter)
+            waiter->wake();
+    }
+
+private:
+    boost::mutex m_mutex;
+    std::vector<T> m_buffer;
+    // Index of the oldest value, and how many values there are
+    size_t m_head, m_size;
+    bool m_closed;
+    FiberWaitQueue m_senders, m_receivers;
+};
+
+}
+
+#endif
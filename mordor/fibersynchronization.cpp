@@ -3,15 +3,48 @@
 #include "fibersynchronization.h"
 
 #include "assert.h"
+#include "atomic.h"
 #include "fiber.h"
 #include "scheduler.h"
+#include "statistics.h"
 
 namespace Mordor {
 
+static AverageMinMaxStatistic<unsigned long long> &g_statReadWait =
+    Statistics::registerStatistic("fiberrwmutex.readwait",
+    AverageMinMaxStatistic<unsigned long long>("us"));
+static AverageMinMaxStatistic<unsigned long long> &g_statWriteWait =
+    Statistics::registerStatistic("fiberrwmutex.writewait",
+    AverageMinMaxStatistic<unsigned long long>("us"));
+
+FiberWaiter::FiberWaiter()
+    : scheduler(Scheduler::getThis()),
+      fiber(Fiber::getThis()),
+      next(NULL)
+{}
+
+void
+FiberWaiter::wake()
+{
+    // Our stack can go away as soon as the Fiber is scheduled, so take
+    // everything needed out of it first
+    Scheduler *scheduler = this->scheduler;
+    Fiber::ptr fiber;
+    fiber.swap(this->fiber);
+    scheduler->schedule(fiber);
+}
+
+FiberMutex::FiberMutex()
+    : m_state(0),
+      m_handOffs(0),
+      m_owner(NULL)
+{}
+
 FiberMutex::~FiberMutex()
 {
 #ifndef NDEBUG
     boost::mutex::scoped_lock scopeLock(m_mutex);
+    MORDOR_NOTHROW_ASSERT(m_state == 0);
     MORDOR_NOTHROW_ASSERT(!m_owner);
     MORDOR_NOTHROW_ASSERT(m_waiters.empty());
 #endif
@@ -21,59 +54,85 @@ void
 FiberMutex::lock()
 {
     MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(m_owner != Fiber::getThis().get());
+    if (atomicIncrement(m_state) == 1) {
+#ifndef NDEBUG
+        m_owner = Fiber::getThis().get();
+#endif
+        return;
+    }
+    FiberWaiter waiter;
     {
         boost::mutex::scoped_lock scopeLock(m_mutex);
-        MORDOR_ASSERT(m_owner != Fiber::getThis());
-        MORDOR_ASSERT_PERF(std::find(m_waiters.begin(), m_waiters.end(),
-            std::make_pair(Scheduler::getThis(), Fiber::getThis()))
-            == m_waiters.end());
-        if (!m_owner) {
-            m_owner = Fiber::getThis();
+        // The owner already let go, before we could queue
+        if (m_handOffs > 0) {
+            --m_handOffs;
+#ifndef NDEBUG
+            m_owner = waiter.fiber.get();
+#endif
             return;
         }
-        m_waiters.push_back(std::make_pair(Scheduler::getThis(),
-            Fiber::getThis()));
+        m_waiters.push(waiter);
     }
     Scheduler::yieldTo();
-#ifndef NDEBUG
-    boost::mutex::scoped_lock scopeLock(m_mutex);
-    MORDOR_ASSERT(m_owner == Fiber::getThis());
-    MORDOR_ASSERT_PERF(std::find(m_waiters.begin(), m_waiters.end(),
-            std::make_pair(Scheduler::getThis(), Fiber::getThis()))
-            == m_waiters.end());
-#endif
+    MORDOR_ASSERT(m_owner == Fiber::getThis().get());
 }
 
 void
 FiberMutex::unlock()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    unlockNoLock();
+    MORDOR_ASSERT(m_owner == Fiber::getThis().get());
+#ifndef NDEBUG
+    m_owner = NULL;
+#endif
+    if (atomicDecrement(m_state) != 0)
+        handOff();
 }
 
 bool
 FiberMutex::unlockIfNotUnique()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    MORDOR_ASSERT(m_owner == Fiber::getThis());
-    if (!m_waiters.empty()) {
-        unlockNoLock();
-        return true;
+    MORDOR_ASSERT(m_owner == Fiber::getThis().get());
+    if (m_state == 1)
+        return false;
+    unlock();
+    return true;
+}
+
+void
+FiberMutex::lockFor(FiberWaiter &waiter)
+{
+    if (atomicIncrement(m_state) != 1) {
+        boost::mutex::scoped_lock scopeLock(m_mutex);
+        if (m_handOffs == 0) {
+            m_waiters.push(waiter);
+            return;
+        }
+        --m_handOffs;
     }
-    return false;
+#ifndef NDEBUG
+    m_owner = waiter.fiber.get();
+#endif
+    waiter.wake();
 }
 
 void
-FiberMutex::unlockNoLock()
+FiberMutex::handOff()
 {
-    MORDOR_ASSERT(m_owner == Fiber::getThis());
-    m_owner.reset();
-    if (!m_waiters.empty()) {
-        std::pair<Scheduler *, Fiber::ptr> next = m_waiters.front();
-        m_waiters.pop_front();
-        m_owner = next.second;
-        next.first->schedule(next.second);
+    FiberWaiter *next;
+    {
+        boost::mutex::scoped_lock scopeLock(m_mutex);
+        next = m_waiters.pop();
+        // Whoever is about to queue will find this instead
+        if (!next) {
+            ++m_handOffs;
+            return;
+        }
+#ifndef NDEBUG
+        m_owner = next->fiber.get();
+#endif
     }
+    next->wake();
 }
 
 RecursiveFiberMutex::~RecursiveFiberMutex()
@@ -90,30 +149,24 @@ void
 RecursiveFiberMutex::lock()
 {
     MORDOR_ASSERT(Scheduler::getThis());
+    FiberWaiter waiter;
     {
         boost::mutex::scoped_lock scopeLock(m_mutex);
-        if (Fiber::getThis() == m_owner) {
+        if (waiter.fiber == m_owner) {
             ++m_recursion;
             return;
         }
-        MORDOR_ASSERT_PERF(std::find(m_waiters.begin(), m_waiters.end(),
-                                     std::make_pair(Scheduler::getThis(), Fiber::getThis())) ==
-                           m_waiters.end());
         if (!m_owner) {
-            m_owner = Fiber::getThis();
+            m_owner = waiter.fiber;
             m_recursion = 1;
             return;
         }
-        m_waiters.push_back(std::make_pair(Scheduler::getThis(),
-                                           Fiber::getThis()));
+        m_waiters.push(waiter);
     }
     Scheduler::yieldTo();
 #ifndef NDEBUG
     boost::mutex::scoped_lock scopeLock(m_mutex);
     MORDOR_ASSERT(m_owner == Fiber::getThis());
-    MORDOR_ASSERT_PERF(std::find(m_waiters.begin(), m_waiters.end(),
-                                 std::make_pair(Scheduler::getThis(), Fiber::getThis())) ==
-                       m_waiters.end());
 #endif
 }
 
@@ -147,23 +200,119 @@ RecursiveFiberMutex::unlockNoLock()
 {
     MORDOR_ASSERT(m_owner == Fiber::getThis());
     m_owner.reset();
-    if (!m_waiters.empty()) {
-        std::pair<Scheduler *, Fiber::ptr> next = m_waiters.front();
-        m_waiters.pop_front();
-        m_owner = next.second;
+    if (FiberWaiter *next = m_waiters.pop()) {
+        m_owner = next->fiber;
         m_recursion = 1;
-        next.first->schedule(next.second);
+        next->wake();
+    }
+}
+
+FiberRWMutex::FiberRWMutex()
+    : m_readers(0),
+      m_writer(false)
+{}
+
+FiberRWMutex::~FiberRWMutex()
+{
+#ifndef NDEBUG
+    boost::mutex::scoped_lock scopeLock(m_mutex);
+    MORDOR_NOTHROW_ASSERT(m_readers == 0);
+    MORDOR_NOTHROW_ASSERT(!m_writer);
+    MORDOR_NOTHROW_ASSERT(m_readWaiters.empty());
+    MORDOR_NOTHROW_ASSERT(m_writeWaiters.empty());
+#endif
+}
+
+void
+FiberRWMutex::lockShared()
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+    FiberWaiter waiter;
+    {
+        boost::mutex::scoped_lock scopeLock(m_mutex);
+        if (!m_writer && m_writeWaiters.empty()) {
+            ++m_readers;
+            return;
+        }
+        m_readWaiters.push(waiter);
     }
+    TimeStatistic<AverageMinMaxStatistic<unsigned long long> > time(
+        g_statReadWait);
+    Scheduler::yieldTo();
+}
+
+void
+FiberRWMutex::unlockShared()
+{
+    FiberWaiter *next;
+    {
+        boost::mutex::scoped_lock scopeLock(m_mutex);
+        MORDOR_ASSERT(m_readers > 0);
+        MORDOR_ASSERT(!m_writer);
+        if (--m_readers != 0)
+            return;
+        next = m_writeWaiters.pop();
+        if (!next)
+            return;
+        m_writer = true;
+    }
+    next->wake();
+}
+
+void
+FiberRWMutex::lock()
+{
+    MORDOR_ASSERT(Scheduler::getThis());
+    FiberWaiter waiter;
+    {
+        boost::mutex::scoped_lock scopeLock(m_mutex);
+        if (!m_writer && m_readers == 0) {
+            m_writer = true;
+            return;
+        }
+        m_writeWaiters.push(waiter);
+    }
+    TimeStatistic<AverageMinMaxStatistic<unsigned long long> > time(
+        g_statWriteWait);
+    Scheduler::yieldTo();
+}
+
+void
+FiberRWMutex::unlock()
+{
+    FiberWaitQueue readers;
+    FiberWaiter *writer = NULL;
+    {
+        boost::mutex::scoped_lock scopeLock(m_mutex);
+        MORDOR_ASSERT(m_writer);
+        MORDOR_ASSERT(m_readers == 0);
+        m_writer = false;
+        // Let in everyone who queued to read while we held it
+        while (FiberWaiter *reader = m_readWaiters.pop()) {
+            readers.push(*reader);
+            ++m_readers;
+        }
+        if (m_readers == 0) {
+            writer = m_writeWaiters.pop();
+            m_writer = writer != NULL;
+        }
+    }
+    while (FiberWaiter *reader = readers.pop())
+        reader->wake();
+    if (writer)
+        writer->wake();
 }
 
 FiberSemaphore::FiberSemaphore(size_t initialConcurrency)
-    : m_concurrency(initialConcurrency)
+    : m_concurrency((ptrdiff_t)initialConcurrency),
+      m_wakeups(0)
 {}
 
 FiberSemaphore::~FiberSemaphore()
 {
 #ifndef NDEBUG
     boost::mutex::scoped_lock scopeLock(m_mutex);
+    MORDOR_NOTHROW_ASSERT(m_concurrency >= 0);
     MORDOR_NOTHROW_ASSERT(m_waiters.empty());
 #endif
 }
@@ -172,38 +321,37 @@ void
 FiberSemaphore::wait()
 {
     MORDOR_ASSERT(Scheduler::getThis());
+    if (atomicDecrement(m_concurrency) >= 0)
+        return;
+    FiberWaiter waiter;
     {
         boost::mutex::scoped_lock scopeLock(m_mutex);
-        MORDOR_ASSERT_PERF(std::find(m_waiters.begin(), m_waiters.end(),
-            std::make_pair(Scheduler::getThis(), Fiber::getThis()))
-            == m_waiters.end());
-        if (m_concurrency > 0u) {
-            --m_concurrency;
+        // Notified before we could queue
+        if (m_wakeups > 0) {
+            --m_wakeups;
             return;
         }
-        m_waiters.push_back(std::make_pair(Scheduler::getThis(),
-            Fiber::getThis()));
+        m_waiters.push(waiter);
     }
     Scheduler::yieldTo();
-#ifndef NDEBUG_PERF
-    boost::mutex::scoped_lock scopeLock(m_mutex);
-    MORDOR_ASSERT_PERF(std::find(m_waiters.begin(), m_waiters.end(),
-            std::make_pair(Scheduler::getThis(), Fiber::getThis()))
-            == m_waiters.end());
-#endif
 }
 
 void
 FiberSemaphore::notify()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (!m_waiters.empty()) {
-        std::pair<Scheduler *, Fiber::ptr> next = m_waiters.front();
-        m_waiters.pop_front();
-        next.first->schedule(next.second);
-    } else {
-        ++m_concurrency;
+    if (atomicIncrement(m_concurrency) > 0)
+        return;
+    FiberWaiter *next;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        next = m_waiters.pop();
+        // Whoever is about to queue will find this instead
+        if (!next) {
+            ++m_wakeups;
+            return;
+        }
     }
+    next->wake();
 }
 
 FiberCondition::~FiberCondition()
@@ -218,70 +366,41 @@ void
 FiberCondition::wait()
 {
     MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis().get());
+    FiberWaiter waiter;
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
-        MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis());
-        m_waiters.push_back(std::make_pair(Scheduler::getThis(),
-            Fiber::getThis()));
-        m_fiberMutex.unlockNoLock();
+        m_waiters.push(waiter);
     }
+    // If we're signalled before we get to yield, the signaller queues us on
+    // the mutex, and the unlock hands it right back to us
+    m_fiberMutex.unlock();
     Scheduler::yieldTo();
-#ifndef NDEBUG
-    boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
-    MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis());
-#endif
+    MORDOR_ASSERT(m_fiberMutex.m_owner == Fiber::getThis().get());
 }
 
 void
 FiberCondition::signal()
 {
-    std::pair<Scheduler *, Fiber::ptr> next;
+    FiberWaiter *next;
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        if (m_waiters.empty())
-            return;
-        next = m_waiters.front();
-        m_waiters.pop_front();
-    }
-    boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
-    MORDOR_ASSERT(m_fiberMutex.m_owner != next.second);
-    MORDOR_ASSERT_PERF(std::find(m_fiberMutex.m_waiters.begin(),
-        m_fiberMutex.m_waiters.end(), next)
-        == m_fiberMutex.m_waiters.end());
-    if (!m_fiberMutex.m_owner) {
-        m_fiberMutex.m_owner = next.second;
-        next.first->schedule(next.second);
-    } else {
-        m_fiberMutex.m_waiters.push_back(next);
+        next = m_waiters.pop();
     }
+    if (next)
+        m_fiberMutex.lockFor(*next);
 }
 
 void
 FiberCondition::broadcast()
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    if (m_waiters.empty())
-        return;
-    boost::mutex::scoped_lock lock2(m_fiberMutex.m_mutex);
-
-    std::list<std::pair<Scheduler *, Fiber::ptr> >::iterator it;
-    for (it = m_waiters.begin();
-        it != m_waiters.end();
-        ++it) {
-        std::pair<Scheduler *, Fiber::ptr> &next = *it;
-        MORDOR_ASSERT(m_fiberMutex.m_owner != next.second);
-        MORDOR_ASSERT_PERF(std::find(m_fiberMutex.m_waiters.begin(),
-            m_fiberMutex.m_waiters.end(), next)
-            == m_fiberMutex.m_waiters.end());
-        if (!m_fiberMutex.m_owner) {
-            m_fiberMutex.m_owner = next.second;
-            next.first->schedule(next.second);
-        } else {
-            m_fiberMutex.m_waiters.push_back(next);
-        }
+    FiberWaitQueue waiters;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        waiters.swap(m_waiters);
     }
-    m_waiters.clear();
+    while (FiberWaiter *next = waiters.pop())
+        m_fiberMutex.lockFor(*next);
 }
 
 
@@ -296,6 +415,7 @@ FiberEvent::~FiberEvent()
 void
 FiberEvent::wait()
 {
+    FiberWaiter waiter;
     {
         boost::mutex::scoped_lock lock(m_mutex);
         if (m_signalled) {
@@ -303,8 +423,7 @@ FiberEvent::wait()
                 m_signalled = false;
             return;
         }
-        m_waiters.push_back(std::make_pair(Scheduler::getThis(),
-            Fiber::getThis()));
+        m_waiters.push(waiter);
     }
     Scheduler::yieldTo();
 }
@@ -313,29 +432,25 @@ void
 FiberEvent::set()
 {
     if (m_autoReset) {
-        std::pair<Scheduler *, Fiber::ptr> runnable;
+        FiberWaiter *runnable;
         {
             boost::mutex::scoped_lock lock(m_mutex);
-            if (m_waiters.empty()) {
+            runnable = m_waiters.pop();
+            if (!runnable) {
                 m_signalled = true;
                 return;
             }
-            runnable = m_waiters.front();
-            m_waiters.pop_front();
         }
-        runnable.first->schedule(runnable.second);
+        runnable->wake();
     } else {
-        std::list<std::pair<Scheduler *, Fiber::ptr> > runnables;
+        FiberWaitQueue runnables;
         {
             boost::mutex::scoped_lock lock(m_mutex);
             m_signalled = true;
             runnables.swap(m_waiters);
         }
-        for (std::list<std::pair<Scheduler *, Fiber::ptr> >::iterator it = runnables.begin();
-             it != runnables.end();
-             ++it) {
-            it->first->schedule(it->second);
-        }
+        while (FiberWaiter *runnable = runnables.pop())
+            runnable->wake();
     }
 }
 
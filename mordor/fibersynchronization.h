@@ -2,7 +2,8 @@
 #define __MORDOR_FIBERSYNCHRONIZATION_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
-#include <list>
+#include <algorithm>
+#include <cstddef>
 
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
@@ -13,6 +14,62 @@ namespace Mordor {
 class Fiber;
 class Scheduler;
 
+/// A Fiber suspended on one of the synchronization primitives below
+
+/// It lives on the waiting Fiber's stack, so parking a Fiber doesn't
+/// allocate; whoever wakes it must not touch it afterwards, since the Fiber
+/// may already be running again and have returned
+struct FiberWaiter : boost::noncopyable
+{
+    /// Captures Scheduler::getThis() and Fiber::getThis()
+    FiberWaiter();
+
+    /// Schedule the waiting Fiber; this FiberWaiter must not be touched
+    /// afterwards
+    void wake();
+
+    Scheduler *scheduler;
+    boost::shared_ptr<Fiber> fiber;
+    FiberWaiter *next;
+};
+
+/// Intrusive FIFO of FiberWaiters
+struct FiberWaitQueue
+{
+public:
+    FiberWaitQueue() : m_head(NULL), m_tail(NULL) {}
+
+    bool empty() const { return m_head == NULL; }
+    void push(FiberWaiter &waiter)
+    {
+        waiter.next = NULL;
+        if (m_tail)
+            m_tail->next = &waiter;
+        else
+            m_head = &waiter;
+        m_tail = &waiter;
+    }
+    /// @return The longest waiting FiberWaiter, or NULL if empty
+    FiberWaiter *pop()
+    {
+        FiberWaiter *result = m_head;
+        if (result) {
+            m_head = result->next;
+            if (!m_head)
+                m_tail = NULL;
+        }
+        return result;
+    }
+    void swap(FiberWaitQueue &other)
+    {
+        std::swap(m_head, other.m_head);
+        std::swap(m_tail, other.m_tail);
+    }
+
+private:
+    FiberWaiter *m_head, *m_tail;
+};
+
 /// Scheduler based Mutex for Fibers
 
 /// Type that will lock the mutex on construction, and unlock on
@@ -66,7 +123,8 @@ private:
 /// Mutex for use by Fibers that yields to a Scheduler instead of blocking
 /// if the mutex cannot be immediately acquired.  It also provides the
 /// additional guarantee that it is strictly FIFO, instead of random which
-/// Fiber will acquire the mutex next after it is released.
+/// Fiber will acquire the mutex next after it is released.  Uncontended
+/// lock() and unlock() are a single atomic operation each.
 struct FiberMutex : boost::noncopyable
 {
     friend struct FiberCondition;
@@ -74,6 +132,7 @@ public:
     typedef ScopedLockImpl<FiberMutex> ScopedLock;
 
 public:
+    FiberMutex();
     ~FiberMutex();
 
     /// @brief Locks the mutex
@@ -94,12 +153,22 @@ public:
     bool unlockIfNotUnique();
 
 private:
-    void unlockNoLock();
+    /// Acquire the mutex on behalf of the suspended waiter, waking it if
+    /// that's immediately possible, or queueing it otherwise
+    void lockFor(FiberWaiter &waiter);
+    /// Pass the mutex to the next waiter
+    void handOff();
 
 private:
+    // How many Fibers hold or are waiting for the mutex
+    volatile size_t m_state;
+    // The rest is only used under contention
     boost::mutex m_mutex;
-    boost::shared_ptr<Fiber> m_owner;
-    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
+    // Hand-offs made before the Fiber they were for could queue itself
+    size_t m_handOffs;
+    FiberWaitQueue m_waiters;
+    // Only tracked in debug builds
+    Fiber *m_owner;
 };
 
 struct RecursiveFiberMutex : boost::noncopyable
@@ -132,16 +201,93 @@ private:
 private:
     boost::mutex m_mutex;
     boost::shared_ptr<Fiber> m_owner;
-    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
+    FiberWaitQueue m_waiters;
     unsigned m_recursion;
 };
 
+/// Type that will lock a reader-writer mutex for reading on construction,
+/// and unlock on destruction
+template<class Mutex> struct ScopedReadLockImpl
+{
+public:
+    ScopedReadLockImpl(Mutex &mutex)
+        : m_mutex(mutex)
+    {
+        m_mutex.lockShared();
+        m_locked = true;
+    }
+    ~ScopedReadLockImpl()
+    { unlock(); }
+
+    void lock()
+    {
+        if (!m_locked) {
+            m_mutex.lockShared();
+            m_locked = true;
+        }
+    }
+
+    void unlock()
+    {
+        if (m_locked) {
+            m_mutex.unlockShared();
+            m_locked = false;
+        }
+    }
+
+private:
+    Mutex &m_mutex;
+    bool m_locked;
+};
+
+/// Scheduler based reader-writer mutex for Fibers
+
+/// Any number of Fibers may hold it for reading at once, or one Fiber for
+/// writing; Fibers that have to wait yield to their Scheduler, and are
+/// resumed on it in the order they arrived.  Writers are preferred: once a
+/// writer is waiting, new readers queue behind it.  Releasing a write lock
+/// lets in every reader that queued meanwhile, so a stream of writers can't
+/// starve readers either.  How often and how long Fibers wait is recorded
+/// in the fiberrwmutex.readwait and fiberrwmutex.writewait statistics.
+struct FiberRWMutex : boost::noncopyable
+{
+public:
+    typedef ScopedReadLockImpl<FiberRWMutex> ScopedReadLock;
+    typedef ScopedLockImpl<FiberRWMutex> ScopedWriteLock;
+
+public:
+    FiberRWMutex();
+    ~FiberRWMutex();
+
+    /// @brief Locks the mutex for reading
+    /// @pre Scheduler::getThis() != NULL
+    /// @pre Fiber::getThis() does not hold this mutex
+    void lockShared();
+    /// @pre Fiber::getThis() holds this mutex for reading
+    void unlockShared();
+
+    /// @brief Locks the mutex for writing
+    /// @pre Scheduler::getThis() != NULL
+    /// @pre Fiber::getThis() does not hold this mutex
+    void lock();
+    /// @pre Fiber::getThis() holds this mutex for writing
+    void unlock();
+
+private:
+    boost::mutex m_mutex;
+    size_t m_readers;
+    bool m_writer;
+    FiberWaitQueue m_readWaiters, m_writeWaiters;
+};
+
 /// Scheduler based Semaphore for Fibers
 
 /// Semaphore for use by Fibers that yields to a Scheduler instead of blocking
 /// if the mutex cannot be immediately acquired.  It also provides the
 /// additional guarantee that it is strictly FIFO, instead of random which
-/// Fiber will acquire the semaphore next after it is released.
+/// Fiber will acquire the semaphore next after it is released.  wait() when
+/// there is concurrency available and notify() when no one is waiting are a
+/// single atomic operation each.
 struct FiberSemaphore : boost::noncopyable
 {
 public:
@@ -159,9 +305,13 @@ public:
     void notify();
 
 private:
+    // Available concurrency, or minus the number of waiting Fibers
+    volatile ptrdiff_t m_concurrency;
+    // The rest is only used when Fibers have to wait
     boost::mutex m_mutex;
-    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
-    size_t m_concurrency;
+    // notify()s made before the Fiber they were for could queue itself
+    size_t m_wakeups;
+    FiberWaitQueue m_waiters;
 };
 
 /// Scheduler based condition variable for Fibers
@@ -195,7 +345,7 @@ public:
 private:
     boost::mutex m_mutex;
     FiberMutex &m_fiberMutex;
-    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
+    FiberWaitQueue m_waiters;
 };
 
 /// Scheduler based event variable for Fibers
@@ -227,7 +377,7 @@ private:
     boost::mutex m_mutex;
     bool m_signalled;
     const bool m_autoReset;
-    std::list<std::pair<Scheduler *, boost::shared_ptr<Fiber> > > m_waiters;
+    FiberWaitQueue m_waiters;
 };
 
 }
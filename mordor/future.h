@@ -3,15 +3,18 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include <bitset>
+#include <iterator>
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "assert.h"
 #include "atomic.h"
 #include "fiber.h"
 #include "scheduler.h"
+#include "timer.h"
 
 namespace Mordor {
 
@@ -61,19 +64,39 @@ public:
     /// For signallers to set the result; once signalled should not be modified
     T& result() { MORDOR_ASSERT(!(m_fiber & 0x1)); return m_t; }
 
+    /// Call dg with the result once this Future is signalled, instead of
+    /// waiting for it; right away if it already has been
+    /// @param scheduler If set, dg is scheduled on it instead of being called
+    /// directly by the signaller
+    /// @pre No continuation has been set, and nobody is waiting
+    void then(boost::function<void (const T &)> dg,
+        Scheduler *scheduler = NULL)
+    {
+        MORDOR_ASSERT(dg);
+        MORDOR_ASSERT(!m_dg);
+        MORDOR_ASSERT(!m_scheduler);
+        m_dg = dg;
+        m_scheduler = scheduler;
+        intptr_t currentValue = atomicCompareAndSwap(m_fiber, (intptr_t)0x2,
+            (intptr_t)0);
+        if (currentValue == 0x1) {
+            m_fiber = 0x2;
+            continuation();
+        } else {
+            MORDOR_ASSERT(currentValue == 0);
+        }
+    }
+
     /// Signal this Future
     void signal()
     {
         intptr_t newValue = m_fiber, oldValue;
-        if (newValue == 0x2) {
-            MORDOR_ASSERT(m_dg);
-            if (m_scheduler)
-                m_scheduler->schedule(boost::bind(m_dg, boost::cref(m_t)));
-            else
-                m_dg(m_t);
-            return;
-        }
         do {
+            // then() may have raced us to attach a continuation
+            if (newValue == 0x2) {
+                continuation();
+                return;
+            }
             oldValue = newValue;
             newValue = oldValue | 0x1;
         } while ( (newValue = atomicCompareAndSwap(m_fiber, newValue, oldValue)) != oldValue);
@@ -88,11 +111,21 @@ public:
 
     void reset()
     {
-        m_fiber = 0;
+        m_fiber = m_dg ? 0x2 : 0;
         if (!m_dg)
             m_scheduler = NULL;
     }
 
+private:
+    void continuation()
+    {
+        MORDOR_ASSERT(m_dg);
+        if (m_scheduler)
+            m_scheduler->schedule(boost::bind(m_dg, boost::cref(m_t)));
+        else
+            m_dg(m_t);
+    }
+
 private:
     // We're going to stuff a couple of things into m_fiber, and do some bit
     // manipulation, so it's going to be easier to declare it as intptr_t
@@ -145,19 +178,38 @@ public:
         }
     }
 
+    /// Call dg once this Future is signalled, instead of waiting for it;
+    /// right away if it already has been
+    /// @param scheduler If set, dg is scheduled on it instead of being called
+    /// directly by the signaller
+    /// @pre No continuation has been set, and nobody is waiting
+    void then(boost::function<void ()> dg, Scheduler *scheduler = NULL)
+    {
+        MORDOR_ASSERT(dg);
+        MORDOR_ASSERT(!m_dg);
+        MORDOR_ASSERT(!m_scheduler);
+        m_dg = dg;
+        m_scheduler = scheduler;
+        intptr_t currentValue = atomicCompareAndSwap(m_fiber, (intptr_t)0x2,
+            (intptr_t)0);
+        if (currentValue == 0x1) {
+            m_fiber = 0x2;
+            continuation();
+        } else {
+            MORDOR_ASSERT(currentValue == 0);
+        }
+    }
+
     /// Signal this Future
     void signal()
     {
         intptr_t newValue = m_fiber, oldValue;
-        if (newValue == 0x2) {
-            MORDOR_ASSERT(m_dg);
-            if (m_scheduler)
-                m_scheduler->schedule(m_dg);
-            else
-                m_dg();
-            return;
-        }
         do {
+            // then() may have raced us to attach a continuation
+            if (newValue == 0x2) {
+                continuation();
+                return;
+            }
             oldValue = newValue;
             newValue = oldValue | 0x1;
         } while ( (newValue = atomicCompareAndSwap(m_fiber, newValue, oldValue)) != oldValue);
@@ -172,12 +224,21 @@ public:
 
     void reset()
     {
-        m_fiber = 0;
+        m_fiber = m_dg ? 0x2 : 0;
         if (!m_dg)
             m_scheduler = NULL;
     }
 
 private:
+    void continuation()
+    {
+        MORDOR_ASSERT(m_dg);
+        if (m_scheduler)
+            m_scheduler->schedule(m_dg);
+        else
+            m_dg();
+    }
+
     /// @return If the future was already signalled
     bool startWait()
     {
@@ -277,6 +338,115 @@ size_t waitAny(Iterator first, Iterator last)
     return result;
 }
 
+
+namespace Detail {
+
+struct WhenAll : boost::noncopyable
+{
+    WhenAll(size_t count, Future<bool> &all_)
+        : remaining(count),
+          done(0),
+          all(all_)
+    {}
+
+    void signalled()
+    {
+        if (atomicDecrement(remaining) == 0)
+            finish(true);
+    }
+
+    void finish(bool result)
+    {
+        if (atomicCompareAndSwap(done, 1, 0) != 0)
+            return;
+        // The timer is set before any Future can call us, but it can fire
+        // (which is the only way result is false) before it's set
+        if (result && timer)
+            timer->cancel();
+        all.result() = result;
+        all.signal();
+    }
+
+    size_t remaining;
+    int done;
+    Future<bool> &all;
+    Timer::ptr timer;
+};
+
+struct WhenAny : boost::noncopyable
+{
+    WhenAny(Future<size_t> &any_)
+        : done(0),
+          any(any_)
+    {}
+
+    void finish(size_t index)
+    {
+        if (atomicCompareAndSwap(done, 1, 0) != 0)
+            return;
+        if (index != ~(size_t)0 && timer)
+            timer->cancel();
+        any.result() = index;
+        any.signal();
+    }
+
+    int done;
+    Future<size_t> &any;
+    Timer::ptr timer;
+};
+
+}
+
+/// Signal all once every Future in [first, last) has been signalled, or once
+/// timeout has elapsed, whichever is first; nothing waits in the meantime
+///
+/// The bookkeeping is owned by continuations attached to the Futures (see
+/// Future::then) and by the timer, and goes away with the last of them.
+/// @param all Result is true if every Future was signalled, false if the
+/// timeout elapsed first
+/// @param timerManager If set, where to register the timeout
+/// @param timeout In microseconds
+/// @pre None of the Futures has a continuation, or is being waited on
+template <class Iterator>
+void whenAll(Iterator first, Iterator last, Future<bool> &all,
+    TimerManager *timerManager = NULL, unsigned long long timeout = ~0ull)
+{
+    size_t count = std::distance(first, last);
+    if (count == 0) {
+        all.result() = true;
+        all.signal();
+        return;
+    }
+    boost::shared_ptr<Detail::WhenAll> state(new Detail::WhenAll(count, all));
+    if (timerManager && timeout != ~0ull)
+        state->timer = timerManager->registerTimer(timeout, boost::bind(
+            &Detail::WhenAll::finish, state, false));
+    for (; first != last; ++first)
+        first->then(boost::bind(&Detail::WhenAll::signalled, state));
+}
+
+/// Signal any as soon as one Future in [first, last) has been signalled, or
+/// once timeout has elapsed; nothing waits in the meantime
+///
+/// The remaining Futures keep their continuations; they can still be
+/// signalled later, and that is simply ignored.
+/// @param any Result is the index of the first Future signalled, or
+/// ~(size_t)0 if the timeout elapsed first
+/// @param timerManager If set, where to register the timeout
+/// @param timeout In microseconds
+/// @pre None of the Futures has a continuation, or is being waited on
+template <class Iterator>
+void whenAny(Iterator first, Iterator last, Future<size_t> &any,
+    TimerManager *timerManager = NULL, unsigned long long timeout = ~0ull)
+{
+    MORDOR_ASSERT(first != last);
+    boost::shared_ptr<Detail::WhenAny> state(new Detail::WhenAny(any));
+    if (timerManager && timeout != ~0ull)
+        state->timer = timerManager->registerTimer(timeout, boost::bind(
+            &Detail::WhenAny::finish, state, ~(size_t)0));
+    for (size_t index = 0; first != last; ++first, ++index)
+        first->then(boost::bind(&Detail::WhenAny::finish, state, index));
+}
 }
 
 #endif
@@ -0,0 +1,206 @@
+#ifndef __MORDOR_GENERATOR_H__
+#define __MORDOR_GENERATOR_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "assert.h"
+#include "coroutine.h"
+
+namespace Mordor {
+
+/// A pull-based sequence of values
+
+/// Generators are plain state machines: next() runs on the caller's stack,
+/// and returns once it has produced a value.  Chaining stages with
+/// mapGenerator and filterGenerator therefore costs one small object per
+/// stage instead of one Fiber stack per stage.  Only sources that really
+/// need to suspend mid-computation have to be written as a Coroutine (see
+/// coroutineGenerator), and then only that source has a stack; everything
+/// downstream of it runs on the stack of whoever pulls from the end of the
+/// chain.
+template <class T>
+class Generator : boost::noncopyable
+{
+public:
+    typedef boost::shared_ptr<Generator> ptr;
+
+public:
+    virtual ~Generator() {}
+
+    /// Produce the next value
+    /// @return false once the sequence is exhausted; value is unspecified
+    virtual bool next(T &value) = 0;
+};
+
+namespace Detail {
+
+template <class T>
+class FunctionGenerator : public Generator<T>
+{
+public:
+    FunctionGenerator(boost::function<bool (T &)> dg)
+        : m_dg(dg),
+          m_done(false)
+    {}
+
+    bool next(T &value)
+    {
+        if (m_done)
+            return false;
+        m_done = !m_dg(value);
+        return !m_done;
+    }
+
+private:
+    boost::function<bool (T &)> m_dg;
+    bool m_done;
+};
+
+template <class Iterator, class T>
+class RangeGenerator : public Generator<T>
+{
+public:
+    RangeGenerator(Iterator begin, Iterator end)
+        : m_it(begin),
+          m_end(end)
+    {}
+
+    bool next(T &value)
+    {
+        if (m_it == m_end)
+            return false;
+        value = *m_it++;
+        return true;
+    }
+
+private:
+    Iterator m_it, m_end;
+};
+
+template <class T>
+class CoroutineGenerator : public Generator<T>
+{
+public:
+    CoroutineGenerator(boost::function<void (Coroutine<T> &)> dg,
+        size_t stacksize)
+        : m_coroutine(dg, stacksize)
+    {}
+
+    bool next(T &value)
+    {
+        if (m_coroutine.state() == Fiber::TERM)
+            return false;
+        value = m_coroutine.call();
+        return m_coroutine.state() != Fiber::TERM;
+    }
+
+private:
+    Coroutine<T> m_coroutine;
+};
+
+template <class T, class U, class Functor>
+class MapGenerator : public Generator<U>
+{
+public:
+    MapGenerator(boost::shared_ptr<Generator<T> > source, Functor functor)
+        : m_source(source),
+          m_functor(functor),
+          m_value()
+    {}
+
+    bool next(U &value)
+    {
+        if (!m_source->next(m_value))
+            return false;
+        value = m_functor(m_value);
+        return true;
+    }
+
+private:
+    boost::shared_ptr<Generator<T> > m_source;
+    Functor m_functor;
+    T m_value;
+};
+
+template <class T, class Functor>
+class FilterGenerator : public Generator<T>
+{
+public:
+    FilterGenerator(boost::shared_ptr<Generator<T> > source, Functor functor)
+        : m_source(source),
+          m_functor(functor)
+    {}
+
+    bool next(T &value)
+    {
+        while (m_source->next(value)) {
+            if (m_functor(value))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    boost::shared_ptr<Generator<T> > m_source;
+    Functor m_functor;
+};
+
+}
+
+/// A Generator that calls dg for each value, until it returns false
+template <class T>
+typename Generator<T>::ptr
+functionGenerator(boost::function<bool (T &)> dg)
+{
+    MORDOR_ASSERT(dg);
+    return typename Generator<T>::ptr(new Detail::FunctionGenerator<T>(dg));
+}
+
+/// A Generator over the values in [begin, end), which must outlive it
+template <class T, class Iterator>
+typename Generator<T>::ptr
+rangeGenerator(Iterator begin, Iterator end)
+{
+    return typename Generator<T>::ptr(
+        new Detail::RangeGenerator<Iterator, T>(begin, end));
+}
+
+/// A Generator of everything dg yields, run as a Coroutine
+/// @param stacksize Passed to the Coroutine's Fiber
+template <class T>
+typename Generator<T>::ptr
+coroutineGenerator(boost::function<void (Coroutine<T> &)> dg,
+    size_t stacksize = 0)
+{
+    MORDOR_ASSERT(dg);
+    return typename Generator<T>::ptr(
+        new Detail::CoroutineGenerator<T>(dg, stacksize));
+}
+
+/// A Generator of functor(value) for each value of source
+/// @tparam U The type functor returns, which must be given explicitly
+template <class U, class T, class Functor>
+typename Generator<U>::ptr
+mapGenerator(boost::shared_ptr<Generator<T> > source, Functor functor)
+{
+    MORDOR_ASSERT(source);
+    return typename Generator<U>::ptr(
+        new Detail::MapGenerator<T, U, Functor>(source, functor));
+}
+
+/// A Generator of the values of source for which functor returns true
+template <class T, class Functor>
+typename Generator<T>::ptr
+filterGenerator(boost::shared_ptr<Generator<T> > source, Functor functor)
+{
+    MORDOR_ASSERT(source);
+    return typename Generator<T>::ptr(
+        new Detail::FilterGenerator<T, Functor>(source, functor));
+}
+
+}
+
+#endif
@@ -2,6 +2,8 @@
 #define __HTTP_BROKER_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <list>
+
 #include <openssl/ssl.h>
 
 #include "http.h"
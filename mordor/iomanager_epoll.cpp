@@ -7,22 +7,71 @@
 #include "iomanager_epoll.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <boost/exception_ptr.hpp>
 
 #include "assert.h"
 #include "atomic.h"
+#include "config.h"
 #include "fiber.h"
+#include "iomanager_uring.h"
+#include "statistics.h"
 
 // EPOLLRDHUP is missing in the header on etch
 #ifndef EPOLLRDHUP
 #define EPOLLRDHUP 0x2000
 #endif
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:iomanager");
 
+static ConfigVar<bool>::ptr g_ioUring = Config::lookup<bool>(
+    "iomanager.iouring", false,
+    "Use io_uring for socket and file I/O where the kernel supports it");
+static ConfigVar<unsigned int>::ptr g_ioUringEntries =
+    Config::lookup<unsigned int>("iomanager.iouring.entries", 256u,
+    "Submission queue size of each IOManager's io_uring");
+static ConfigVar<unsigned int>::ptr g_batchSize =
+    Config::lookup<unsigned int>("iomanager.epoll.batchsize", 64u,
+    "Maximum number of events each epoll_wait call returns");
+static ConfigVar<unsigned int>::ptr g_spinCount =
+    Config::lookup<unsigned int>("iomanager.epoll.spin", 0u,
+    "Number of times an idle thread polls for events without blocking "
+    "before it blocks in epoll_wait; it stops early if a timer comes due");
+
+static CountStatistic<unsigned long long> &g_statSpinHits =
+    Statistics::registerStatistic("iomanager.epoll.spinhits",
+    CountStatistic<unsigned long long>());
+static CountStatistic<unsigned long long> &g_statBlockingWaits =
+    Statistics::registerStatistic("iomanager.epoll.blockingwaits",
+    CountStatistic<unsigned long long>());
+
+struct IOManager::IoOp
+{
+    Scheduler *scheduler;
+    boost::shared_ptr<Fiber> fiber;
+    tid_t thread;
+    Scheduler::Priority priority;
+    unsigned long long deadline;
+    int result;
+};
+
+// Reschedule a waiter the way it was running when it started waiting
+template <class FiberOrDg>
+static void resume(Scheduler *scheduler, FiberOrDg fd, tid_t thread,
+    Scheduler::Priority priority, unsigned long long deadline)
+{
+    if (deadline != ~0ull)
+        scheduler->scheduleDeadline(fd, deadline, thread);
+    else
+        scheduler->schedule(fd, thread, priority);
+}
+
 enum epoll_ctl_op_t
 {
     epoll_ctl_op_t_dummy = 0x7ffffff
@@ -87,7 +136,12 @@ static std::ostream &operator <<(std::ostream &os, EPOLL_EVENTS events)
         os << "EPOLLRDHUP";
         one = true;
     }
-    events = (EPOLL_EVENTS)(events & ~(EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLERR | EPOLLHUP | EPOLLET | EPOLLONESHOT | EPOLLRDHUP));
+    if (events & EPOLLEXCLUSIVE) {
+        if (one) os << " | ";
+        os << "EPOLLEXCLUSIVE";
+        one = true;
+    }
+    events = (EPOLL_EVENTS)(events & ~(EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLERR | EPOLLHUP | EPOLLET | EPOLLONESHOT | EPOLLRDHUP | EPOLLEXCLUSIVE));
     if (events) {
         if (one) os << " | ";
         os << (uint32_t)events;
@@ -97,6 +151,8 @@ static std::ostream &operator <<(std::ostream &os, EPOLL_EVENTS events)
 
 IOManager::AsyncState::AsyncState()
     : m_fd(0),
+      m_epfd(-1),
+      m_thread(emptytid()),
       m_events(NONE)
 {}
 
@@ -130,11 +186,16 @@ IOManager::AsyncState::triggerEvent(Event event, size_t &pendingEventCount)
     atomicDecrement(pendingEventCount);
     EventContext &context = contextForEvent(event);
     if (context.dg) {
-        context.scheduler->schedule(&context.dg);
+        resume(context.scheduler, &context.dg, context.thread,
+            context.priority, context.deadline);
     } else {
-        context.scheduler->schedule(&context.fiber);
+        resume(context.scheduler, &context.fiber, context.thread,
+            context.priority, context.deadline);
     }
     context.scheduler = NULL;
+    context.thread = emptytid();
+    context.priority = Scheduler::NORMAL;
+    context.deadline = ~0ull;
     return true;
 }
 
@@ -164,76 +225,70 @@ IOManager::AsyncState::resetContext(EventContext &context)
     context.scheduler->schedule(boost::bind(
         &IOManager::AsyncState::asyncResetContext, this, context));
     context.scheduler = NULL;
+    context.thread = emptytid();
+    context.priority = Scheduler::NORMAL;
+    context.deadline = ~0ull;
     context.fiber.reset();
     context.dg = NULL;
 }
 
-IOManager::IOManager(size_t threads, bool useCaller, bool autoStart, size_t batchSize)
-    : Scheduler(threads, useCaller, batchSize),
-      m_pendingEventCount(0)
+IOManager::IOManager(size_t threads, bool useCaller, bool autoStart,
+    size_t batchSize, bool workStealing, bool sharded)
+    : Scheduler(threads, useCaller, batchSize, workStealing),
+      m_sharded(sharded),
+      m_ring(NULL),
+      m_epfd(-1),
+      m_pendingTickles(0),
+      m_pendingEventCount(0),
+      m_nextShard(0)
 {
-    m_epfd = epoll_create(5000);
-    MORDOR_LOG_LEVEL(g_log, m_epfd <= 0 ? Log::ERROR : Log::TRACE) << this
-        << " epoll_create(5000): " << m_epfd;
-    if (m_epfd <= 0)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
-    int rc = pipe(m_tickleFds);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this << " pipe(): "
-        << rc << " (" << lastError() << ")";
-    if (rc) {
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("pipe");
-    }
-    MORDOR_ASSERT(m_tickleFds[0] > 0);
-    MORDOR_ASSERT(m_tickleFds[1] > 0);
-    epoll_event event;
-    memset(&event, 0, sizeof(epoll_event));
-    event.events = EPOLLIN | EPOLLET;
-    event.data.fd = m_tickleFds[0];
-    rc = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);
-    if (rc == -1) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
-    }
-    rc = fcntl(m_tickleFds[1], F_SETFL, O_NONBLOCK);
-    if (rc == -1) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("fcntl");
-    }
-    rc = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", EPOLL_CTL_ADD, " << m_tickleFds[0]
-        << ", EPOLLIN | EPOLLET): " << rc << " (" << lastError() << ")";
-    if (rc) {
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-        close(m_epfd);
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
-    }
-    if (autoStart) {
-        try {
-            start();
-        } catch (...) {
-            close(m_tickleFds[0]);
-            close(m_tickleFds[1]);
-            close(m_epfd);
-            throw;
+    // In semaphore mode every read() consumes exactly one tickle, so a
+    // single tickle can't be swallowed by a thread that was already awake
+    // on behalf of another one
+    m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+    MORDOR_LOG_LEVEL(g_log, m_tickleFd < 0 ? Log::ERROR : Log::VERBOSE) << this
+        << " eventfd(): " << m_tickleFd << " (" << lastError() << ")";
+    if (m_tickleFd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("eventfd");
+    try {
+        if (g_ioUring->val()) {
+            try {
+                m_ring = new IOUring(g_ioUringEntries->val());
+            } catch (NativeException &) {
+                MORDOR_LOG_INFO(g_log) << this
+                    << " io_uring unavailable; using epoll only";
+            }
         }
+        if (sharded) {
+            // One per thread to begin with; each thread claims one the
+            // first time it needs it
+            m_shards.reserve(threadCount());
+            for (size_t i = 0; i < threadCount(); ++i) {
+                int epfd = createEpoll(true);
+                Shard *shard = new Shard();
+                shard->epfd = epfd;
+                shard->thread = emptytid();
+                m_shards.push_back(shard);
+            }
+            // The root thread keeps its set for good; it's the same thread
+            // across every stop() and start()
+            if (rootThreadId() != emptytid())
+                m_shards[0]->thread = rootThreadId();
+        } else {
+            m_epfd = createEpoll(false);
+        }
+        if (autoStart)
+            start();
+    } catch (...) {
+        closeFds();
+        throw;
     }
 }
 
 IOManager::~IOManager()
 {
     stop();
-    close(m_epfd);
-    MORDOR_LOG_TRACE(g_log) << this << " close(" << m_epfd << ")";
-    close(m_tickleFds[0]);
-    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFds[0] << ")";
-    close(m_tickleFds[1]);
+    closeFds();
     // Yes, it would be more C++-esque to store a boost::shared_ptr in the
     // vector, but that requires an extra allocation per fd for the counter
     for (size_t i = 0; i < m_pendingEvents.size(); ++i) {
@@ -242,6 +297,199 @@ IOManager::~IOManager()
     }
 }
 
+int
+IOManager::createEpoll(bool exclusive)
+{
+    int epfd = epoll_create(5000);
+    MORDOR_LOG_LEVEL(g_log, epfd <= 0 ? Log::ERROR : Log::TRACE) << this
+        << " epoll_create(5000): " << epfd;
+    if (epfd <= 0)
+        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_create");
+    // Level triggered, so that while tickles (or completions) are
+    // outstanding epoll keeps handing the fd to one more waiting thread at a
+    // time.  When the fd is in every thread's epoll set, EPOLLEXCLUSIVE keeps
+    // it from waking all of them
+    int fds[] = { m_tickleFd, m_ring ? m_ring->fd() : -1 };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]) && fds[i] >= 0; ++i) {
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0);
+        event.data.fd = fds[i];
+        int rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event);
+        if (rc && errno == EINVAL && exclusive) {
+            // Kernels older than 4.5 don't know EPOLLEXCLUSIVE; every idle
+            // thread will wake, but only one of them will get anything
+            event.events = EPOLLIN;
+            rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &event);
+        }
+        error_t error = lastError();
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << epfd << ", EPOLL_CTL_ADD, " << fds[i]
+            << ", " << (EPOLL_EVENTS)event.events << "): " << rc << " ("
+            << error << ")";
+        if (rc) {
+            close(epfd);
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "epoll_ctl");
+        }
+    }
+    return epfd;
+}
+
+void
+IOManager::closeFds()
+{
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        close(m_shards[i]->epfd);
+        MORDOR_LOG_TRACE(g_log) << this << " close(" << m_shards[i]->epfd
+            << ")";
+        delete m_shards[i];
+    }
+    m_shards.clear();
+    if (m_epfd >= 0) {
+        close(m_epfd);
+        MORDOR_LOG_TRACE(g_log) << this << " close(" << m_epfd << ")";
+        m_epfd = -1;
+    }
+    delete m_ring;
+    m_ring = NULL;
+    close(m_tickleFd);
+    MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_tickleFd << ")";
+}
+
+IOManager::AsyncState &
+IOManager::asyncState(int fd)
+{
+    if (m_pendingEvents.size() < (size_t)fd)
+        m_pendingEvents.resize(fd * 3 / 2);
+    if (!m_pendingEvents[fd - 1]) {
+        m_pendingEvents[fd - 1] = new AsyncState();
+        m_pendingEvents[fd - 1]->m_fd = fd;
+        m_pendingEvents[fd - 1]->m_epfd = m_epfd;
+    }
+    AsyncState &state = *m_pendingEvents[fd - 1];
+    MORDOR_ASSERT(fd == state.m_fd);
+    return state;
+}
+
+IOManager::Shard *
+IOManager::localShard()
+{
+    tid_t thread = gettid();
+    Shard *unclaimed = NULL;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        if (m_shards[i]->thread == thread)
+            return m_shards[i];
+        if (!unclaimed && m_shards[i]->thread == emptytid())
+            unclaimed = m_shards[i];
+    }
+    if (!unclaimed) {
+        // threadCount() has been raised since we were constructed
+        m_shards.reserve(m_shards.size() + 1);
+        int epfd = createEpoll(true);
+        unclaimed = new Shard();
+        unclaimed->epfd = epfd;
+        m_shards.push_back(unclaimed);
+    }
+    unclaimed->thread = thread;
+    MORDOR_LOG_DEBUG(g_log) << this << " thread " << thread
+        << " claimed epoll set " << unclaimed->epfd;
+    return unclaimed;
+}
+
+IOManager::Shard *
+IOManager::homeShard()
+{
+    tid_t root = rootThreadId();
+    // The root thread only polls while its caller is inside the Scheduler,
+    // so it only keeps the fds it registers when there's nobody else
+    if (Scheduler::getThis() == this &&
+        (gettid() != root || threadCount() == 1))
+        return localShard();
+    // Otherwise spread fds over the threads that are already polling, or
+    // over the sets that the next threads to start will claim
+    size_t count = m_shards.size();
+    Shard *unclaimed = NULL, *rootShard = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        Shard *shard = m_shards[m_nextShard++ % count];
+        if (shard->thread == emptytid()) {
+            if (!unclaimed)
+                unclaimed = shard;
+        } else if (shard->thread == root) {
+            rootShard = shard;
+        } else {
+            return shard;
+        }
+    }
+    return unclaimed ? unclaimed : rootShard;
+}
+
+void
+IOManager::releaseShard(Shard *shard)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    MORDOR_ASSERT(shard->thread == gettid());
+    MORDOR_ASSERT(shard->thread != rootThreadId());
+    shard->thread = emptytid();
+    Shard *target = NULL;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        if (m_shards[i]->thread != emptytid() &&
+            m_shards[i]->thread != rootThreadId()) {
+            target = m_shards[i];
+            break;
+        }
+    }
+    // With nobody else polling, the fds stay in this set for whichever
+    // thread claims it next, and their waiters resume wherever they can;
+    // they must not wait for this thread, which is going away
+    tid_t thread = target ? target->thread : emptytid();
+    boost::exception_ptr exception;
+    for (size_t i = 0; i < m_pendingEvents.size(); ++i) {
+        AsyncState *state = m_pendingEvents[i];
+        if (!state)
+            continue;
+        boost::mutex::scoped_lock lock2(state->m_mutex);
+        if (state->m_epfd != shard->epfd)
+            continue;
+        state->m_thread = thread;
+        AsyncState::EventContext *contexts[] =
+            { &state->m_in, &state->m_out, &state->m_close };
+        for (size_t j = 0; j < sizeof(contexts) / sizeof(contexts[0]); ++j) {
+            if (contexts[j]->scheduler == this)
+                contexts[j]->thread = thread;
+        }
+        if (!target)
+            continue;
+        state->m_epfd = target->epfd;
+        if (!state->m_events)
+            continue;
+        // Re-adding an edge triggered fd reports it if it's already ready,
+        // so nothing that arrived in between is lost
+        epoll_event event;
+        event.events = EPOLLET | state->m_events;
+        event.data.ptr = state;
+        int rc = epoll_ctl(shard->epfd, EPOLL_CTL_DEL, state->m_fd, &event);
+        MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+            << " epoll_ctl(" << shard->epfd << ", EPOLL_CTL_DEL, "
+            << state->m_fd << "): " << rc << " (" << lastError() << ")";
+        if (!rc) {
+            rc = epoll_ctl(target->epfd, EPOLL_CTL_ADD, state->m_fd, &event);
+            MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
+                << " epoll_ctl(" << target->epfd << ", EPOLL_CTL_ADD, "
+                << state->m_fd << ", " << (EPOLL_EVENTS)event.events << "): "
+                << rc << " (" << lastError() << ")";
+        }
+        if (rc) {
+            try {
+                MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_ctl");
+            } catch (boost::exception &) {
+                exception = boost::current_exception();
+            }
+        }
+    }
+    if (exception)
+        boost::rethrow_exception(exception);
+}
+
 bool
 IOManager::stopping()
 {
@@ -259,26 +507,29 @@ IOManager::registerEvent(int fd, Event event, boost::function<void ()> dg)
 
     // Look up our state in the global map, expanding it if necessary
     boost::mutex::scoped_lock lock(m_mutex);
-    if (m_pendingEvents.size() < (size_t)fd)
-        m_pendingEvents.resize(fd * 3 / 2);
-    if (!m_pendingEvents[fd - 1]) {
-        m_pendingEvents[fd - 1] = new AsyncState();
-        m_pendingEvents[fd - 1]->m_fd = fd;
-    }
-    AsyncState &state = *m_pendingEvents[fd - 1];
-    MORDOR_ASSERT(fd == state.m_fd);
+    AsyncState &state = asyncState(fd);
+    Shard *home = m_sharded ? homeShard() : NULL;
+    // Keep m_mutex until we have the state, so releaseShard can't move the
+    // fd out from under us
+    boost::mutex::scoped_lock lock2(state.m_mutex);
     lock.unlock();
 
-    boost::mutex::scoped_lock lock2(state.m_mutex);
+    // With nothing else registered the fd isn't in any epoll set, so it's
+    // free to move to a new home
+    if (home && !state.m_events) {
+        state.m_epfd = home->epfd;
+        state.m_thread = home->thread;
+    }
 
     MORDOR_ASSERT(!(state.m_events & event));
+    MORDOR_ASSERT(!state.contextForEvent(event).op);
     int op = state.m_events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     epoll_event epevent;
     epevent.events = EPOLLET | state.m_events | event;
     epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rc = epoll_ctl(state.m_epfd, op, fd, &epevent);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+        << " epoll_ctl(" << state.m_epfd << ", " << (epoll_ctl_op_t)op << ", "
         << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
         << " (" << lastError() << ")";
     if (rc)
@@ -290,6 +541,11 @@ IOManager::registerEvent(int fd, Event event, boost::function<void ()> dg)
     MORDOR_ASSERT(!context.fiber);
     MORDOR_ASSERT(!context.dg);
     context.scheduler = Scheduler::getThis();
+    if (context.scheduler == this)
+        context.thread = state.m_thread;
+    // Latency sensitive work stays latency sensitive across its waits
+    context.priority = Scheduler::currentPriority();
+    context.deadline = Scheduler::currentDeadline();
     if (dg) {
         context.dg.swap(dg);
     } else {
@@ -322,9 +578,9 @@ IOManager::unregisterEvent(int fd, Event event)
     epoll_event epevent;
     epevent.events = EPOLLET | newEvents;
     epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rc = epoll_ctl(state.m_epfd, op, fd, &epevent);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+        << " epoll_ctl(" << state.m_epfd << ", " << (epoll_ctl_op_t)op << ", "
         << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
         << " (" << lastError() << ")";
     if (rc)
@@ -353,6 +609,14 @@ IOManager::cancelEvent(int fd, Event event)
     lock.unlock();
 
     boost::mutex::scoped_lock lock2(state.m_mutex);
+    AsyncState::EventContext &context = state.contextForEvent(event);
+    if (context.op) {
+        // The operation still completes like any other (most likely with
+        // ECANCELED), and that resumes whoever is waiting for it
+        MORDOR_ASSERT(m_ring);
+        return m_ring->submit(IOUring::CANCEL, -1, context.op, 0, 0, 0, 0)
+            == 0;
+    }
     if (!(state.m_events & event))
         return false;
 
@@ -362,9 +626,9 @@ IOManager::cancelEvent(int fd, Event event)
     epoll_event epevent;
     epevent.events = EPOLLET | newEvents;
     epevent.data.ptr = &state;
-    int rc = epoll_ctl(m_epfd, op, fd, &epevent);
+    int rc = epoll_ctl(state.m_epfd, op, fd, &epevent);
     MORDOR_LOG_LEVEL(g_log, rc ? Log::ERROR : Log::VERBOSE) << this
-        << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+        << " epoll_ctl(" << state.m_epfd << ", " << (epoll_ctl_op_t)op << ", "
         << fd << ", " << (EPOLL_EVENTS)epevent.events << "): " << rc
         << " (" << lastError() << ")";
     if (rc)
@@ -373,6 +637,111 @@ IOManager::cancelEvent(int fd, Event event)
     return true;
 }
 
+int
+IOManager::asyncRecvmsg(int fd, msghdr *msg, int flags)
+{
+    return performIo(fd, READ, IOUring::RECVMSG, msg, 1, 0, flags);
+}
+
+int
+IOManager::asyncSendmsg(int fd, const msghdr *msg, int flags)
+{
+    return performIo(fd, WRITE, IOUring::SENDMSG, msg, 1, 0, flags);
+}
+
+int
+IOManager::asyncAccept(int fd, sockaddr *addr, socklen_t *addrlen)
+{
+    return performIo(fd, READ, IOUring::ACCEPT, addr, 0,
+        (unsigned long long)(uintptr_t)addrlen, 0);
+}
+
+int
+IOManager::asyncConnect(int fd, const sockaddr *addr, socklen_t addrlen)
+{
+    return performIo(fd, WRITE, IOUring::CONNECT, addr, 0, addrlen, 0);
+}
+
+int
+IOManager::asyncReadv(int fd, const iovec *iov, int iovcnt, long long offset)
+{
+    return performIo(fd, READ, IOUring::READV, iov, iovcnt,
+        (unsigned long long)offset, 0);
+}
+
+int
+IOManager::asyncWritev(int fd, const iovec *iov, int iovcnt, long long offset)
+{
+    return performIo(fd, WRITE, IOUring::WRITEV, iov, iovcnt,
+        (unsigned long long)offset, 0);
+}
+
+int
+IOManager::performIo(int fd, Event event, int opcode, const void *addr,
+    unsigned int len, unsigned long long offset, unsigned int flags)
+{
+    MORDOR_ASSERT(m_ring);
+    MORDOR_ASSERT(fd > 0);
+    MORDOR_ASSERT(Scheduler::getThis());
+    MORDOR_ASSERT(event == READ || event == WRITE);
+
+    // Lives on our stack until the completion resumes us
+    IoOp op;
+    op.scheduler = Scheduler::getThis();
+    op.fiber = Fiber::getThis();
+    // In sharded mode, stay on this thread, like an fd's home thread
+    op.thread = m_sharded && op.scheduler == this ? gettid() : emptytid();
+    op.priority = Scheduler::currentPriority();
+    op.deadline = Scheduler::currentDeadline();
+    op.result = 0;
+
+    boost::mutex::scoped_lock lock(m_mutex);
+    AsyncState &state = asyncState(fd);
+    lock.unlock();
+    {
+        boost::mutex::scoped_lock lock2(state.m_mutex);
+        AsyncState::EventContext &context = state.contextForEvent(event);
+        MORDOR_ASSERT(!(state.m_events & event));
+        MORDOR_ASSERT(!context.op);
+        atomicIncrement(m_pendingEventCount);
+        int rc = m_ring->submit((IOUring::Opcode)opcode, fd, addr, len,
+            offset, flags, (unsigned long long)(uintptr_t)&op);
+        if (rc) {
+            atomicDecrement(m_pendingEventCount);
+            return rc;
+        }
+        context.op = &op;
+    }
+    Scheduler::yieldTo();
+    boost::mutex::scoped_lock lock2(state.m_mutex);
+    AsyncState::EventContext &context = state.contextForEvent(event);
+    MORDOR_ASSERT(context.op == &op);
+    context.op = NULL;
+    return op.result;
+}
+
+void
+IOManager::reapCompletions()
+{
+    IOUring::Completion completions[64];
+    size_t count;
+    do {
+        count = m_ring->reap(completions, 64);
+        for (size_t i = 0; i < count; ++i) {
+            // Cancellations are submitted without an IoOp
+            if (!completions[i].userData)
+                continue;
+            IoOp *op = (IoOp *)(uintptr_t)completions[i].userData;
+            op->result = completions[i].result;
+            atomicDecrement(m_pendingEventCount);
+            // op goes away as soon as its Fiber runs again, so this must be
+            // the last thing we do with it
+            resume(op->scheduler, &op->fiber, op->thread, op->priority,
+                op->deadline);
+        }
+    } while (count == sizeof(completions) / sizeof(completions[0]));
+}
+
 bool
 IOManager::stopping(unsigned long long &nextTimeout)
 {
@@ -384,27 +753,63 @@ IOManager::stopping(unsigned long long &nextTimeout)
 void
 IOManager::idle()
 {
-    epoll_event events[64];
+    // Sampled once per idle Fiber; changes apply to threads as they next go
+    // idle
+    const int batchSize = (int)std::max(1u, g_batchSize->val());
+    const unsigned int spinCount = g_spinCount->val();
+    std::vector<epoll_event> events(batchSize);
+    Shard *shard = NULL;
+    if (m_sharded) {
+        boost::mutex::scoped_lock lock(m_mutex);
+        shard = localShard();
+    }
+    int epfd = shard ? shard->epfd : m_epfd;
     while (true) {
         unsigned long long nextTimeout;
-        if (stopping(nextTimeout))
+        if (stopping(nextTimeout)) {
+            // Worker threads exit when we stop; a later start() gets new ones
+            if (shard && gettid() != rootThreadId())
+                releaseShard(shard);
             return;
-        int rc;
+        }
+        int rc = 0;
         int timeout;
-        do {
-            if (nextTimeout != ~0ull)
-                timeout = (int)(nextTimeout / 1000) + 1;
-            else
-                timeout = -1;
-            rc = epoll_wait(m_epfd, events, 64, timeout);
-            if (rc < 0 && errno == EINTR)
+        // Poll for a while before blocking, trading CPU for not having to be
+        // woken up.  Never spin past the next timer (or at all if one is
+        // already due), and don't block past it either
+        timeout = 0;
+        if (spinCount != 0 && nextTimeout != 0) {
+            unsigned long long start = TimerManager::now();
+            for (unsigned int i = 0; i < spinCount && rc == 0; ++i) {
+                rc = epoll_wait(epfd, &events[0], batchSize, 0);
+                if (rc < 0 && errno == EINTR)
+                    rc = 0;
+                if (rc == 0 && nextTimeout != ~0ull &&
+                    TimerManager::now() - start >= nextTimeout)
+                    break;
+            }
+            if (rc > 0)
+                g_statSpinHits.increment();
+            else if (nextTimeout != ~0ull)
                 nextTimeout = nextTimer();
-            else
-                break;
-        } while (true);
+        }
+        if (rc == 0 && nextTimeout != 0) {
+            g_statBlockingWaits.increment();
+            do {
+                if (nextTimeout != ~0ull)
+                    timeout = (int)(nextTimeout / 1000) + 1;
+                else
+                    timeout = -1;
+                rc = epoll_wait(epfd, &events[0], batchSize, timeout);
+                if (rc < 0 && errno == EINTR)
+                    nextTimeout = nextTimer();
+                else
+                    break;
+            } while (true);
+        }
         MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::VERBOSE) << this
-            << " epoll_wait(" << m_epfd << ", 64, " << timeout << "): " << rc
-            << " (" << lastError() << ")";
+            << " epoll_wait(" << epfd << ", " << batchSize << ", " << timeout
+            << "): " << rc << " (" << lastError() << ")";
         if (rc < 0)
             MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("epoll_wait");
         std::vector<boost::function<void ()> > expired = processTimers();
@@ -416,16 +821,19 @@ IOManager::idle()
         boost::exception_ptr exception;
         for(int i = 0; i < rc; ++i) {
             epoll_event &event = events[i];
-            if (event.data.fd == m_tickleFds[0]) {
-                unsigned char dummy[256];
-                int rc2;
-                // every tickle write only 1 byte
-                // but it does not have to be read by 1 byte
-                // try to read more to save read() syscall
-                while((rc2 = read(m_tickleFds[0], dummy, 256)) > 0) {
-                    MORDOR_LOG_VERBOSE(g_log) << this << " received " << rc2 << " tickles";
-                }
-                MORDOR_VERIFY(rc2 < 0 && errno == EAGAIN);
+            if (event.data.fd == m_tickleFd) {
+                // Take only our own tickle; any others are for other threads
+                uint64_t dummy;
+                int rc2 = read(m_tickleFd, &dummy, sizeof(dummy));
+                MORDOR_LOG_VERBOSE(g_log) << this << " read(" << m_tickleFd
+                    << ", 8): " << rc2 << " (" << lastError() << ")";
+                MORDOR_VERIFY(rc2 == sizeof(dummy) || (rc2 < 0 && errno == EAGAIN));
+                if (rc2 == sizeof(dummy))
+                    atomicDecrement(m_pendingTickles);
+                continue;
+            }
+            if (m_ring && event.data.fd == m_ring->fd()) {
+                reapCompletions();
                 continue;
             }
 
@@ -456,9 +864,9 @@ IOManager::idle()
             int remainingEvents = (state.m_events & ~incomingEvents);
             int op = remainingEvents ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
             event.events = EPOLLET | remainingEvents;
-            int rc2 = epoll_ctl(m_epfd, op, state.m_fd, &event);
+            int rc2 = epoll_ctl(state.m_epfd, op, state.m_fd, &event);
             MORDOR_LOG_LEVEL(g_log, rc2 ? Log::ERROR : Log::VERBOSE) << this
-                << " epoll_ctl(" << m_epfd << ", " << (epoll_ctl_op_t)op << ", "
+                << " epoll_ctl(" << state.m_epfd << ", " << (epoll_ctl_op_t)op << ", "
                 << state.m_fd << ", " << (EPOLL_EVENTS)event.events << "): " << rc2
                 << " (" << lastError() << ")";
             if (rc2) {
@@ -483,6 +891,9 @@ IOManager::idle()
         try {
             Fiber::yield();
         } catch (OperationAbortedException &) {
+            // This thread is going away
+            if (shard)
+                releaseShard(shard);
             return;
         }
     }
@@ -491,14 +902,23 @@ IOManager::idle()
 void
 IOManager::tickle()
 {
-    if (!hasIdleThreads()) {
-        MORDOR_LOG_VERBOSE(g_log) << this << " 0 idle thread, no tickle.";
-        return;
-    }
-    int rc = write(m_tickleFds[1], "T", 1);
-    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFds[1] << ", 1): "
+    // Wake exactly one more idle thread, unless every idle thread already
+    // has a tickle on its way
+    size_t pending = m_pendingTickles, seen;
+    do {
+        if (pending >= idleThreadCount()) {
+            MORDOR_LOG_VERBOSE(g_log) << this << " " << pending
+                << " tickles already pending, no tickle.";
+            return;
+        }
+        seen = pending;
+        pending = atomicCompareAndSwap(m_pendingTickles, seen + 1, seen);
+    } while (pending != seen);
+    uint64_t one = 1;
+    int rc = write(m_tickleFd, &one, sizeof(one));
+    MORDOR_LOG_VERBOSE(g_log) << this << " write(" << m_tickleFd << ", 8): "
         << rc << " (" << lastError() << ")";
-    MORDOR_VERIFY(rc == 1 || (rc < 0 && errno == EAGAIN));
+    MORDOR_VERIFY(rc == sizeof(one));
 }
 
 }
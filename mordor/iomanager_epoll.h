@@ -2,6 +2,9 @@
 #define __MORDOR_IOMANAGER_EPOLL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+
 #include "scheduler.h"
 #include "timer.h"
 #include "version.h"
@@ -13,6 +16,7 @@
 namespace Mordor {
 
 class Fiber;
+class IOUring;
 
 class IOManager : public Scheduler, public TimerManager
 {
@@ -25,6 +29,8 @@ public:
     };
 
 private:
+    struct IoOp;
+
     struct AsyncState : boost::noncopyable
     {
         AsyncState();
@@ -32,10 +38,20 @@ private:
 
         struct EventContext
         {
-            EventContext() : scheduler(NULL) {}
+            EventContext()
+                : scheduler(NULL), thread(emptytid()),
+                  priority(Scheduler::NORMAL), deadline(~0ull), op(NULL)
+            {}
             Scheduler *scheduler;
+            // Thread to resume on; the fd's home thread in sharded mode
+            tid_t thread;
+            // Inherited from whoever registered
+            Scheduler::Priority priority;
+            unsigned long long deadline;
             boost::shared_ptr<Fiber> fiber;
             boost::function<void ()> dg;
+            // Completion-based I/O in flight, instead of a registration
+            IoOp *op;
         };
 
         EventContext &contextForEvent(Event event);
@@ -43,6 +59,10 @@ private:
         void resetContext(EventContext &);
 
         int m_fd;
+        // The epoll set m_fd is (or will next be) registered in
+        int m_epfd;
+        // Home thread in sharded mode; emptytid() otherwise
+        tid_t m_thread;
         EventContext m_in, m_out, m_close;
         Event m_events;
         boost::mutex m_mutex;
@@ -55,11 +75,52 @@ public:
     /// @param autoStart  whether call the start() automatically in constructor
     /// @note @p autoStart provides a more friendly behavior for derived class
     ///      that inherits from IOManager
-    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true, size_t batchSize = 1);
+    /// @param workStealing see Scheduler::Scheduler
+    /// @param sharded If each thread should wait on its own epoll set instead
+    /// of every thread sharing one.  An fd is homed on the thread that
+    /// registers it while it has no other events registered (or spread
+    /// across the worker threads if registered from outside the IOManager,
+    /// or from the useCaller thread, which only polls while its caller is
+    /// in the Scheduler), and its events resume the waiting Fiber or dg on
+    /// that home thread
+    IOManager(size_t threads = 1, bool useCaller = true, bool autoStart = true,
+        size_t batchSize = 1, bool workStealing = false, bool sharded = false);
     ~IOManager();
 
     bool stopping();
 
+    /// If this IOManager was constructed with per-thread epoll sets
+    bool sharded() const { return m_sharded; }
+
+    /// If the async*() functions are available
+
+    /// They are when iomanager.iouring is set and the kernel supports
+    /// io_uring (Linux 5.7 or later); otherwise everything goes through
+    /// epoll
+    bool completionIo() const { return m_ring != NULL; }
+
+    /// Completion-based versions of the syscalls of the same names
+
+    /// Each of these hands the operation to the kernel, suspends the current
+    /// Fiber until it finishes, and returns what the syscall would have
+    /// returned, or -errno.  An operation counts as a registration of READ
+    /// (or WRITE, for asyncSendmsg, asyncConnect and asyncWritev) on fd, so
+    /// cancelEvent() aborts it with -ECANCELED (though it may still have
+    /// completed first).
+    /// @pre completionIo()
+    int asyncRecvmsg(int fd, msghdr *msg, int flags);
+    int asyncSendmsg(int fd, const msghdr *msg, int flags);
+    int asyncAccept(int fd, sockaddr *addr, socklen_t *addrlen);
+    int asyncConnect(int fd, const sockaddr *addr, socklen_t addrlen);
+    /// @param offset Where in the file to start, or -1 for the current
+    /// position (which is then advanced)
+    int asyncReadv(int fd, const iovec *iov, int iovcnt,
+        long long offset = -1);
+    int asyncWritev(int fd, const iovec *iov, int iovcnt,
+        long long offset = -1);
+
+    /// The Fiber (or dg) is rescheduled with the Scheduler::currentPriority()
+    /// and Scheduler::currentDeadline() of whoever registered
     void registerEvent(int fd, Event events,
         boost::function<void ()> dg = NULL);
     /// Will not cause the event to fire
@@ -74,13 +135,58 @@ protected:
     void tickle();
 
     void onTimerInsertedAtFront() { tickle(); }
+    // Keep a busy thread's coarse clock from going stale
+    void onBusy() { refreshCoarseClock(); }
+
+private:
+    /// A thread's own epoll set in sharded mode
+    struct Shard
+    {
+        int epfd;
+        // emptytid() until a thread claims it
+        tid_t thread;
+    };
+
+    /// Create an epoll set with the tickle fd in it
+    int createEpoll(bool exclusive);
+    /// Close every epoll set and the tickle fd
+    void closeFds();
+    /// @return The state for fd, creating it if necessary
+    /// @pre m_mutex is locked
+    AsyncState &asyncState(int fd);
+    /// Submit opcode (an IOUring::Opcode) on behalf of the current Fiber,
+    /// and wait for it to complete
+    int performIo(int fd, Event event, int opcode, const void *addr,
+        unsigned int len, unsigned long long offset, unsigned int flags);
+    /// Resume the Fibers whose io_uring operations have completed
+    void reapCompletions();
+    /// @return The current thread's Shard, claiming or creating one if
+    /// needed
+    /// @pre m_mutex is locked
+    Shard *localShard();
+    /// @return The Shard a newly registered fd should be homed on
+    /// @pre m_mutex is locked
+    Shard *homeShard();
+    /// Give up the current (exiting) worker thread's Shard, moving the fds
+    /// homed on it to another worker thread, if there is one
+    void releaseShard(Shard *shard);
 
 private:
+    bool m_sharded;
+    // NULL unless completion-based I/O is in use
+    IOUring *m_ring;
+    // Shared by all threads; -1 in sharded mode
     int m_epfd;
-    int m_tickleFds[2];
+    // eventfd in semaphore mode; each unit wakes one idle thread
+    int m_tickleFd;
+    // Units written to m_tickleFd that no thread has consumed yet
+    volatile size_t m_pendingTickles;
     size_t m_pendingEventCount;
     boost::mutex m_mutex;
     std::vector<AsyncState *> m_pendingEvents;
+    // Protected by m_mutex; never shrinks, so a Shard * stays valid
+    std::vector<Shard *> m_shards;
+    size_t m_nextShard;
 };
 
 }
@@ -143,6 +143,8 @@ protected:
     // adjust the timeout value in its blocking call to GetQueuedCompletionStatusEx
     // so that it doesn't miss the timer
     void onTimerInsertedAtFront() { tickle(); }
+    // Keep a busy thread's coarse clock from going stale
+    void onBusy() { refreshCoarseClock(); }
 
 private:
     HANDLE m_hCompletionPort;
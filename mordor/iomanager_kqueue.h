@@ -52,6 +52,8 @@ protected:
     void tickle();
 
     void onTimerInsertedAtFront() { tickle(); }
+    // Keep a busy thread's coarse clock from going stale
+    void onBusy() { refreshCoarseClock(); }
 
 private:
     int m_kqfd;
@@ -0,0 +1,231 @@
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include "pch.h"
+
+#ifdef LINUX
+
+#include "iomanager_uring.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "assert.h"
+#include "exception.h"
+#include "log.h"
+
+// Everything we need arrived by 5.7; with older headers, always fall back
+// to epoll
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_FAST_POLL) && \
+    defined(__NR_io_uring_setup)
+#define MORDOR_IO_URING
+#endif
+
+namespace Mordor {
+
+static Logger::ptr g_log = Log::lookup("mordor:iomanager");
+
+#ifdef MORDOR_IO_URING
+
+static void *mapRing(int fd, size_t size, off_t offset)
+{
+    return mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, offset);
+}
+
+IOUring::IOUring(unsigned int entries)
+    : m_fd(-1),
+      m_sqRing(MAP_FAILED),
+      m_cqRing(MAP_FAILED),
+      m_sqes(MAP_FAILED)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    m_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, m_fd < 0 ? Log::INFO : Log::VERBOSE) << this
+        << " io_uring_setup(" << entries << "): " << m_fd << " (" << error
+        << ")";
+    if (m_fd < 0)
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "io_uring_setup");
+    // NODROP so that completions can never be lost, RW_CUR_POS to read and
+    // write at the current file position, and FAST_POLL so that socket
+    // operations wait for readiness instead of failing with EAGAIN
+    const unsigned int required = IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS |
+        IORING_FEAT_FAST_POLL;
+    if ((params.features & required) != required) {
+        MORDOR_LOG_INFO(g_log) << this << " io_uring features " << std::hex
+            << params.features << ", need " << required;
+        destroy();
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(ENOSYS, "io_uring_setup");
+    }
+
+    m_sqEntries = params.sq_entries;
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqRing = mapRing(m_fd, m_sqRingSize, IORING_OFF_SQ_RING);
+    if (m_sqRing != MAP_FAILED)
+        m_cqRing = mapRing(m_fd, m_cqRingSize, IORING_OFF_CQ_RING);
+    if (m_cqRing != MAP_FAILED)
+        m_sqes = mapRing(m_fd, m_sqesSize, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        error = lastError();
+        destroy();
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "mmap");
+    }
+
+    char *sq = (char *)m_sqRing, *cq = (char *)m_cqRing;
+    m_sqHead = (unsigned int *)(sq + params.sq_off.head);
+    m_sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    m_sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    m_sqFlags = (unsigned int *)(sq + params.sq_off.flags);
+    m_sqArray = (unsigned int *)(sq + params.sq_off.array);
+    m_cqHead = (unsigned int *)(cq + params.cq_off.head);
+    m_cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    m_cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    m_cqes = cq + params.cq_off.cqes;
+}
+
+IOUring::~IOUring()
+{
+    destroy();
+}
+
+void
+IOUring::destroy()
+{
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqesSize);
+    if (m_cqRing != MAP_FAILED)
+        munmap(m_cqRing, m_cqRingSize);
+    if (m_sqRing != MAP_FAILED)
+        munmap(m_sqRing, m_sqRingSize);
+    m_sqes = m_cqRing = m_sqRing = MAP_FAILED;
+    if (m_fd >= 0) {
+        close(m_fd);
+        MORDOR_LOG_VERBOSE(g_log) << this << " close(" << m_fd << ")";
+        m_fd = -1;
+    }
+}
+
+int
+IOUring::submit(Opcode opcode, int fd, const void *addr, unsigned int len,
+    unsigned long long offset, unsigned int flags,
+    unsigned long long userData)
+{
+    static const unsigned char opcodes[] = {
+        IORING_OP_RECVMSG,
+        IORING_OP_SENDMSG,
+        IORING_OP_ACCEPT,
+        IORING_OP_CONNECT,
+        IORING_OP_READV,
+        IORING_OP_WRITEV,
+        IORING_OP_ASYNC_CANCEL
+    };
+    MORDOR_ASSERT((size_t)opcode < sizeof(opcodes));
+
+    boost::mutex::scoped_lock lock(m_submitMutex);
+    unsigned int tail = *m_sqTail;
+    // We submit everything as soon as it's queued, and without SQPOLL the
+    // kernel consumes it during io_uring_enter, so the queue is always
+    // empty here
+    MORDOR_ASSERT(tail == __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE));
+    unsigned int index = tail & *m_sqMask;
+    io_uring_sqe *sqe = (io_uring_sqe *)m_sqes + index;
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = opcodes[opcode];
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->rw_flags = flags;
+    sqe->user_data = userData;
+    m_sqArray[index] = index;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int rc;
+    do {
+        rc = (int)syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, rc == 1 ? Log::VERBOSE : Log::ERROR) << this
+        << " io_uring_enter(" << m_fd << ", " << (int)sqe->opcode << ", "
+        << fd << ", " << userData << "): " << rc << " (" << error << ")";
+    if (rc != 1) {
+        // The kernel didn't take it, so it will never complete; take it back
+        // off the queue rather than have it submitted along with the next one
+        __atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+        return rc < 0 ? -(int)error : -EAGAIN;
+    }
+    return 0;
+}
+
+size_t
+IOUring::reap(Completion *completions, size_t count)
+{
+    boost::mutex::scoped_lock lock(m_reapMutex);
+    unsigned int head = *m_cqHead;
+    unsigned int tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    size_t reaped = 0;
+    while (head != tail && reaped < count) {
+        io_uring_cqe *cqe = (io_uring_cqe *)m_cqes + (head & *m_cqMask);
+        completions[reaped].userData = cqe->user_data;
+        completions[reaped].result = cqe->res;
+        ++head;
+        ++reaped;
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+#ifdef IORING_SQ_CQ_OVERFLOW
+    // Completions that didn't fit in the ring are held by the kernel until
+    // someone asks for events
+    if (head == tail &&
+        (__atomic_load_n(m_sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW))
+        syscall(__NR_io_uring_enter, m_fd, 0, 0, IORING_ENTER_GETEVENTS,
+            NULL, 0);
+#endif
+    return reaped;
+}
+
+#else
+
+IOUring::IOUring(unsigned int entries)
+    : m_fd(-1)
+{
+    MORDOR_LOG_INFO(g_log) << this << " built without io_uring support";
+    MORDOR_THROW_EXCEPTION_FROM_ERROR_API(ENOSYS, "io_uring_setup");
+}
+
+IOUring::~IOUring()
+{}
+
+void
+IOUring::destroy()
+{}
+
+int
+IOUring::submit(Opcode opcode, int fd, const void *addr, unsigned int len,
+    unsigned long long offset, unsigned int flags,
+    unsigned long long userData)
+{
+    MORDOR_NOTREACHED();
+}
+
+size_t
+IOUring::reap(Completion *completions, size_t count)
+{
+    MORDOR_NOTREACHED();
+}
+
+#endif
+
+}
+
+#endif
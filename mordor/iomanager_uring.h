@@ -0,0 +1,82 @@
+#ifndef __MORDOR_IOMANAGER_URING_H__
+#define __MORDOR_IOMANAGER_URING_H__
+// Copyright (c) 2009 - Mozy, Inc.
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "version.h"
+
+#ifndef LINUX
+#error IOUring is Linux only
+#endif
+
+namespace Mordor {
+
+/// A single io_uring submission/completion queue pair
+
+/// Used by the epoll IOManager for completion-based I/O; the IOManager polls
+/// fd() alongside everything else, and calls reap() when it is readable.
+/// Operations are submitted to the kernel as soon as they are queued.
+class IOUring : boost::noncopyable
+{
+public:
+    enum Opcode {
+        RECVMSG,
+        SENDMSG,
+        ACCEPT,
+        CONNECT,
+        READV,
+        WRITEV,
+        /// Cancel the operation whose userData is addr
+        CANCEL
+    };
+
+    struct Completion
+    {
+        unsigned long long userData;
+        /// What the syscall would have returned, or -errno
+        int result;
+    };
+
+public:
+    /// @throws NativeException if the kernel lacks io_uring, or a feature we
+    /// rely on
+    IOUring(unsigned int entries);
+    ~IOUring();
+
+    /// Pollable; readable while there are completions to reap()
+    int fd() const { return m_fd; }
+
+    /// Queue and submit a single operation
+
+    /// The meaning of addr, len, offset and flags follow the corresponding
+    /// fields of struct io_uring_sqe for opcode
+    /// @return 0, or -errno if the operation couldn't be submitted
+    int submit(Opcode opcode, int fd, const void *addr, unsigned int len,
+        unsigned long long offset, unsigned int flags,
+        unsigned long long userData);
+
+    /// Pop up to count completions
+    /// @return How many were popped
+    size_t reap(Completion *completions, size_t count);
+
+private:
+    /// Unmap the rings and close the io_uring fd
+    void destroy();
+
+private:
+    int m_fd;
+    void *m_sqRing, *m_cqRing, *m_sqes;
+    size_t m_sqRingSize, m_cqRingSize, m_sqesSize;
+    unsigned int m_sqEntries;
+    // Pointers into the mmap'ed rings
+    unsigned int *m_sqHead, *m_sqTail, *m_sqMask, *m_sqFlags, *m_sqArray;
+    unsigned int *m_cqHead, *m_cqTail, *m_cqMask;
+    void *m_cqes;
+    boost::mutex m_submitMutex, m_reapMutex;
+};
+
+}
+
+#endif
@@ -2,12 +2,17 @@
 #define __MORDOR_PARALLEL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <algorithm>
+#include <functional>
+#include <iterator>
 #include <vector>
 
 #include <boost/bind.hpp>
-#include <boost/noncopyable.hpp>
 #include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
 
+#include "assert.h"
 #include "atomic.h"
 #include "fiber.h"
 #include "log.h"
@@ -86,6 +91,267 @@ parallel_foreach_impl(Iterator &begin, Iterator &end, Functor &functor,
         scheduler->schedule(caller);
 }
 
+template<class Iterator, class Functor>
+void
+parallel_foreach(Iterator begin, Iterator end, Functor &functor,
+    int parallelism, Scheduler *scheduler, std::input_iterator_tag)
+{
+    boost::mutex mutex;
+    boost::exception_ptr exception;
+    int count = parallelism;
+    for (int i = 0; i < parallelism; ++i) {
+        scheduler->schedule(boost::bind(
+            &Detail::parallel_foreach_impl<Iterator, Functor>,
+            boost::ref(begin), boost::ref(end), boost::ref(functor),
+            boost::ref(mutex), boost::ref(exception), scheduler,
+            Fiber::getThis(), boost::ref(count)));
+    }
+    Scheduler::yieldTo();
+
+    if (exception)
+        Mordor::rethrow_exception(exception);
+}
+
+/// Shared state for the Fibers of parallel_for_chunks
+template<class Body>
+struct ChunkedFor
+{
+    ChunkedFor(size_t total_, Body &body_, int parallelism_,
+        Scheduler *scheduler_)
+        : total(total_),
+          next(0),
+          body(body_),
+          parallelism(parallelism_),
+          count(parallelism_),
+          failed(0),
+          scheduler(scheduler_),
+          caller(Fiber::getThis())
+    {}
+
+    size_t total;
+    /// Index of the first element no Fiber has claimed yet; may overshoot
+    /// total once the last chunks have been handed out
+    volatile size_t next;
+    Body &body;
+    int parallelism;
+    int count;
+    volatile int failed;
+    boost::mutex mutex;
+    boost::exception_ptr exception;
+    Scheduler *scheduler;
+    Fiber::ptr caller;
+};
+
+/// Claims chunks of indices with an atomic add instead of taking a lock per
+/// element.  Chunks are guided: each is a share of what remained when it was
+/// claimed, so early chunks amortize the claim well and late ones are small
+/// enough to keep every Fiber busy until the end
+template<class Body>
+static
+void
+parallel_for_chunks_impl(ChunkedFor<Body> &state, int worker)
+{
+    try {
+        while (!state.failed) {
+            size_t next = state.next;
+            if (next >= state.total)
+                break;
+            size_t chunk = (state.total - next) / (2 * state.parallelism);
+            if (chunk == 0)
+                chunk = 1;
+            // Someone else may have claimed more since we looked, which only
+            // makes this chunk a bit bigger than guided; clamp it to the end
+            size_t first = atomicAdd(state.next, chunk) - chunk;
+            if (first >= state.total)
+                break;
+            size_t last = (std::min)(first + chunk, state.total);
+            state.body(first, last, worker, state.failed);
+        }
+    } catch (boost::exception &ex) {
+        removeTopFrames(ex);
+        boost::mutex::scoped_lock lock(state.mutex);
+        state.failed = 1;
+        if (!state.exception)
+            state.exception = boost::current_exception();
+    } catch (...) {
+        boost::mutex::scoped_lock lock(state.mutex);
+        state.failed = 1;
+        if (!state.exception)
+            state.exception = boost::current_exception();
+    }
+    if (atomicDecrement(state.count) == 0)
+        state.scheduler->schedule(state.caller);
+}
+
+/// @return The effective parallelism for an algorithm over total elements;
+/// 1 means run sequentially in the caller
+inline
+int
+parallelism_for(size_t total, int parallelism, Scheduler *scheduler)
+{
+    MORDOR_ASSERT(parallelism != 0);
+    if (!scheduler)
+        return 1;
+    if (parallelism == -1)
+        parallelism = (int)scheduler->threadCount();
+    // No point in Fibers that could never claim anything
+    if ((size_t)parallelism > total)
+        parallelism = (int)total;
+    return (std::max)(parallelism, 1);
+}
+
+/// Run body(first, last, worker, failed) over guided chunks of [0, total)
+/// on parallelism Fibers of the current Scheduler, and rethrow the first
+/// exception any of them threw.  worker is in [0, parallelism), and is the
+/// same for every chunk one Fiber claims; body should stop early once
+/// failed is set
+template<class Body>
+void
+parallel_for_chunks(size_t total, Body &body, int parallelism)
+{
+    Scheduler *scheduler = Scheduler::getThis();
+    parallelism = parallelism_for(total, parallelism, scheduler);
+    if (total == 0)
+        return;
+    if (parallelism == 1) {
+        volatile int failed = 0;
+        body(0, total, 0, failed);
+        return;
+    }
+    ChunkedFor<Body> state(total, body, parallelism, scheduler);
+    for (int i = 0; i < parallelism; ++i) {
+        scheduler->schedule(boost::bind(
+            &Detail::parallel_for_chunks_impl<Body>, boost::ref(state), i));
+    }
+    Scheduler::yieldTo();
+
+    if (state.exception)
+        Mordor::rethrow_exception(state.exception);
+}
+
+template<class Iterator, class Functor>
+struct ForeachBody
+{
+    ForeachBody(Iterator begin_, Functor &functor_)
+        : begin(begin_), functor(functor_)
+    {}
+
+    void operator()(size_t first, size_t last, int,
+        const volatile int &failed)
+    {
+        Iterator it = begin + first;
+        for (size_t i = first; i < last && !failed; ++i, ++it)
+            functor(*it);
+    }
+
+    Iterator begin;
+    Functor &functor;
+};
+
+template<class InputIterator, class OutputIterator, class Functor>
+struct TransformBody
+{
+    TransformBody(InputIterator begin_, OutputIterator out_,
+        Functor &functor_)
+        : begin(begin_), out(out_), functor(functor_)
+    {}
+
+    void operator()(size_t first, size_t last, int,
+        const volatile int &failed)
+    {
+        InputIterator it = begin + first;
+        OutputIterator result = out + first;
+        for (size_t i = first; i < last && !failed; ++i, ++it, ++result)
+            *result = functor(*it);
+    }
+
+    InputIterator begin;
+    OutputIterator out;
+    Functor &functor;
+};
+
+template<class Iterator, class T, class BinaryFunctor>
+struct ReduceBody
+{
+    ReduceBody(Iterator begin_, BinaryFunctor &functor_, int parallelism)
+        : begin(begin_), functor(functor_), partials(parallelism)
+    {}
+
+    void operator()(size_t first, size_t last, int worker,
+        const volatile int &failed)
+    {
+        // Each worker only ever touches its own accumulator
+        boost::optional<T> &partial = partials[worker];
+        Iterator it = begin + first;
+        size_t i = first;
+        if (!partial) {
+            partial = T(*it++);
+            ++i;
+        }
+        for (; i < last && !failed; ++i, ++it)
+            *partial = functor(*partial, *it);
+    }
+
+    Iterator begin;
+    BinaryFunctor &functor;
+    std::vector<boost::optional<T> > partials;
+};
+
+template<class Iterator, class Compare>
+struct SortRunsBody
+{
+    SortRunsBody(Iterator begin_, size_t total_, size_t runs_,
+        Compare &compare_)
+        : begin(begin_), total(total_), runs(runs_), compare(compare_)
+    {}
+
+    Iterator runBegin(size_t run) const
+    { return begin + (run * total / runs); }
+
+    void operator()(size_t first, size_t last, int, const volatile int &)
+    {
+        for (size_t run = first; run < last; ++run)
+            std::sort(runBegin(run), runBegin(run + 1), compare);
+    }
+
+    Iterator begin;
+    size_t total, runs;
+    Compare &compare;
+};
+
+template<class Iterator, class Compare>
+struct MergeRunsBody
+{
+    MergeRunsBody(SortRunsBody<Iterator, Compare> &runs_, size_t width_)
+        : runs(runs_), width(width_)
+    {}
+
+    /// Merge pair i: the width runs at 2 * i * width with the (up to) width
+    /// runs after them
+    void operator()(size_t first, size_t last, int, const volatile int &)
+    {
+        for (size_t i = first; i < last; ++i) {
+            size_t left = 2 * i * width;
+            size_t middle = (std::min)(left + width, runs.runs);
+            size_t right = (std::min)(middle + width, runs.runs);
+            std::inplace_merge(runs.runBegin(left), runs.runBegin(middle),
+                runs.runBegin(right), runs.compare);
+        }
+    }
+
+    SortRunsBody<Iterator, Compare> &runs;
+    size_t width;
+};
+
+template<class Iterator, class Functor>
+void
+parallel_foreach(Iterator begin, Iterator end, Functor &functor,
+    int parallelism, Scheduler *, std::random_access_iterator_tag)
+{
+    ForeachBody<Iterator, Functor> body(begin, functor);
+    parallel_for_chunks(end - begin, body, parallelism);
+}
+
 Logger::ptr getLogger();
 
 }
@@ -103,15 +369,19 @@ Logger::ptr getLogger();
 /// @param begin The beginning of the collection
 /// @param end The end of the collection
 /// @param dg The functor to be passed each object in the collection
-/// @param parallelism How many objects to Schedule in parallel
+/// @param parallelism How many objects to Schedule in parallel; defaults to
+/// the Scheduler's threadCount()
+/// @note With random access iterators, Fibers claim guided chunks of the
+/// collection with an atomic add instead of locking for every object, so
+/// objects are only processed in order when a single thread is running them
 template<class Iterator, class Functor>
 void
 parallel_foreach(Iterator begin, Iterator end, Functor functor,
     int parallelism = -1)
 {
-    if (parallelism == -1)
-        parallelism = 4;
     Scheduler *scheduler = Scheduler::getThis();
+    if (parallelism == -1)
+        parallelism = scheduler ? (int)scheduler->threadCount() : 1;
 
     if (parallelism == 1 || !scheduler) {
         MORDOR_LOG_DEBUG(Detail::getLogger())
@@ -121,22 +391,106 @@ parallel_foreach(Iterator begin, Iterator end, Functor functor,
         return;
     }
 
-    boost::mutex mutex;
-    boost::exception_ptr exception;
     MORDOR_LOG_DEBUG(Detail::getLogger()) << " running parallel_for with "
         << parallelism << " fibers";
-    int count = parallelism;
-    for (int i = 0; i < parallelism; ++i) {
-        scheduler->schedule(boost::bind(
-            &Detail::parallel_foreach_impl<Iterator, Functor>,
-            boost::ref(begin), boost::ref(end), boost::ref(functor),
-            boost::ref(mutex), boost::ref(exception), scheduler,
-            Fiber::getThis(), boost::ref(count)));
+    Detail::parallel_foreach(begin, end, functor, parallelism, scheduler,
+        typename std::iterator_traits<Iterator>::iterator_category());
+}
+
+
+/// @ingroup parallel_do
+/// Store functor(*it) to out for every it in [begin, end), in parallel on the
+/// current Scheduler
+/// @tparam InputIterator A random access iterator
+/// @tparam OutputIterator A random access iterator; writes to different
+/// positions must be safe from different threads (i.e. not std::vector<bool>)
+/// @param parallelism How many Fibers to use; defaults to the Scheduler's
+/// threadCount()
+/// @return The end of the output range
+template<class InputIterator, class OutputIterator, class Functor>
+OutputIterator
+parallel_transform(InputIterator begin, InputIterator end, OutputIterator out,
+    Functor functor, int parallelism = -1)
+{
+    Detail::TransformBody<InputIterator, OutputIterator, Functor> body(begin,
+        out, functor);
+    size_t total = end - begin;
+    Detail::parallel_for_chunks(total, body, parallelism);
+    return out + total;
+}
+
+/// @ingroup parallel_do
+/// Combine init with every object in [begin, end) using functor, in parallel
+/// on the current Scheduler
+///
+/// Each Fiber folds the chunks it claims into its own partial accumulator,
+/// so nothing is shared until the partials are combined, in the caller, at
+/// the end.
+/// @tparam Iterator A random access iterator
+/// @param functor T (const T &, const T &), which must be associative and
+/// commutative; objects are not visited in any particular order
+/// @param parallelism How many Fibers to use; defaults to the Scheduler's
+/// threadCount()
+template<class Iterator, class T, class BinaryFunctor>
+T
+parallel_reduce(Iterator begin, Iterator end, T init, BinaryFunctor functor,
+    int parallelism = -1)
+{
+    size_t total = end - begin;
+    parallelism = Detail::parallelism_for(total, parallelism,
+        Scheduler::getThis());
+    Detail::ReduceBody<Iterator, T, BinaryFunctor> body(begin, functor,
+        parallelism);
+    Detail::parallel_for_chunks(total, body, parallelism);
+    for (size_t i = 0; i < body.partials.size(); ++i) {
+        if (body.partials[i])
+            init = functor(init, *body.partials[i]);
     }
-    Scheduler::yieldTo();
+    return init;
+}
 
-    if (exception)
-        Mordor::rethrow_exception(exception);
+/// @ingroup parallel_do
+/// Sort [begin, end) in parallel on the current Scheduler
+///
+/// The range is cut into one run per Fiber, the runs are std::sort'ed
+/// concurrently, and then neighbouring runs are merged pairwise, also
+/// concurrently, until one run is left.  Like std::sort, this is not stable.
+/// @tparam Iterator A random access iterator
+/// @param parallelism How many Fibers to use; defaults to the Scheduler's
+/// threadCount()
+template<class Iterator, class Compare>
+void
+parallel_sort(Iterator begin, Iterator end, Compare compare,
+    int parallelism = -1)
+{
+    // Below this, a run isn't worth a Fiber of its own
+    static const size_t minimumRun = 1024;
+    size_t total = end - begin;
+    size_t runs = Detail::parallelism_for(total / minimumRun, parallelism,
+        Scheduler::getThis());
+    if (runs <= 1) {
+        std::sort(begin, end, compare);
+        return;
+    }
+    Detail::SortRunsBody<Iterator, Compare> sortRuns(begin, total, runs,
+        compare);
+    Detail::parallel_for_chunks(runs, sortRuns, (int)runs);
+    for (size_t width = 1; width < runs; width *= 2) {
+        Detail::MergeRunsBody<Iterator, Compare> mergeRuns(sortRuns, width);
+        size_t pairs = (runs + 2 * width - 1) / (2 * width);
+        Detail::parallel_for_chunks(pairs, mergeRuns, (int)pairs);
+    }
+}
+
+/// @ingroup parallel_do
+/// Sort [begin, end) by operator < in parallel on the current Scheduler
+template<class Iterator>
+void
+parallel_sort(Iterator begin, Iterator end, int parallelism = -1)
+{
+    parallel_sort(begin, end,
+        std::less<typename std::iterator_traits<Iterator>::value_type>(),
+        parallelism);
 }
 
 }
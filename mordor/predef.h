@@ -87,5 +87,21 @@ enum {
 
 #endif
 
+// MORDOR_RETURN_ADDRESS() is the address the current function will return
+// to, i.e. its call site; it's only meaningful in a MORDOR_NOINLINE function
+#ifdef MSVC
+#include <intrin.h>
+#define MORDOR_NOINLINE __declspec(noinline)
+#define MORDOR_FORCEINLINE __forceinline
+#define MORDOR_RETURN_ADDRESS() _ReturnAddress()
+#elif defined(GCC)
+#define MORDOR_NOINLINE __attribute__((noinline))
+#define MORDOR_FORCEINLINE inline __attribute__((always_inline))
+#define MORDOR_RETURN_ADDRESS() __builtin_return_address(0)
+#else
+#define MORDOR_NOINLINE
+#define MORDOR_FORCEINLINE inline
+#define MORDOR_RETURN_ADDRESS() ((void *)0)
+#endif
 
 #endif
@@ -2,27 +2,250 @@
 
 #include "scheduler.h"
 
+#include <algorithm>
+#include <map>
+#include <set>
+
 #include <boost/bind.hpp>
 
 #include "atomic.h"
 #include "assert.h"
+#include "config.h"
+#include "exception.h"
 #include "fiber.h"
+#include "statistics.h"
+#include "timer.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:scheduler");
 
+// In work stealing mode, how often (in run loop iterations) a thread with
+// work of its own still checks the shared queue
+static const unsigned int g_sharedQueueInterval = 61;
+// How often (in dispatches) a thread that hasn't gone idle calls onBusy()
+static const unsigned int g_busyInterval = 64;
+// How many free shared queue nodes each thread holds on to
+static const size_t g_nodeCacheSize = 1024;
+
+static ConfigVar<bool>::ptr g_adaptiveStacks = Config::lookup<bool>(
+    "scheduler.adaptivestacks", false,
+    "Run delegates on smaller stacks when delegates scheduled from the same "
+    "call site have never used much stack.  Needs fiber.stackwatermark; "
+    "consider fiber.guardpages too, since a call site that has never used "
+    "much stack still could.");
+static ConfigVar<unsigned long long>::ptr g_starvationLimit =
+    Config::lookup<unsigned long long>("scheduler.starvationlimit", 64ull,
+    "How many other pieces of work can be dispatched ahead of work waiting "
+    "in a lower priority class before it goes first anyway");
+
+// How many measurements of a call site adaptive stacks wants before it
+// trusts them
+static const unsigned long long g_adaptiveStackSamples = 100;
+// The smallest stack adaptive stacks will hand out
+static const size_t g_minAdaptiveStackSize = 16384;
+
+namespace {
+
+struct StackSite
+{
+    StackSite() : count(0), maximum(0), stacksize(0) {}
+
+    HistogramStatistic<size_t> histogram;
+    unsigned long long count;
+    size_t maximum;
+    // What adaptive stacks would run this call site's delegates with; 0 for
+    // the default stack size
+    size_t stacksize;
+};
+
+typedef std::map<const void *, StackSite> StackSites;
+
+// Each thread records (and adapts to) its own measurements, so dispatching
+// only ever takes its own thread's mutex, which the statistic is the only
+// other thing to take
+struct ThreadStackSites
+{
+    boost::mutex mutex;
+    StackSites sites;
+};
+
+}
+
+// Guards g_threadStackSites and g_retiredStackSites
+static boost::mutex g_stackSitesMutex;
+static std::set<ThreadStackSites *> g_threadStackSites;
+// Measurements from threads that have exited
+static StackSites g_retiredStackSites;
+
+static void mergeStackSites(StackSites &to, const StackSites &from)
+{
+    for (StackSites::const_iterator it = from.begin();
+        it != from.end();
+        ++it) {
+        StackSite &stackSite = to[it->first];
+        stackSite.histogram.merge(it->second.histogram);
+        stackSite.count += it->second.count;
+        stackSite.maximum = (std::max)(stackSite.maximum, it->second.maximum);
+        stackSite.stacksize =
+            (std::max)(stackSite.stacksize, it->second.stacksize);
+    }
+}
+
+static void retireStackSites(ThreadStackSites *sites)
+{
+    boost::mutex::scoped_lock lock(g_stackSitesMutex);
+    mergeStackSites(g_retiredStackSites, sites->sites);
+    g_threadStackSites.erase(sites);
+    delete sites;
+}
+
+static boost::thread_specific_ptr<ThreadStackSites> & t_stackSites()
+{
+    static boost::thread_specific_ptr<ThreadStackSites> *sites =
+        new boost::thread_specific_ptr<ThreadStackSites>(&retireStackSites);
+    return *sites;
+}
+
+static ThreadStackSites &threadStackSites()
+{
+    ThreadStackSites *sites = t_stackSites().get();
+    if (!sites) {
+        sites = new ThreadStackSites();
+        {
+            boost::mutex::scoped_lock lock(g_stackSitesMutex);
+            g_threadStackSites.insert(sites);
+        }
+        t_stackSites().reset(sites);
+    }
+    return *sites;
+}
+
+namespace {
+
+struct StackSitesStatistic : Statistic
+{
+    StackSitesStatistic() : Statistic("bytes") {}
+
+    void reset()
+    {
+        boost::mutex::scoped_lock lock(g_stackSitesMutex);
+        g_retiredStackSites.clear();
+        for (std::set<ThreadStackSites *>::const_iterator it =
+            g_threadStackSites.begin();
+            it != g_threadStackSites.end();
+            ++it) {
+            boost::mutex::scoped_lock threadLock((*it)->mutex);
+            (*it)->sites.clear();
+        }
+    }
+
+    std::ostream &serialize(std::ostream &os) const
+    {
+        StackSites sites;
+        {
+            boost::mutex::scoped_lock lock(g_stackSitesMutex);
+            mergeStackSites(sites, g_retiredStackSites);
+            for (std::set<ThreadStackSites *>::const_iterator it =
+                g_threadStackSites.begin();
+                it != g_threadStackSites.end();
+                ++it) {
+                boost::mutex::scoped_lock threadLock((*it)->mutex);
+                mergeStackSites(sites, (*it)->sites);
+            }
+        }
+        for (StackSites::const_iterator it = sites.begin();
+            it != sites.end();
+            ++it) {
+            os << std::endl << "    "
+                << to_string(std::vector<void *>(1, (void *)it->first))
+                << ": max " << it->second.maximum << "; ";
+            if (it->second.stacksize)
+                os << "stack " << it->second.stacksize << "; ";
+            os << it->second.histogram;
+        }
+        return os;
+    }
+};
+
+}
+
+static StackSitesStatistic &g_statStackSites =
+    Statistics::registerStatistic("scheduler.stackwatermark",
+    StackSitesStatistic(),
+    "Stack high-watermarks of delegates, by where they were scheduled from "
+    "(while fiber.stackwatermark is on), and the stack adaptive stacks has "
+    "settled on for them");
+
+static void recordStackWatermark(const void *site, size_t used)
+{
+    ThreadStackSites &sites = threadStackSites();
+    boost::mutex::scoped_lock lock(sites.mutex);
+    StackSite &stackSite = sites.sites[site];
+    stackSite.histogram.update(used);
+    if (used > stackSite.maximum)
+        stackSite.maximum = used;
+    if (++stackSite.count < g_adaptiveStackSamples)
+        return;
+    // Leave at least as much headroom as has ever been used
+    size_t stacksize = g_minAdaptiveStackSize;
+    while (stacksize < stackSite.maximum * 2)
+        stacksize *= 2;
+    stackSite.stacksize =
+        stacksize < Fiber::defaultStackSize() ? stacksize : 0;
+}
+
+static size_t adaptiveStackSize(const void *site)
+{
+    ThreadStackSites &sites = threadStackSites();
+    boost::mutex::scoped_lock lock(sites.mutex);
+    StackSites::const_iterator it = sites.sites.find(site);
+    return it == sites.sites.end() ? 0 : it->second.stacksize;
+}
+
+struct Scheduler::NodeCache
+{
+    NodeCache() : head(NULL), count(0) {}
+    ~NodeCache()
+    {
+        while (head) {
+            FiberAndThread *next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+
+    FiberAndThread *head;
+    size_t count;
+};
+
 ThreadLocalStorage<Scheduler *> Scheduler::t_scheduler;
 ThreadLocalStorage<Fiber *> Scheduler::t_fiber;
+ThreadLocalStorage<Scheduler::WorkQueue *> Scheduler::t_workQueue;
+ThreadLocalStorage<const Scheduler::Dispatched *> Scheduler::t_dispatched;
+// boost::tss so the cache is cleaned up when the thread exits
+boost::thread_specific_ptr<Scheduler::NodeCache> Scheduler::t_nodeCache;
 
-Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize)
-    : m_activeThreadCount(0),
+Scheduler::Scheduler(size_t threads, bool useCaller, size_t batchSize,
+    bool workStealing)
+    : m_injectHead((intptr_t)&m_injectStub),
+      m_injectTail(&m_injectStub),
+      m_dispatched(0),
+      m_sharedCount(0),
+      m_urgentCount(0),
+      m_localCount(0),
+      m_workStealing(workStealing),
+      m_activeThreadCount(0),
       m_idleThreadCount(0),
       m_stopping(true),
       m_autoStop(false),
       m_batchSize(batchSize)
 {
     MORDOR_ASSERT(threads >= 1);
+    for (size_t i = 0; i < SHARED_LISTS; ++i) {
+        m_fibers[i] = NULL;
+        m_fibersTail[i] = &m_fibers[i];
+    }
     if (useCaller) {
         --threads;
         MORDOR_ASSERT(getThis() == NULL);
@@ -42,6 +265,16 @@ Scheduler::~Scheduler()
     MORDOR_NOTHROW_ASSERT(m_stopping);
     if (getThis() == this) {
         t_scheduler = NULL;
+        t_workQueue = NULL;
+    }
+    // Anything scheduled after we stopped
+    drainInjected();
+    for (size_t i = 0; i < SHARED_LISTS; ++i) {
+        while (m_fibers[i]) {
+            FiberAndThread *next = m_fibers[i]->next;
+            delete m_fibers[i];
+            m_fibers[i] = next;
+        }
     }
 }
 
@@ -76,7 +309,7 @@ bool
 Scheduler::hasWorkToDo()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    return !m_fibers.empty();
+    return m_sharedCount != 0 || m_localCount != 0;
 }
 
 void
@@ -152,7 +385,8 @@ bool
 Scheduler::stopping()
 {
     boost::mutex::scoped_lock lock(m_mutex);
-    return m_stopping && m_fibers.empty() && m_activeThreadCount == 0;
+    return m_stopping && m_sharedCount == 0 && m_localCount == 0 &&
+        m_activeThreadCount == 0;
 }
 
 void
@@ -164,7 +398,7 @@ Scheduler::switchTo(tid_t thread)
             return;
     }
     MORDOR_LOG_DEBUG(g_log) << this << " switching to thread " << thread;
-    schedule(Fiber::getThis(), thread);
+    reschedule(thread);
     Scheduler::yieldTo();
 }
 
@@ -188,10 +422,34 @@ void
 Scheduler::yield()
 {
     MORDOR_ASSERT(Scheduler::getThis());
-    Scheduler::getThis()->schedule(Fiber::getThis());
+    Scheduler::getThis()->reschedule(emptytid());
     yieldTo();
 }
 
+void
+Scheduler::reschedule(tid_t thread)
+{
+    const Dispatched *current = t_dispatched.get();
+    if (current && current->deadline != ~0ull)
+        scheduleDeadline(Fiber::getThis(), current->deadline, thread);
+    else
+        schedule(Fiber::getThis(), thread, currentPriority());
+}
+
+Scheduler::Priority
+Scheduler::currentPriority()
+{
+    const Dispatched *current = t_dispatched.get();
+    return current ? current->priority : NORMAL;
+}
+
+unsigned long long
+Scheduler::currentDeadline()
+{
+    const Dispatched *current = t_dispatched.get();
+    return current ? current->deadline : ~0ull;
+}
+
 void
 Scheduler::dispatch()
 {
@@ -247,23 +505,78 @@ Scheduler::run()
         // Hijacked a thread
         MORDOR_ASSERT(t_fiber.get() == Fiber::getThis().get());
     }
+    WorkQueue *localQueue = NULL;
+    if (m_workStealing) {
+        boost::mutex::scoped_lock lock(m_mutex);
+        for (std::vector<boost::shared_ptr<WorkQueue> >::iterator it =
+            m_workQueues.begin();
+            it != m_workQueues.end();
+            ++it) {
+            if ((*it)->thread == gettid()) {
+                localQueue = it->get();
+                break;
+            }
+        }
+        if (!localQueue) {
+            m_workQueues.push_back(boost::shared_ptr<WorkQueue>(
+                new WorkQueue(gettid())));
+            localQueue = m_workQueues.back().get();
+        }
+    }
+    t_workQueue = localQueue;
     Fiber::ptr idleFiber(new Fiber(boost::bind(&Scheduler::idle, this)));
     MORDOR_LOG_VERBOSE(g_log) << this << " starting thread with idle fiber " << idleFiber;
     Fiber::ptr dgFiber;
+    // What dgFiber's stack size was asked for as; 0 for the default
+    size_t dgStackSize = 0;
     // use a deque for O(1) .size() and pop_front()
     std::deque<FiberAndThread> batch;
     bool isActive = false;
+    unsigned int tick = 0;
+    // m_dispatched when this thread last looked at the shared lists
+    size_t sharedVisit = m_dispatched;
+    // Dispatches since this thread was last idle
+    unsigned int busy = 0;
     while (true) {
         MORDOR_ASSERT(batch.empty());
         bool dontIdle = false;
         bool tickleMe = false;
-        {
+        // Service our own queue first without touching the shared lock, but
+        // check the shared queue every so often so that work scheduled from
+        // outside the Scheduler (or for a specific thread) isn't starved, and
+        // right away when there's HIGH or deadline work waiting there, or
+        // anything there has been passed over for the starvation limit
+        bool triedLocal = false;
+        if (localQueue && m_urgentCount == 0 &&
+            (m_sharedCount == 0 ||
+            m_dispatched - sharedVisit < g_starvationLimit->val()) &&
+            ++tick % g_sharedQueueInterval != 0) {
+            if (!isActive) {
+                atomicIncrement(m_activeThreadCount);
+                isActive = true;
+            }
+            popLocal(*localQueue, batch, dontIdle);
+            triedLocal = true;
+        }
+        if (batch.empty()) {
             boost::mutex::scoped_lock lock(m_mutex);
+            sharedVisit = m_dispatched;
             // Kill ourselves off if needed
             if (m_threads.size() > m_threadCount && gettid() != m_rootThread) {
                 // Accounting
                 if (isActive)
-                    --m_activeThreadCount;
+                    atomicDecrement(m_activeThreadCount);
+                // Hand anything left in our queue to the rest of the threads
+                if (localQueue) {
+                    boost::mutex::scoped_lock lock2(localQueue->mutex);
+                    while (!localQueue->fibers.empty()) {
+                        pushShared(localQueue->fibers.front());
+                        localQueue->fibers.pop_front();
+                        atomicDecrement(m_localCount);
+                    }
+                    lock2.unlock();
+                    removeWorkQueue(localQueue);
+                }
                 // Kill off the idle fiber
                 try {
                     throw boost::enable_current_exception(
@@ -285,51 +598,97 @@ Scheduler::run()
                 MORDOR_NOTREACHED();
             }
 
-            std::list<FiberAndThread>::iterator it(m_fibers.begin());
-            while (it != m_fibers.end()) {
-                // If we've met our batch size, and we're not checking to see
-                // if we need to tickle another thread, then break
-                if ( (tickleMe || m_activeThreadCount == threadCount()) &&
-                    batch.size() == m_batchSize)
-                    break;
-                if (it->thread != emptytid() && it->thread != gettid()) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping item scheduled for thread "
-                        << it->thread;
-
-                    // Wake up another thread to hopefully service this
-                    tickleMe = true;
-                    dontIdle = true;
-                    ++it;
-                    continue;
-                }
-                MORDOR_ASSERT(it->fiber || it->dg);
-                // This fiber is still executing; probably just some race
-                // race condition that it needs to yield on one thread
-                // before running on another thread
-                if (it->fiber && it->fiber->state() == Fiber::EXEC) {
-                    MORDOR_LOG_DEBUG(g_log) << this
-                        << " skipping executing fiber " << it->fiber;
-                    ++it;
-                    dontIdle = true;
-                    continue;
-                }
-                // We were just checking if there is more work; there is, so
-                // set the flag and don't actually take this piece of work
-                if (batch.size() == m_batchSize) {
-                    tickleMe = true;
-                    break;
-                }
-                batch.push_back(*it);
-                it = m_fibers.erase(it);
-                if (!isActive) {
-                    ++m_activeThreadCount;
-                    isActive = true;
+            drainInjected();
+            size_t order[SHARED_LISTS];
+            size_t lists = dispatchOrder(order);
+            bool full = false;
+            for (size_t i = 0; i < lists && !full; ++i) {
+                size_t list = order[i];
+                FiberAndThread * volatile *link = &m_fibers[list];
+                while (FiberAndThread *ft = *link) {
+                    // If we've met our batch size, and we're not checking to
+                    // see if we need to tickle another thread, then break
+                    if ( (tickleMe || m_activeThreadCount == threadCount()) &&
+                        batch.size() == m_batchSize) {
+                        full = true;
+                        break;
+                    }
+                    if (ft->thread != emptytid() && ft->thread != gettid()) {
+                        MORDOR_LOG_DEBUG(g_log) << this
+                            << " skipping item scheduled for thread "
+                            << ft->thread;
+
+                        // Wake up another thread to hopefully service this
+                        tickleMe = true;
+                        dontIdle = true;
+                        link = &ft->next;
+                        continue;
+                    }
+                    MORDOR_ASSERT(ft->fiber || ft->dg);
+                    // This fiber is still executing; probably just some race
+                    // race condition that it needs to yield on one thread
+                    // before running on another thread
+                    if (ft->fiber && ft->fiber->state() == Fiber::EXEC) {
+                        MORDOR_LOG_DEBUG(g_log) << this
+                            << " skipping executing fiber " << ft->fiber;
+                        link = &ft->next;
+                        dontIdle = true;
+                        continue;
+                    }
+                    // We were just checking if there is more work; there is,
+                    // so set the flag and don't actually take this piece of
+                    // work
+                    if (batch.size() == m_batchSize) {
+                        tickleMe = true;
+                        full = true;
+                        break;
+                    }
+                    *link = ft->next;
+                    if (m_fibersTail[list] == &ft->next)
+                        m_fibersTail[list] = link;
+                    batch.push_back(FiberAndThread());
+                    batch.back().fiber.swap(ft->fiber);
+                    batch.back().dg.swap(ft->dg);
+                    batch.back().site = ft->site;
+                    batch.back().priority = ft->priority;
+                    batch.back().deadline = ft->deadline;
+                    freeNode(ft);
+                    if (batch.back().urgent())
+                        atomicDecrement(m_urgentCount);
+                    atomicIncrement(m_dispatched);
+                    atomicDecrement(m_sharedCount);
+                    if (!isActive) {
+                        atomicIncrement(m_activeThreadCount);
+                        isActive = true;
+                    }
                 }
             }
+            // A producer is part way through pushing onto the injection
+            // queue; we'll see it in a moment
+            if (batch.empty() && lists == 0 && m_sharedCount != 0)
+                dontIdle = true;
             if (batch.empty() && isActive) {
-                --m_activeThreadCount;
+                atomicDecrement(m_activeThreadCount);
+                isActive = false;
+            }
+        }
+        if (batch.empty() && localQueue && !triedLocal &&
+            popLocal(*localQueue, batch, dontIdle)) {
+            // Whatever sent us to the shared lists was for another thread, or
+            // already taken
+            atomicIncrement(m_activeThreadCount);
+            isActive = true;
+        }
+        if (batch.empty() && localQueue && m_localCount != 0) {
+            // Nothing for us; see if another thread has work piling up
+            atomicIncrement(m_activeThreadCount);
+            isActive = true;
+            if (!steal(*localQueue, batch)) {
+                atomicDecrement(m_activeThreadCount);
                 isActive = false;
+                // Whatever is left is a fiber that hasn't finished switching
+                // out yet; don't go to sleep on it
+                dontIdle = m_localCount != 0;
             }
         }
         if (tickleMe)
@@ -345,14 +704,20 @@ Scheduler::run()
 
             if (idleFiber->state() == Fiber::TERM) {
                 MORDOR_LOG_DEBUG(g_log) << this << " idle fiber terminated";
-                if (gettid() == m_rootThread)
+                if (gettid() == m_rootThread) {
                     m_callingFiber.reset();
+                } else if (localQueue) {
+                    boost::mutex::scoped_lock lock(m_mutex);
+                    removeWorkQueue(localQueue);
+                }
                 // Unblock the next thread
                 if (threadCount() > 1)
                     tickle();
                 return;
             }
             MORDOR_LOG_DEBUG(g_log) << this << " idling";
+            Fiber::trimStackCache();
+            busy = 0;
             atomicIncrement(m_idleThreadCount);
             idleFiber->call();
             atomicDecrement(m_idleThreadCount);
@@ -363,6 +728,9 @@ Scheduler::run()
             FiberAndThread& ft = batch.front();
             Fiber::ptr f = ft.fiber;
             boost::function<void ()> dg = ft.dg;
+            const void *site = ft.site;
+            Dispatched current = { ft.priority, ft.deadline };
+            t_dispatched = &current;
             batch.pop_front();
 
             try {
@@ -370,17 +738,25 @@ Scheduler::run()
                     MORDOR_LOG_DEBUG(g_log) << this << " running " << f;
                     f->yieldTo();
                 } else if (dg) {
-                    if (dgFiber)
+                    size_t stacksize = site && g_adaptiveStacks->val() ?
+                        adaptiveStackSize(site) : 0;
+                    if (dgFiber && stacksize == dgStackSize) {
                         dgFiber->reset(dg);
-                    else
-                        dgFiber.reset(new Fiber(dg));
+                    } else {
+                        dgFiber.reset(new Fiber(dg, stacksize));
+                        dgStackSize = stacksize;
+                    }
                     MORDOR_LOG_DEBUG(g_log) << this << " running " << dg;
                     dg = NULL;
                     dgFiber->yieldTo();
-                    if (dgFiber->state() != Fiber::TERM)
+                    if (dgFiber->state() != Fiber::TERM) {
                         dgFiber.reset();
-                    else
+                    } else {
+                        size_t used = dgFiber->stackHighWatermark();
+                        if (used && site)
+                            recordStackWatermark(site, used);
                         dgFiber->reset(NULL);
+                    }
                 }
             } catch (...) {
                 try {
@@ -394,16 +770,302 @@ Scheduler::run()
                 {
                     boost::mutex::scoped_lock lock(m_mutex);
                     // push all un-executed fibers back to m_fibers
-                    copy(batch.begin(), batch.end(), back_inserter(m_fibers));
+                    for (std::deque<FiberAndThread>::iterator it =
+                        batch.begin();
+                        it != batch.end();
+                        ++it)
+                        pushShared(*it);
                     batch.clear();
                     // decrease the activeCount as this thread is in exception
                     isActive = false;
-                    --m_activeThreadCount;
+                    atomicDecrement(m_activeThreadCount);
                 }
+                t_dispatched = NULL;
                 throw;
             }
+            t_dispatched = NULL;
+            if (++busy % g_busyInterval == 0)
+                onBusy();
+        }
+    }
+}
+
+MORDOR_NOINLINE const void *
+Scheduler::callSite()
+{
+    return MORDOR_RETURN_ADDRESS();
+}
+
+Scheduler::FiberAndThread *
+Scheduler::allocNode()
+{
+    NodeCache *cache = t_nodeCache.get();
+    if (cache && cache->head) {
+        FiberAndThread *ft = cache->head;
+        cache->head = ft->next;
+        --cache->count;
+        ft->priority = NORMAL;
+        ft->deadline = ~0ull;
+        return ft;
+    }
+    return new FiberAndThread();
+}
+
+void
+Scheduler::freeNode(FiberAndThread *ft)
+{
+    MORDOR_ASSERT(!ft->fiber && !ft->dg);
+    NodeCache *cache = t_nodeCache.get();
+    if (!cache) {
+        cache = new NodeCache();
+        t_nodeCache.reset(cache);
+    }
+    if (cache->count >= g_nodeCacheSize) {
+        delete ft;
+        return;
+    }
+    ft->next = cache->head;
+    cache->head = ft;
+    ++cache->count;
+}
+
+bool
+Scheduler::inject(FiberAndThread *ft)
+{
+    // Count it first, so that stopping() can't see an empty Scheduler while
+    // the push is in progress
+    bool tickleMe = atomicIncrement(m_sharedCount) == 1;
+    if (ft->urgent())
+        atomicIncrement(m_urgentCount);
+    ft->next = NULL;
+    intptr_t prev = m_injectHead, seen;
+    while ((seen = atomicCompareAndSwap(m_injectHead, (intptr_t)ft, prev))
+        != prev)
+        prev = seen;
+    // Until this store lands, the consumer sees the queue as ending at prev.
+    // It's a release so that the consumer (which follows links with an
+    // acquire) sees everything stored into ft, even on weakly ordered CPUs.
+    atomicStoreRelease(((FiberAndThread *)prev)->next, ft);
+    return tickleMe;
+}
+
+void
+Scheduler::drainInjected()
+{
+    while (true) {
+        FiberAndThread *tail = m_injectTail;
+        FiberAndThread *next = atomicLoadAcquire(tail->next);
+        if (tail == &m_injectStub) {
+            if (!next)
+                return;
+            m_injectTail = tail = next;
+            next = atomicLoadAcquire(tail->next);
+        }
+        if (!next) {
+            if (tail != (FiberAndThread *)m_injectHead)
+                // A push is in progress
+                return;
+            // tail is the last real node; put the stub back behind it so
+            // tail can be handed off
+            m_injectStub.next = NULL;
+            intptr_t prev = m_injectHead, seen;
+            while ((seen = atomicCompareAndSwap(m_injectHead,
+                (intptr_t)&m_injectStub, prev)) != prev)
+                prev = seen;
+            atomicStoreRelease(((FiberAndThread *)prev)->next, &m_injectStub);
+            next = atomicLoadAcquire(tail->next);
+            if (!next)
+                return;
+        }
+        m_injectTail = next;
+        enqueueShared(tail);
+    }
+}
+
+void
+Scheduler::pushShared(const FiberAndThread &ft)
+{
+    FiberAndThread *node = allocNode();
+    node->fiber = ft.fiber;
+    node->dg = ft.dg;
+    node->thread = ft.thread;
+    node->site = ft.site;
+    node->priority = ft.priority;
+    node->deadline = ft.deadline;
+    enqueueShared(node);
+    if (node->urgent())
+        atomicIncrement(m_urgentCount);
+    atomicIncrement(m_sharedCount);
+}
+
+void
+Scheduler::enqueueShared(FiberAndThread *ft)
+{
+    ft->next = NULL;
+    ft->enqueued = m_dispatched;
+    size_t list = ft->deadline == ~0ull ? (size_t)(ft->priority - HIGH) :
+        (size_t)DEADLINE_LIST;
+    MORDOR_ASSERT(list < SHARED_LISTS);
+    FiberAndThread * volatile *link = m_fibersTail[list];
+    if (list == DEADLINE_LIST) {
+        // Keep it sorted; ties stay in FIFO order
+        link = &m_fibers[list];
+        while (*link && (*link)->deadline <= ft->deadline)
+            link = &(*link)->next;
+        ft->next = *link;
+    }
+    *link = ft;
+    if (!ft->next)
+        m_fibersTail[list] = &ft->next;
+}
+
+size_t
+Scheduler::dispatchOrder(size_t order[])
+{
+    static const size_t normal[SHARED_LISTS] =
+        { HIGH_LIST, DEADLINE_LIST, NORMAL_LIST, LOW_LIST };
+    static const size_t overdue[SHARED_LISTS] =
+        { DEADLINE_LIST, HIGH_LIST, NORMAL_LIST, LOW_LIST };
+    const size_t *base = normal;
+    if (m_fibers[DEADLINE_LIST] &&
+        m_fibers[DEADLINE_LIST]->deadline <= TimerManager::now())
+        base = overdue;
+    // Whichever list's head has been passed over the longest goes first, if
+    // that's been too long; the list that would go first anyway isn't being
+    // passed over
+    unsigned long long limit = g_starvationLimit->val();
+    // Local dispatches bump it without m_mutex; differences stay right
+    // across wraparound
+    size_t dispatched = m_dispatched;
+    size_t starved = SHARED_LISTS;
+    bool first = true;
+    for (size_t i = 0; i < SHARED_LISTS; ++i) {
+        FiberAndThread *head = m_fibers[base[i]];
+        if (!head)
+            continue;
+        if (first) {
+            first = false;
+            continue;
+        }
+        if (dispatched - head->enqueued >= limit &&
+            (starved == SHARED_LISTS || dispatched - head->enqueued >
+            dispatched - m_fibers[starved]->enqueued))
+            starved = base[i];
+    }
+    size_t count = 0;
+    if (starved != SHARED_LISTS)
+        order[count++] = starved;
+    for (size_t i = 0; i < SHARED_LISTS; ++i) {
+        if (m_fibers[base[i]] && base[i] != starved)
+            order[count++] = base[i];
+    }
+    return count;
+}
+
+Scheduler::WorkQueue *
+Scheduler::localQueue()
+{
+    if (!m_workStealing || t_scheduler.get() != this)
+        return NULL;
+    return t_workQueue.get();
+}
+
+void
+Scheduler::scheduleLocal(WorkQueue &queue, const FiberAndThread &ft)
+{
+    bool tickleMe;
+    {
+        boost::mutex::scoped_lock lock(queue.mutex);
+        // If there was already something waiting on this thread, another
+        // thread may as well come and take it
+        tickleMe = !queue.fibers.empty();
+        queue.fibers.push_back(ft);
+        atomicIncrement(m_localCount);
+    }
+    if (tickleMe && hasIdleThreads())
+        tickle();
+}
+
+bool
+Scheduler::popLocal(WorkQueue &queue, std::deque<FiberAndThread> &batch,
+    bool &dontIdle)
+{
+    boost::mutex::scoped_lock lock(queue.mutex);
+    std::deque<FiberAndThread>::iterator it = queue.fibers.begin();
+    while (it != queue.fibers.end() && batch.size() < m_batchSize) {
+        // Same race as in run(); the fiber rescheduled itself and hasn't
+        // finished yielding yet
+        if (it->fiber && it->fiber->state() == Fiber::EXEC) {
+            ++it;
+            dontIdle = true;
+            continue;
+        }
+        batch.push_back(*it);
+        it = queue.fibers.erase(it);
+        atomicDecrement(m_localCount);
+        atomicIncrement(m_dispatched);
+    }
+    return !batch.empty();
+}
+
+bool
+Scheduler::steal(WorkQueue &queue, std::deque<FiberAndThread> &batch)
+{
+    std::deque<FiberAndThread> stolen;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        size_t count = m_workQueues.size();
+        // Don't have every thief start on the same victim
+        size_t start = (size_t)gettid() % count;
+        for (size_t i = 0; i < count && stolen.empty(); ++i) {
+            WorkQueue &victim = *m_workQueues[(start + i) % count];
+            if (&victim == &queue)
+                continue;
+            boost::mutex::scoped_lock lock2(victim.mutex);
+            size_t toSteal = (victim.fibers.size() + 1) / 2;
+            std::deque<FiberAndThread>::iterator it = victim.fibers.begin();
+            while (it != victim.fibers.end() && stolen.size() < toSteal) {
+                if (it->fiber && it->fiber->state() == Fiber::EXEC) {
+                    ++it;
+                    continue;
+                }
+                stolen.push_back(*it);
+                it = victim.fibers.erase(it);
+            }
+            if (!stolen.empty())
+                MORDOR_LOG_DEBUG(g_log) << this << " stole " << stolen.size()
+                    << " fiber/dgs from thread " << victim.thread;
+        }
+    }
+    if (stolen.empty())
+        return false;
+    while (!stolen.empty() && batch.size() < m_batchSize) {
+        batch.push_back(stolen.front());
+        stolen.pop_front();
+        atomicDecrement(m_localCount);
+        atomicIncrement(m_dispatched);
+    }
+    // Keep the rest for ourselves; they're still counted in m_localCount
+    if (!stolen.empty()) {
+        boost::mutex::scoped_lock lock(queue.mutex);
+        queue.fibers.insert(queue.fibers.end(), stolen.begin(), stolen.end());
+    }
+    return true;
+}
+
+void
+Scheduler::removeWorkQueue(WorkQueue *queue)
+{
+    for (std::vector<boost::shared_ptr<WorkQueue> >::iterator it =
+        m_workQueues.begin();
+        it != m_workQueues.end();
+        ++it) {
+        if (it->get() == queue) {
+            m_workQueues.erase(it);
+            break;
         }
     }
+    t_workQueue = NULL;
 }
 
 SchedulerSwitcher::SchedulerSwitcher(Scheduler *target)
@@ -2,20 +2,22 @@
 #define __MORDOR_SCHEDULER_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <deque>
 #include <list>
 
 #include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
+#include "atomic.h"
+#include "fiber.h"
 #include "thread.h"
 #include "thread_local_storage.h"
 
 namespace Mordor {
 
-class Fiber;
-
 /// Cooperative user-mode thread (Fiber) Scheduler
 
 /// A Scheduler is used to cooperatively schedule fibers on threads,
@@ -31,6 +33,18 @@ class Fiber;
 class Scheduler : public boost::noncopyable
 {
 public:
+    /// Dispatch classes for scheduled work
+
+    /// Work in a higher class is dispatched before work in a lower one, except
+    /// that work which has been passed over for scheduler.starvationlimit
+    /// dispatches goes first, so lower classes are never starved outright.
+    /// NORMAL is zero, so it's what work gets when nobody says otherwise.
+    enum Priority {
+        HIGH = -1,
+        NORMAL = 0,
+        LOW = 1
+    };
+
     /// Default constructor
 
     /// By default, a single-threaded hijacking Scheduler is constructed.
@@ -42,8 +56,12 @@ public:
     /// executing thread
     /// @param batchSize Number of operations to pull off the scheduler queue
     /// on every iteration
+    /// @param workStealing If each thread should keep its own run queue for
+    /// work scheduled from within the Scheduler, with idle threads stealing
+    /// from their peers, instead of every thread sharing a single queue
     /// @pre if (useCaller == true) Scheduler::getThis() == NULL
-    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1);
+    Scheduler(size_t threads = 1, bool useCaller = true, size_t batchSize = 1,
+        bool workStealing = false);
     /// Destroys the scheduler, implicitly calling stop()
     virtual ~Scheduler();
 
@@ -77,15 +95,49 @@ public:
     ///           in, the ownership will be transfered to this scheduler
     /// @param thread Optionally provide a specific thread for the Fiber to run
     /// on
+    /// @param priority Dispatch class; work scheduled with anything but NORMAL
+    /// always goes through the shared queue, even when work stealing
+    /// @note schedule() is always inlined, so that while fiber.stackwatermark
+    /// is on it can record its caller as the call site of the delegate (see
+    /// scheduler.stackwatermark)
     template <class FiberOrDg>
-    void schedule(FiberOrDg fd, tid_t thread = emptytid())
+    MORDOR_FORCEINLINE void schedule(FiberOrDg fd, tid_t thread = emptytid(),
+        Priority priority = NORMAL)
     {
-        bool tickleMe;
-        {
-            boost::mutex::scoped_lock lock(m_mutex);
-            tickleMe = scheduleNoLock(fd, thread);
+        const void *site = Fiber::measuringStacks() ? callSite() : NULL;
+        if (thread == emptytid() && priority == NORMAL) {
+            if (WorkQueue *queue = localQueue()) {
+                FiberAndThread ft(fd, thread);
+                ft.site = site;
+                scheduleLocal(*queue, ft);
+                return;
+            }
         }
-        if (shouldTickle(tickleMe))
+        FiberAndThread *ft = allocNode();
+        ft->assign(fd, thread);
+        ft->site = site;
+        ft->priority = priority;
+        if (shouldTickle(inject(ft)))
+            tickle();
+    }
+
+    /// Schedule a Fiber or functor that should start running by deadline
+
+    /// Work with deadlines is dispatched earliest deadline first, after HIGH
+    /// work but before NORMAL work; once the earliest deadline has passed,
+    /// it's dispatched before HIGH work too.
+    /// @param deadline Absolute time, in TimerManager::now() microseconds
+    /// @param thread Optionally provide a specific thread for the Fiber to run
+    /// on
+    template <class FiberOrDg>
+    MORDOR_FORCEINLINE void scheduleDeadline(FiberOrDg fd,
+        unsigned long long deadline, tid_t thread = emptytid())
+    {
+        FiberAndThread *ft = allocNode();
+        ft->assign(fd, thread);
+        ft->site = Fiber::measuringStacks() ? callSite() : NULL;
+        ft->deadline = deadline;
+        if (shouldTickle(inject(ft)))
             tickle();
     }
 
@@ -94,15 +146,20 @@ public:
     /// @param begin The first item to schedule
     /// @param end One past the last item to schedule
     template <class InputIterator>
-    void schedule(InputIterator begin, InputIterator end)
+    MORDOR_FORCEINLINE void schedule(InputIterator begin, InputIterator end)
     {
+        const void *site = Fiber::measuringStacks() ? callSite() : NULL;
+        if (WorkQueue *queue = localQueue()) {
+            scheduleLocal(*queue, begin, end, site);
+            return;
+        }
         bool tickleMe = false;
-        {
-            boost::mutex::scoped_lock lock(m_mutex);
-            while (begin != end) {
-                tickleMe = scheduleNoLock(&*begin) || tickleMe;
-                ++begin;
-            }
+        while (begin != end) {
+            FiberAndThread *ft = allocNode();
+            ft->assign(&*begin, emptytid());
+            ft->site = site;
+            tickleMe = inject(ft) || tickleMe;
+            ++begin;
         }
         if (shouldTickle(tickleMe))
             tickle();
@@ -134,6 +191,15 @@ public:
     /// @pre Scheduler::getThis() != NULL
     static void yield();
 
+    /// @return The dispatch class of the work currently running on this
+    /// thread; yield(), switchTo() and IOManager event registrations
+    /// reschedule the current Fiber with it
+    static Priority currentPriority();
+    /// @return The deadline the work currently running on this thread was
+    /// scheduled with, or ~0ull if none; like currentPriority(), it's carried
+    /// across yield(), switchTo() and IOManager event registrations
+    static unsigned long long currentDeadline();
+
     /// Force a hijacking Scheduler to process scheduled work
 
     /// Calls yieldTo(), and yields back to the currently executing Fiber
@@ -154,6 +220,9 @@ public:
     }
 
     tid_t rootThreadId() const { return m_rootThread; }
+
+    /// If this Scheduler was constructed with work stealing enabled
+    bool workStealing() const { return m_workStealing; }
 protected:
     /// Derived classes can query stopping() to see if the Scheduler is trying
     /// to stop, and should return from the idle Fiber as soon as possible.
@@ -173,12 +242,18 @@ protected:
     /// The Scheduler wants to force the idle fiber to Fiber::yield(), because
     /// new work has been scheduled.
     virtual void tickle() = 0;
+    /// Called every so often (every 64 dispatches) by a thread that has had
+    /// work to do since it was last idle
+    virtual void onBusy() {}
 
     bool hasWorkToDo();
     virtual bool hasIdleThreads() const { return m_idleThreadCount != 0; }
+    /// How many threads are currently inside idle()
+    size_t idleThreadCount() const { return m_idleThreadCount; }
 
     /// determine whether tickle() is needed, to be invoked in schedule()
-    /// @param empty whether m_fibers is empty before the new task is scheduled
+    /// @param empty whether the shared queue was empty before the new task
+    /// was scheduled
     virtual bool shouldTickle(bool empty) const
     { return empty && Scheduler::getThis() != this; }
 
@@ -186,42 +261,166 @@ protected:
     void setThis() { t_scheduler = this; }
 
 private:
+    struct FiberAndThread;
+    struct WorkQueue;
+    struct NodeCache;
+
     void yieldTo(bool yieldToCallerOnTerminate);
     void run();
-
-    /// @pre @c fd should be valid
-    /// @pre the task to be scheduled is not thread-targeted, or this scheduler
-    ///      owns the targeted thread.
-    template <class FiberOrDg>
-        bool scheduleNoLock(FiberOrDg fd,
-                            tid_t thread = emptytid()) {
-        bool tickleMe = m_fibers.empty();
-        m_fibers.push_back(FiberAndThread(fd, thread));
-        return tickleMe;
+    /// Schedule the current Fiber the way it was last dispatched
+    void reschedule(tid_t thread);
+
+    /// @return The run queue owned by the currently executing thread, or NULL
+    /// if work stealing is disabled or the current thread is not one of ours
+    WorkQueue *localQueue();
+    /// Pull up to m_batchSize items off the current thread's run queue
+    bool popLocal(WorkQueue &queue, std::deque<FiberAndThread> &batch,
+        bool &dontIdle);
+    /// Move up to half of another thread's run queue to this thread
+    bool steal(WorkQueue &queue, std::deque<FiberAndThread> &batch);
+    /// @pre m_mutex is locked
+    void removeWorkQueue(WorkQueue *queue);
+
+    void scheduleLocal(WorkQueue &queue, const FiberAndThread &ft);
+    template <class InputIterator>
+    void scheduleLocal(WorkQueue &queue, InputIterator begin,
+        InputIterator end, const void *site)
+    {
+        bool tickleMe;
+        {
+            boost::mutex::scoped_lock lock(queue.mutex);
+            // If there was already something waiting on this thread, another
+            // thread may as well come and take it
+            tickleMe = !queue.fibers.empty();
+            while (begin != end) {
+                queue.fibers.push_back(FiberAndThread(&*begin, emptytid()));
+                queue.fibers.back().site = site;
+                atomicIncrement(m_localCount);
+                ++begin;
+            }
+        }
+        if (tickleMe && hasIdleThreads())
+            tickle();
     }
 
+    /// Where the (inlined) schedule() that called this was called from
+    static const void *callSite();
+    /// Get a node for the shared queue from this thread's cache
+    static FiberAndThread *allocNode();
+    /// Return a node to this thread's cache
+    /// @pre ft holds neither a Fiber nor a dg
+    static void freeNode(FiberAndThread *ft);
+
+    /// Push onto the lock-free injection queue
+    /// @return If the shared queue was empty beforehand
+    bool inject(FiberAndThread *ft);
+    /// Move everything in the injection queue to the end of m_fibers
+    /// @pre m_mutex is locked
+    void drainInjected();
+    /// @pre m_mutex is locked
+    void pushShared(const FiberAndThread &ft);
+    /// Put ft on the end of the list for its class, or in deadline order
+    /// @pre m_mutex is locked
+    void enqueueShared(FiberAndThread *ft);
+    /// Fill order with the shared lists, in the order to take work from them
+    /// @return How many lists to look at
+    /// @pre m_mutex is locked
+    size_t dispatchOrder(size_t order[]);
+
 private:
     struct FiberAndThread {
         boost::shared_ptr<Fiber> fiber;
         boost::function<void ()> dg;
         tid_t thread;
+        // Where the work was scheduled from
+        const void *site;
+        Priority priority;
+        // ~0ull if none
+        unsigned long long deadline;
+        // Scheduler::m_dispatched when it reached the shared lists
+        size_t enqueued;
+        FiberAndThread * volatile next;
+        FiberAndThread()
+            : thread(emptytid()), site(NULL), priority(NORMAL),
+              deadline(~0ull), enqueued(0), next(NULL) {}
         FiberAndThread(boost::shared_ptr<Fiber> f, tid_t th)
-            : fiber(f), thread(th) {}
+            : fiber(f), thread(th), site(NULL), priority(NORMAL),
+              deadline(~0ull), enqueued(0), next(NULL) {}
         FiberAndThread(boost::shared_ptr<Fiber>* f, tid_t th)
-            : thread(th) {
+            : thread(th), site(NULL), priority(NORMAL), deadline(~0ull),
+              enqueued(0), next(NULL) {
             fiber.swap(*f);
         }
         FiberAndThread(boost::function<void ()> d, tid_t th)
-            : dg(d), thread(th) {}
+            : dg(d), thread(th), site(NULL), priority(NORMAL),
+              deadline(~0ull), enqueued(0), next(NULL) {}
         FiberAndThread(boost::function<void ()> *d, tid_t th)
-            : thread(th) {
+            : thread(th), site(NULL), priority(NORMAL), deadline(~0ull),
+              enqueued(0), next(NULL) {
             dg.swap(*d);
         }
+
+        /// Whether it should go ahead of a thread's own queue
+        bool urgent() const { return priority == HIGH || deadline != ~0ull; }
+        void assign(boost::shared_ptr<Fiber> f, tid_t th)
+        { fiber.swap(f); thread = th; }
+        void assign(boost::shared_ptr<Fiber> *f, tid_t th)
+        { fiber.swap(*f); thread = th; }
+        void assign(boost::function<void ()> d, tid_t th)
+        { dg.swap(d); thread = th; }
+        void assign(boost::function<void ()> *d, tid_t th)
+        { dg.swap(*d); thread = th; }
+    };
+    /// Per-thread run queue used in work stealing mode
+    struct WorkQueue : boost::noncopyable
+    {
+        WorkQueue(tid_t th) : thread(th) {}
+
+        tid_t thread;
+        boost::mutex mutex;
+        std::deque<FiberAndThread> fibers;
     };
     static ThreadLocalStorage<Scheduler *> t_scheduler;
     static ThreadLocalStorage<Fiber *> t_fiber;
+    static ThreadLocalStorage<WorkQueue *> t_workQueue;
+    // How the work running on a thread was scheduled
+    struct Dispatched
+    {
+        Priority priority;
+        unsigned long long deadline;
+    };
+    static ThreadLocalStorage<const Dispatched *> t_dispatched;
+    static boost::thread_specific_ptr<NodeCache> t_nodeCache;
     boost::mutex m_mutex;
-    std::list<FiberAndThread> m_fibers;
+    // Intrusive MPSC queue that schedule() pushes onto without taking any
+    // lock; whoever holds m_mutex drains it into m_fibers
+    volatile intptr_t m_injectHead;
+    FiberAndThread *m_injectTail;
+    FiberAndThread m_injectStub;
+    // Intrusive lists of work that has been drained but not yet run, one
+    // per Priority (indexed by priority - HIGH), plus one in deadline order;
+    // protected by m_mutex
+    enum {
+        HIGH_LIST = HIGH - HIGH,
+        NORMAL_LIST = NORMAL - HIGH,
+        LOW_LIST = LOW - HIGH,
+        DEADLINE_LIST,
+        SHARED_LISTS
+    };
+    FiberAndThread *m_fibers[SHARED_LISTS];
+    FiberAndThread * volatile *m_fibersTail[SHARED_LISTS];
+    // How much work has been dispatched, from the shared lists or from a
+    // per-thread queue; the starvation limit is measured against it
+    volatile size_t m_dispatched;
+    // Everything in either the injection queue or m_fibers
+    volatile size_t m_sharedCount;
+    // The part of m_sharedCount that is HIGH or has a deadline; while there's
+    // any, threads look at the shared lists before their own queue
+    volatile size_t m_urgentCount;
+    // Protected by m_mutex; only walked when a thread goes looking for work
+    std::vector<boost::shared_ptr<WorkQueue> > m_workQueues;
+    volatile size_t m_localCount;
+    bool m_workStealing;
     tid_t m_rootThread;
     boost::shared_ptr<Fiber> m_rootFiber;
     boost::shared_ptr<Fiber> m_callingFiber;
@@ -510,13 +510,29 @@ suckylsp:
             }
         }
 #else
-        if (!::connect(m_sock, to.name(), to.nameLen())) {
+        int rc = -EINPROGRESS;
+        if (m_ioManager->completionIo() && !m_cancelledSend) {
+            // Let the kernel wait for the connection to finish
+            Timer::ptr timeout;
+            if (m_sendTimeout != ~0ull)
+                timeout = m_ioManager->registerConditionTimer(m_sendTimeout,
+                    boost::bind(&Socket::cancelIo, this, IOManager::WRITE,
+                        boost::ref(m_cancelledSend), ETIMEDOUT),
+                    weak_ptr(shared_from_this()));
+            rc = m_ioManager->asyncConnect(m_sock, to.name(), to.nameLen());
+            if (timeout)
+                timeout->cancel();
+            if (rc && m_cancelledSend)
+                rc = -m_cancelledSend;
+        } else if (!::connect(m_sock, to.name(), to.nameLen())) {
+            rc = 0;
+        } else {
+            rc = -errno;
+        }
+        if (!rc) {
             MORDOR_LOG_INFO(g_log) << this << " connect(" << m_sock << ", "
                 << to << ") local: " << *(localAddress());
-            // Worked first time
-            return;
-        }
-        if (errno == EINPROGRESS) {
+        } else if (rc == -EINPROGRESS) {
             m_ioManager->registerEvent(m_sock, IOManager::WRITE);
             if (m_cancelledSend) {
                 MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
@@ -551,8 +567,8 @@ suckylsp:
                 << to << ") local: " << *(localAddress());
         } else {
             MORDOR_LOG_ERROR(g_log) << this << " connect(" << m_sock << ", " << to
-                << "): (" << lastError() << ")";
-            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("connect");
+                << "): (" << -rc << ")";
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(-rc, "connect");
         }
 #endif
         m_isConnected = true;
@@ -749,6 +765,25 @@ suckylsp:
             newsock = ::accept(m_sock, NULL, NULL);
             error = errno;
         } while (newsock == -1 && error == EINTR);
+        if (newsock == -1 && error == EAGAIN &&
+            m_ioManager->completionIo() && !m_cancelledReceive) {
+            // Let the kernel wait for a connection
+            Timer::ptr timeout;
+            if (m_receiveTimeout != ~0ull)
+                timeout = m_ioManager->registerConditionTimer(m_receiveTimeout,
+                    boost::bind(&Socket::cancelIo, this, IOManager::READ,
+                        boost::ref(m_cancelledReceive), ETIMEDOUT),
+                    weak_ptr(shared_from_this()));
+            newsock = m_ioManager->asyncAccept(m_sock, NULL, NULL);
+            if (timeout)
+                timeout->cancel();
+            error = newsock < 0 ? -newsock : 0;
+            if (newsock < 0) {
+                newsock = -1;
+                if (m_cancelledReceive)
+                    error = m_cancelledReceive;
+            }
+        }
         while (newsock == -1 && error == EAGAIN) {
             m_ioManager->registerEvent(m_sock, IOManager::READ);
             if (m_cancelledReceive) {
@@ -780,7 +815,7 @@ suckylsp:
         if (newsock == -1) {
             MORDOR_LOG_ERROR(g_log) << this << " accept(" << m_sock << "): "
                 << newsock << " (" << error << ")";
-            MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API("accept");
+            MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, "accept");
         }
         if (fcntl(newsock, F_SETFL, O_NONBLOCK) == -1) {
             ::close(newsock);
@@ -963,20 +998,39 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
         rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
         error = errno;
     } while (rc == -1 && error == EINTR);
+    // Rather than waiting to be told the socket is ready and then trying
+    // again, have the kernel do the I/O as soon as it can
+    bool completion = m_ioManager && m_ioManager->completionIo();
     while (m_ioManager && rc == -1 && error == EAGAIN) {
-        m_ioManager->registerEvent(m_sock, event);
+        if (!completion)
+            m_ioManager->registerEvent(m_sock, event);
         Timer::ptr timer;
         if (timeout != ~0ull)
             timer = m_ioManager->registerConditionTimer(timeout,
                 boost::bind(&Socket::cancelIo, this, event, boost::ref(cancelled), ETIMEDOUT),
                 weak_ptr(shared_from_this()));
-        Scheduler::yieldTo();
+        if (completion) {
+            rc = isSend ? m_ioManager->asyncSendmsg(m_sock, &msg, flags) :
+                m_ioManager->asyncRecvmsg(m_sock, &msg, flags);
+            error = rc < 0 ? -rc : 0;
+            if (rc < 0)
+                rc = -1;
+        } else {
+            Scheduler::yieldTo();
+        }
         if (timer)
             timer->cancel();
-        if (cancelled) {
+        // If the operation completed before it could be cancelled, the data
+        // has been transferred; report it, and the cancellation next time
+        if (cancelled && rc == -1) {
             MORDOR_SOCKET_LOG(-1, cancelled);
             MORDOR_THROW_EXCEPTION_FROM_ERROR_API(cancelled, api);
         }
+        if (completion) {
+            // Only without IORING_FEAT_FAST_POLL; wait for readiness instead
+            completion = error != EAGAIN;
+            continue;
+        }
         do {
             rc = isSend ? sendmsg(m_sock, &msg, flags) : recvmsg(m_sock, &msg, flags);
             error = errno;
@@ -984,7 +1038,7 @@ Socket::doIO(iovec *buffers, size_t length, int &flags, Address *address)
     }
     MORDOR_SOCKET_LOG(rc, error);
     if (rc == -1)
-        MORDOR_THROW_EXCEPTION_FROM_LAST_ERROR_API(api);
+        MORDOR_THROW_EXCEPTION_FROM_ERROR_API(error, api);
     if (!isSend)
         flags = msg.msg_flags;
     return rc;
@@ -231,6 +231,61 @@ struct AverageMinMaxStatistic : AverageStatistic<T>
     }
 };
 
+/// Counts values in power-of-two buckets
+
+/// Bucket 0 counts zeros; bucket i counts values in [2^(i-1), 2^i)
+template <class T>
+struct HistogramStatistic : Statistic
+{
+    typedef T value_type;
+
+    HistogramStatistic(const char *units = NULL)
+        : Statistic(units)
+    { reset(); }
+
+    volatile unsigned long long buckets[sizeof(T) * 8 + 1];
+
+    void reset()
+    {
+        for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); ++i)
+            buckets[i] = 0;
+    }
+
+    static size_t bucket(value_type value)
+    {
+        size_t result = 0;
+        while (value) {
+            value >>= 1;
+            ++result;
+        }
+        return result;
+    }
+
+    void update(value_type value) { atomicIncrement(buckets[bucket(value)]); }
+
+    /// Serializes the non-empty buckets as "lower bound+: count, ..."
+    std::ostream &serialize(std::ostream &os) const
+    {
+        bool first = true;
+        for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); ++i) {
+            unsigned long long count = buckets[i];
+            if (!count)
+                continue;
+            if (!first)
+                os << ", ";
+            first = false;
+            os << (i == 0 ? 0ull : 1ull << (i - 1)) << "+: " << count;
+        }
+        return os;
+    }
+
+    void merge(const HistogramStatistic<T> &stat)
+    {
+        for (size_t i = 0; i < sizeof(buckets) / sizeof(buckets[0]); ++i)
+            atomicAdd(buckets[i], (unsigned long long)stat.buckets[i]);
+    }
+};
+
 template <class T, class U>
 struct ThroughputStatistic : Statistic
 {
@@ -2,11 +2,43 @@
 
 #include "buffer.h"
 
+#include <stdlib.h>
 #include <string.h>
 #include <algorithm>
+#include <new>
+
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
 
 #include "mordor/assert.h"
-#include "mordor/util.h"
+#include "mordor/atomic.h"
+#include "mordor/config.h"
+#include "mordor/fibersynchronization.h"
+#include "mordor/scheduler.h"
+#include "mordor/statistics.h"
+#include "mordor/thread_local_storage.h"
+
+#if defined(X86_64) && (defined(GCC) || defined(MSVC))
+#   define MORDOR_BUFFER_SSE2
+#   define MORDOR_BUFFER_AVX2
+#   ifdef MSVC
+#       include <intrin.h>
+#       define MORDOR_TARGET_AVX2
+#   else
+#       define MORDOR_TARGET_AVX2 __attribute__((target("avx2")))
+#   endif
+#   include <immintrin.h>
+#elif defined(ARM64) && defined(GCC)
+#   define MORDOR_BUFFER_NEON
+#   include <arm_neon.h>
+#endif
 
 #ifdef WINDOWS
 static u_long iovLength(size_t length)
@@ -22,7 +54,678 @@ static size_t iovLength(size_t length)
 
 namespace Mordor {
 
+static ConfigVar<size_t>::ptr g_slabCacheSize = Config::lookup<size_t>(
+    "buffer.slabcache", 1048576u,
+    "Bytes of freed Buffer segments, of all slab sizes together, that each "
+    "thread keeps for reuse.  0 disables the cache.");
+static ConfigVar<std::string>::ptr g_simd = Config::lookup<std::string>(
+    "buffer.simd", std::string("auto"),
+    "Instruction set Buffer::find scans with: auto, avx2, sse2, neon or "
+    "none.  One the CPU lacks means auto.");
+static ConfigVar<size_t>::ptr g_mmapThreshold = Config::lookup<size_t>(
+    "buffer.mmapthreshold", 0u,
+    "Buffer segments of at least this many bytes are allocated with mmap "
+    "instead of from the heap.  0 disables.");
+static ConfigVar<bool>::ptr g_hugePages = Config::lookup<bool>(
+    "buffer.hugepages", false,
+    "Back mmapped Buffer segments with transparent huge pages.  Ones smaller "
+    "than a huge page are carved from per-thread huge page arenas; bigger "
+    "ones are aligned to huge pages.");
+static ConfigVar<size_t>::ptr g_mmapCacheSize = Config::lookup<size_t>(
+    "buffer.mmapcache", 8388608u,
+    "Bytes of freed mmapped Buffer segments and arenas that each thread "
+    "keeps for reuse.");
+static ConfigVar<bool>::ptr g_accounting = Config::lookup<bool>(
+    "buffer.accounting", false,
+    "Count the bytes held by all Buffers in buffer.bytes, not just those "
+    "tagged with a BufferAccount.  Implied by buffer.softlimit and "
+    "buffer.hardlimit.");
+static ConfigVar<size_t>::ptr g_softLimit = Config::lookup<size_t>(
+    "buffer.softlimit", 0u,
+    "Once all Buffers together hold this many bytes, Buffer::reserve and "
+    "copyIn park the calling Fiber until they drop back below it.  0 "
+    "disables.");
+static ConfigVar<size_t>::ptr g_hardLimit = Config::lookup<size_t>(
+    "buffer.hardlimit", 0u,
+    "Buffer::reserve and copyIn fail rather than let all Buffers together "
+    "hold more than this many bytes.  0 disables.");
+
+static MaxStatistic<size_t> &g_peakBytes =
+    Statistics::registerStatistic("buffer.peakbytes",
+        MaxStatistic<size_t>("bytes"),
+        "Most bytes held by accounted Buffers at once");
+static CountStatistic<unsigned long long> &g_limitWaits =
+    Statistics::registerStatistic("buffer.limitwaits",
+        CountStatistic<unsigned long long>(),
+        "Buffer::reserve and copyIn calls that waited for a soft limit");
+static CountStatistic<unsigned long long> &g_limitFailures =
+    Statistics::registerStatistic("buffer.limitfailures",
+        CountStatistic<unsigned long long>(),
+        "Buffer::reserve and copyIn calls that failed for a hard limit");
+
+// Payload sizes (Block header not included) that are carved from per-thread
+// slabs; anything smaller than a quarter of the smallest isn't worth a whole
+// one, and anything bigger than the largest goes straight to the heap.
+// Powers of two, so that reserve()'s doubling of a power of two lands
+// exactly on one; the largest covers doubling a 64K read.
+static const size_t g_slabSizes[] =
+    { 4096, 8192, 16384, 32768, 65536, 131072 };
+static const size_t g_slabClasses =
+    sizeof(g_slabSizes) / sizeof(g_slabSizes[0]);
+static const size_t g_segmentCacheSize = 1024;
+#ifndef WINDOWS
+static const size_t g_hugePageSize = 2 * 1024 * 1024;
+// Where each carved arena allocation starts
+static const size_t g_arenaAlignment = 64;
+#endif
+
+namespace {
+
+// Freed allocations of one size, linked through their first word
+struct FreeList
+{
+    FreeList() : head(NULL), count(0) {}
+
+    void push(void *p)
+    {
+        *(void **)p = head;
+        head = p;
+        ++count;
+    }
+
+    void *pop()
+    {
+        void *p = head;
+        if (p) {
+            head = *(void **)p;
+            --count;
+        }
+        return p;
+    }
+
+    void *head;
+    size_t count;
+};
+
+#ifndef WINDOWS
+// Freed mappings of any size, linked through their first word, with their
+// size in the second
+struct MappingList
+{
+    MappingList() : head(NULL), bytes(0) {}
+
+    void push(void *p, size_t size)
+    {
+        ((void **)p)[0] = head;
+        ((size_t *)p)[1] = size;
+        head = p;
+        bytes += size;
+    }
+
+    /// Unlinks the first mapping of between minSize and maxSize bytes
+    void *take(size_t minSize, size_t maxSize, size_t &size)
+    {
+        for (void **link = &head; *link; link = (void **)*link) {
+            void *p = *link;
+            size = ((size_t *)p)[1];
+            if (size >= minSize && size <= maxSize) {
+                *link = *(void **)p;
+                bytes -= size;
+                return p;
+            }
+        }
+        return NULL;
+    }
+
+    void *head;
+    size_t bytes;
+};
+#endif
+
+}
+
+struct SlabCache
+{
+#ifndef WINDOWS
+    SlabCache() : slabBytes(0), arena(NULL), arenaUsed(0) {}
+#else
+    SlabCache() : slabBytes(0) {}
+#endif
+    ~SlabCache();
+
+#ifndef WINDOWS
+    Buffer::Block *allocateMapped(size_t size, bool huge);
+    Buffer::Block *allocateFromArena(size_t size);
+#endif
+
+    FreeList segments;
+    FreeList slabs[g_slabClasses];
+    // Bytes held in slabs, against buffer.slabcache
+    size_t slabBytes;
+#ifndef WINDOWS
+    MappingList mappings;
+    // The huge page arena this thread is carving from, which it holds a
+    // reference to, and how much of it is gone
+    Buffer::Block *arena;
+    size_t arenaUsed;
+#endif
+};
+
+// t_slabCache owns each thread's cache, and is a boost::tss so that it is
+// freed when the thread exits; t_fastSlabCache is a ThreadLocalStorage copy
+// of the same pointer, because it's faster to look up.  Neither is ever
+// destroyed, so that Buffers freed during static destruction can still look
+// them up.
+static boost::thread_specific_ptr<SlabCache> &t_slabCache()
+{
+    static boost::thread_specific_ptr<SlabCache> *cache =
+        new boost::thread_specific_ptr<SlabCache>();
+    return *cache;
+}
+
+static ThreadLocalStorage<SlabCache *> &t_fastSlabCache()
+{
+    static ThreadLocalStorage<SlabCache *> *cache =
+        new ThreadLocalStorage<SlabCache *>();
+    return *cache;
+}
+
+SlabCache::~SlabCache()
+{
+#ifndef WINDOWS
+    // Let go of the arena first, so if it's free it lands in mappings
+    if (arena)
+        arena->release();
+    arena = NULL;
+    size_t size;
+    while (void *p = mappings.take(0, ~(size_t)0, size))
+        munmap(p, size);
+#endif
+    t_fastSlabCache() = NULL;
+    while (void *p = segments.pop())
+        free(p);
+    for (size_t i = 0; i < g_slabClasses; ++i)
+        while (void *p = slabs[i].pop())
+            free(p);
+}
+
+static SlabCache &slabCache()
+{
+    SlabCache *cache = t_fastSlabCache().get();
+    if (!cache) {
+        cache = new SlabCache();
+        t_slabCache().reset(cache);
+        t_fastSlabCache() = cache;
+    }
+    return *cache;
+}
+
+static void *allocateOrThrow(size_t size)
+{
+    void *p = malloc(size);
+    if (!p)
+        MORDOR_THROW_EXCEPTION(std::bad_alloc());
+    return p;
+}
+
+#ifndef WINDOWS
+static size_t pageSize()
+{
+    static size_t result = (size_t)sysconf(_SC_PAGESIZE);
+    return result;
+}
+
+static size_t roundUp(size_t size, size_t multiple)
+{
+    return (size + multiple - 1) / multiple * multiple;
+}
+
+// size must already be a multiple of the page size, or of the huge page size
+// if huge
+static void *mapOrThrow(size_t size, bool huge)
+{
+    size_t slop = huge ? g_hugePageSize : 0;
+    void *p = mmap(NULL, size + slop, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        MORDOR_THROW_EXCEPTION(std::bad_alloc());
+    if (huge) {
+        // Only whole, aligned huge pages can be backed by one
+        size_t head = (g_hugePageSize - (size_t)p % g_hugePageSize) %
+            g_hugePageSize;
+        if (head != 0)
+            munmap(p, head);
+        munmap((unsigned char *)p + head + size, slop - head);
+        p = (unsigned char *)p + head;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+    return p;
+}
+
+// A MAPPED Block of at least size bytes (header included), reusing one this
+// thread freed if it's close enough in size
+Buffer::Block *
+SlabCache::allocateMapped(size_t size, bool huge)
+{
+    size = roundUp(size, huge ? g_hugePageSize : pageSize());
+    size_t mapped = size;
+    void *p = mappings.take(size, size * 2, mapped);
+    if (!p)
+        p = mapOrThrow(size, huge);
+    Buffer::Block *block = (Buffer::Block *)p;
+    block->refs = 1;
+    block->sizeClass = Buffer::Block::MAPPED;
+    block->base = p;
+    block->mapped = mapped;
+    block->tally = NULL;
+    return block;
+}
+
+// Carves size bytes (header included) from this thread's huge page arena,
+// starting a new one if it's used up
+Buffer::Block *
+SlabCache::allocateFromArena(size_t size)
+{
+    size = roundUp(size, g_arenaAlignment);
+    if (!arena || arenaUsed + size > arena->mapped) {
+        // Retired; whoever frees its last allocation frees it
+        if (arena)
+            arena->release();
+        arena = NULL;
+        arena = allocateMapped(g_hugePageSize, true);
+        arenaUsed = roundUp(sizeof(Buffer::Block), g_arenaAlignment);
+    }
+    Buffer::Block *block = (Buffer::Block *)((unsigned char *)arena +
+        arenaUsed);
+    arenaUsed += size;
+    arena->acquire();
+    block->refs = 1;
+    block->sizeClass = Buffer::Block::ARENA;
+    block->base = arena;
+    block->mapped = size;
+    block->tally = NULL;
+    return block;
+}
+#endif
+
+struct BufferTally : boost::noncopyable
+{
+    BufferTally(size_t softLimit = 0, size_t hardLimit = 0,
+        BufferTally *group = NULL)
+        : refs(1),
+          bytes(0),
+          softLimit(softLimit),
+          hardLimit(hardLimit),
+          group(group),
+          waiting(0)
+    {}
+
+    /// @return bytes afterwards
+    size_t add(size_t length) { return atomicAdd(bytes, length); }
+    void remove(size_t length)
+    {
+        size_t remaining = atomicAdd(bytes, (size_t)0 - length);
+        if (waiting != 0 && remaining < softLimit)
+            wakeAll();
+    }
+    void admit(size_t length);
+    /// Throw BufferLimitExceededException if length more bytes would go over
+    /// hardLimit
+    void enforceHardLimit(size_t length);
+    void wakeAll();
+    void release()
+    {
+        if (atomicDecrement(refs) == 0)
+            delete this;
+    }
+
+    // The BufferAccount's, plus one for each Block charged to it
+    volatile size_t refs;
+    volatile size_t bytes;
+    volatile size_t softLimit, hardLimit;
+    // buffer.bytes.<name>'s, which is never freed, if the account is named
+    BufferTally *group;
+    // Fibers in admit(), counted before they look at bytes, so that remove()
+    // can tell whether to wake anyone without locking
+    volatile size_t waiting;
+    boost::mutex mutex;
+    FiberWaitQueue waiters;
+};
+
+void
+BufferTally::admit(size_t length)
+{
+    // Threads that aren't running a Scheduler can't be parked
+    if (softLimit != 0 && bytes >= softLimit && Scheduler::getThis()) {
+        g_limitWaits.increment();
+        do {
+            FiberWaiter waiter;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                atomicIncrement(waiting);
+                if (softLimit == 0 || bytes < softLimit) {
+                    atomicDecrement(waiting);
+                    break;
+                }
+                waiters.push(waiter);
+            }
+            Scheduler::yieldTo();
+            atomicDecrement(waiting);
+        } while (softLimit != 0 && bytes >= softLimit);
+    }
+    enforceHardLimit(length);
+}
+
+void
+BufferTally::enforceHardLimit(size_t length)
+{
+    size_t limit = hardLimit;
+    if (limit != 0 && bytes + length > limit) {
+        g_limitFailures.increment();
+        MORDOR_THROW_EXCEPTION(BufferLimitExceededException());
+    }
+}
+
+void
+BufferTally::wakeAll()
+{
+    FiberWaitQueue runnables;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        runnables.swap(waiters);
+    }
+    // They each check for themselves whether there's room now
+    while (FiberWaiter *runnable = runnables.pop())
+        runnable->wake();
+}
+
+// Never destroyed, so that Buffers freed during static destruction can still
+// use it
+static BufferTally &globalTally()
+{
+    static BufferTally *tally = new BufferTally();
+    return *tally;
+}
+
+namespace {
+
+// Reports a tally's bytes; resetting the statistics mustn't lose track of
+// what is still held
+struct HeldBytesStatistic : Statistic
+{
+    HeldBytesStatistic(BufferTally *_tally)
+        : Statistic("bytes"),
+          tally(_tally)
+    {}
+
+    BufferTally *tally;
+
+    void reset() {}
+    std::ostream &serialize(std::ostream &os) const
+    { return os << tally->bytes; }
+};
+
+HeldBytesStatistic &g_bytes = Statistics::registerStatistic("buffer.bytes",
+    HeldBytesStatistic(&globalTally()),
+    "Bytes held by accounted Buffers");
+
+// Whether Buffers without a BufferAccount are charged to globalTally()
+volatile bool g_accountAll;
+
+void updateAccounting()
+{
+    BufferTally &global = globalTally();
+    global.softLimit = g_softLimit->val();
+    global.hardLimit = g_hardLimit->val();
+    g_accountAll = g_accounting->val() || global.softLimit != 0 ||
+        global.hardLimit != 0;
+    // The soft limit may have gone up
+    global.wakeAll();
+}
+
+struct AccountingConfig
+{
+    AccountingConfig()
+    {
+        g_accounting->onChange.connect(boost::bind(&updateAccounting));
+        g_softLimit->onChange.connect(boost::bind(&updateAccounting));
+        g_hardLimit->onChange.connect(boost::bind(&updateAccounting));
+        updateAccounting();
+    }
+} g_accountingConfig;
+
+// The tally behind buffer.bytes.<name>, registering it the first time
+BufferTally *namedTally(const std::string &name)
+{
+    static boost::mutex mutex;
+    boost::mutex::scoped_lock lock(mutex);
+    std::string statistic = "buffer.bytes." + name;
+    if (HeldBytesStatistic *existing =
+        Statistics::lookup<HeldBytesStatistic>(statistic))
+        return existing->tally;
+    BufferTally *tally = new BufferTally();
+    Statistics::registerStatistic(statistic, HeldBytesStatistic(tally),
+        "Bytes held by Buffers of BufferAccounts named " + name);
+    return tally;
+}
+
+}
+
+BufferAccount::BufferAccount(const std::string &name, size_t softLimit,
+    size_t hardLimit)
+    : m_tally(new BufferTally(softLimit, hardLimit,
+          name.empty() ? NULL : namedTally(name)))
+{}
+
+BufferAccount::~BufferAccount()
+{
+    // Blocks still charged to it keep it alive
+    m_tally->release();
+}
+
+size_t
+BufferAccount::bytes() const
+{
+    return m_tally->bytes;
+}
+
+size_t
+BufferAccount::softLimit() const
+{
+    return m_tally->softLimit;
+}
+
+void
+BufferAccount::softLimit(size_t limit)
+{
+    m_tally->softLimit = limit;
+    m_tally->wakeAll();
+}
+
+size_t
+BufferAccount::hardLimit() const
+{
+    return m_tally->hardLimit;
+}
+
+void
+BufferAccount::hardLimit(size_t limit)
+{
+    m_tally->hardLimit = limit;
+}
+
+Buffer::Block *
+Buffer::Block::allocate(size_t length)
+{
+    BOOST_STATIC_ASSERT(HEAP == g_slabClasses);
+    size_t size = sizeof(Block) + length;
+#ifndef WINDOWS
+    size_t threshold = g_mmapThreshold->val();
+    if (threshold != 0 && size >= threshold) {
+        SlabCache &cache = slabCache();
+        if (!g_hugePages->val())
+            return cache.allocateMapped(size, false);
+        // Small enough that a dozen or so share a huge page
+        if (size <= g_hugePageSize / 16)
+            return cache.allocateFromArena(size);
+        return cache.allocateMapped(size, size >= g_hugePageSize);
+    }
+#endif
+    size_t sizeClass = HEAP;
+    if (length > g_slabSizes[0] / 4) {
+        for (size_t i = 0; i < g_slabClasses; ++i) {
+            if (length <= g_slabSizes[i]) {
+                sizeClass = i;
+                size = sizeof(Block) + g_slabSizes[i];
+                break;
+            }
+        }
+    }
+    void *p = NULL;
+    if (sizeClass != HEAP) {
+        if (SlabCache *cache = t_fastSlabCache().get()) {
+            p = cache->slabs[sizeClass].pop();
+            if (p)
+                cache->slabBytes -= size;
+        }
+    }
+    if (!p)
+        p = allocateOrThrow(size);
+    Block *block = (Block *)p;
+    block->refs = 1;
+    block->sizeClass = sizeClass;
+    block->mapped = size;
+    block->tally = NULL;
+    return block;
+}
+
+Buffer::Block *
+Buffer::Block::adopt()
+{
+    Block *block = (Block *)allocateOrThrow(sizeof(Block));
+    block->refs = 1;
+    block->sizeClass = ADOPTED;
+    block->tally = NULL;
+    return block;
+}
+
+Buffer::Block *
+Buffer::Block::adoptMapping(void *base, size_t mapped)
+{
+    Block *block = (Block *)allocateOrThrow(sizeof(Block));
+    block->refs = 1;
+    block->sizeClass = FILE;
+    block->base = base;
+    block->mapped = mapped;
+    block->tally = NULL;
+    return block;
+}
+
+size_t
+Buffer::Block::capacity() const
+{
+    MORDOR_ASSERT(sizeClass <= HEAP || sizeClass == MAPPED ||
+        sizeClass == ARENA);
+    return mapped - sizeof(Block);
+}
+
+void
+Buffer::Block::charge(BufferTally *tally)
+{
+    MORDOR_ASSERT(sizeClass <= HEAP || sizeClass == MAPPED ||
+        sizeClass == ARENA);
+    charged = mapped;
+    this->tally = tally;
+    BufferTally &global = globalTally();
+    if (tally != &global) {
+        atomicIncrement(tally->refs);
+        tally->add(charged);
+        if (tally->group)
+            tally->group->add(charged);
+    }
+    g_peakBytes.update(global.add(charged));
+}
+
+void
+Buffer::Block::acquire()
+{
+    // Inline storage nobody refers to yet can only be claimed by its own
+    // (non-const) Buffer, so no-one can race us
+    if (sizeClass == INLINE && refs == 1)
+        refs = 2;
+    else
+        atomicIncrement(refs);
+}
+
+void
+Buffer::Block::release()
+{
+    // Only its own Buffer's Segments refer to inline storage, and the
+    // Buffer itself holds the last reference.  Otherwise atomic, because
+    // const Buffers can be read (and so sliced) from several threads at once.
+    if (sizeClass == INLINE) {
+        if (refs == 2)
+            refs = 1;
+        else
+            atomicDecrement(refs);
+        return;
+    }
+    // Nobody else can take a reference if we hold the only one
+    if (refs != 1 && atomicDecrement(refs) != 0)
+        return;
+    if (tally) {
+        BufferTally &global = globalTally();
+        if (tally != &global) {
+            tally->remove(charged);
+            if (tally->group)
+                tally->group->remove(charged);
+            tally->release();
+        }
+        global.remove(charged);
+    }
+    switch (sizeClass) {
+#ifndef WINDOWS
+        case MAPPED:
+        {
+            SlabCache &cache = slabCache();
+            if (cache.mappings.bytes + mapped <= g_mmapCacheSize->val())
+                cache.mappings.push(this, mapped);
+            else
+                munmap(this, mapped);
+            return;
+        }
+        case ARENA:
+            // The arena itself stays put until all of it is free
+            ((Block *)base)->release();
+            return;
+#endif
+        case FILE:
+#ifdef WINDOWS
+            UnmapViewOfFile(base);
+#else
+            munmap(base, mapped);
+#endif
+            break;
+        default:
+            if (sizeClass < g_slabClasses) {
+                // Whichever thread frees it keeps it, so the cap is on the
+                // total, or a thread that only ever frees would hoard
+                SlabCache &cache = slabCache();
+                if (cache.slabBytes + mapped <= g_slabCacheSize->val()) {
+                    cache.slabs[sizeClass].push(this);
+                    cache.slabBytes += mapped;
+                    return;
+                }
+            }
+            break;
+    }
+    free(this);
+}
+
 Buffer::SegmentData::SegmentData()
+    : m_block(NULL)
 {
     start(NULL);
     length(0);
@@ -30,18 +733,55 @@ Buffer::SegmentData::SegmentData()
 
 Buffer::SegmentData::SegmentData(size_t length)
 {
-    m_array.reset(new unsigned char[length]);
-    start(m_array.get());
+    m_block = Block::allocate(length);
+    start(m_block->data());
     this->length(length);
 }
 
 Buffer::SegmentData::SegmentData(void *buffer, size_t length)
 {
-    m_array.reset((unsigned char *)buffer, &nop<unsigned char *>);
-    start(m_array.get());
+    m_block = Block::adopt();
+    start(buffer);
+    this->length(length);
+}
+
+Buffer::SegmentData::SegmentData(Block *block, void *start, size_t length)
+    : m_block(block)
+{
+    if (m_block)
+        m_block->acquire();
+    this->start(start);
     this->length(length);
 }
 
+Buffer::SegmentData::SegmentData(const SegmentData &copy)
+    : m_start(copy.m_start),
+      m_length(copy.m_length),
+      m_block(copy.m_block)
+{
+    if (m_block)
+        m_block->acquire();
+}
+
+Buffer::SegmentData::~SegmentData()
+{
+    if (m_block)
+        m_block->release();
+}
+
+Buffer::SegmentData &
+Buffer::SegmentData::operator =(const SegmentData &copy)
+{
+    if (copy.m_block)
+        copy.m_block->acquire();
+    if (m_block)
+        m_block->release();
+    m_block = copy.m_block;
+    m_start = copy.m_start;
+    m_length = copy.m_length;
+    return *this;
+}
+
 Buffer::SegmentData
 Buffer::SegmentData::slice(size_t start, size_t length)
 {
@@ -49,11 +789,8 @@ Buffer::SegmentData::slice(size_t start, size_t length)
         length = this->length() - start;
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
-    SegmentData result;
-    result.m_array = m_array;
-    result.start((unsigned char*)this->start() + start);
-    result.length(length);
-    return result;
+    return SegmentData(m_block, (unsigned char*)this->start() + start,
+        length);
 }
 
 const Buffer::SegmentData
@@ -63,11 +800,8 @@ Buffer::SegmentData::slice(size_t start, size_t length) const
         length = this->length() - start;
     MORDOR_ASSERT(start <= this->length());
     MORDOR_ASSERT(length + start <= this->length());
-    SegmentData result;
-    result.m_array = m_array;
-    result.start((unsigned char*)this->start() + start);
-    result.length(length);
-    return result;
+    return SegmentData(m_block, (unsigned char*)this->start() + start,
+        length);
 }
 
 void
@@ -95,6 +829,36 @@ Buffer::Segment::Segment(void *buffer, size_t length)
     invariant();
 }
 
+Buffer::Segment::Segment(Block *block, void *start, size_t length)
+: m_writeIndex(0), m_data(block, start, length)
+{
+    invariant();
+}
+
+void *
+Buffer::Segment::operator new(size_t size)
+{
+    MORDOR_ASSERT(size == sizeof(Segment));
+    if (SlabCache *cache = t_fastSlabCache().get()) {
+        if (void *p = cache->segments.pop())
+            return p;
+    }
+    return allocateOrThrow(size);
+}
+
+void
+Buffer::Segment::operator delete(void *p)
+{
+    if (!p)
+        return;
+    SlabCache &cache = slabCache();
+    if (cache.segments.count >= g_segmentCacheSize) {
+        free(p);
+        return;
+    }
+    cache.segments.push(p);
+}
+
 size_t
 Buffer::Segment::readAvailable() const
 {
@@ -129,7 +893,9 @@ Buffer::Segment::consume(size_t length)
 {
     MORDOR_ASSERT(length <= readAvailable());
     m_writeIndex -= length;
-    m_data = m_data.slice(length);
+    // Same allocation, so no need to touch the refcount
+    m_data.start((unsigned char *)m_data.start() + length);
+    m_data.length(m_data.length() - length);
     invariant();
 }
 
@@ -139,7 +905,7 @@ Buffer::Segment::truncate(size_t length)
     MORDOR_ASSERT(length <= readAvailable());
     MORDOR_ASSERT(m_writeIndex = readAvailable());
     m_writeIndex = length;
-    m_data = m_data.slice(0, length);
+    m_data.length(length);
     invariant();
 }
 
@@ -177,6 +943,38 @@ Buffer::Segment::invariant() const
     MORDOR_ASSERT(m_writeIndex <= m_data.length());
 }
 
+Buffer::SegmentList::iterator
+Buffer::SegmentList::insert(iterator position, Segment *segment)
+{
+    SegmentLink *next = position.m_link;
+    segment->m_next = next;
+    segment->m_prev = next->m_prev;
+    next->m_prev->m_next = segment;
+    next->m_prev = segment;
+    ++m_size;
+    return iterator(segment);
+}
+
+Buffer::SegmentList::iterator
+Buffer::SegmentList::erase(iterator position)
+{
+    MORDOR_ASSERT(position != end());
+    Segment *segment = &*position;
+    SegmentLink *next = segment->m_next;
+    segment->m_prev->m_next = next;
+    next->m_prev = segment->m_prev;
+    --m_size;
+    delete segment;
+    return iterator(next);
+}
+
+Buffer::SegmentList::iterator
+Buffer::SegmentList::erase(iterator first, iterator last)
+{
+    while (first != last)
+        first = erase(first);
+    return last;
+}
 
 Buffer::Buffer()
 {
@@ -221,6 +1019,18 @@ Buffer::operator =(const Buffer &copy)
     return *this;
 }
 
+void
+Buffer::account(BufferAccount::ptr account)
+{
+    m_account = account;
+}
+
+BufferAccount::ptr
+Buffer::account() const
+{
+    return m_account;
+}
+
 size_t
 Buffer::readAvailable() const
 {
@@ -243,7 +1053,7 @@ void
 Buffer::adopt(void *buffer, size_t length)
 {
     invariant();
-    Segment newSegment(buffer, length);
+    Segment *newSegment = new Segment(buffer, length);
     if (readAvailable() == 0) {
         // put the new buffer at the front if possible to avoid
         // fragmentation
@@ -260,12 +1070,39 @@ Buffer::adopt(void *buffer, size_t length)
     invariant();
 }
 
+void
+Buffer::adoptMapping(void *base, size_t mapped, const void *start,
+    size_t length)
+{
+    MORDOR_ASSERT((const unsigned char *)start >= (unsigned char *)base);
+    MORDOR_ASSERT((const unsigned char *)start + length <=
+        (unsigned char *)base + mapped);
+    invariant();
+    SegmentData data(Block::adoptMapping(base, mapped), (void *)start,
+        length);
+    // data holds the only reference we want
+    data.m_block->release();
+    if (length == 0)
+        return;
+    // Split any mixed read/write bufs
+    if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
+        m_segments.insert(m_writeIt, new Segment(m_writeIt->readBuffer()));
+        m_writeIt->consume(m_writeIt->readAvailable());
+    }
+    // Read only, so never any write space
+    m_segments.insert(m_writeIt, new Segment(data));
+    m_readAvailable += length;
+    invariant();
+}
+
 void
 Buffer::reserve(size_t length)
 {
     if (writeAvailable() < length) {
         // over-reserve to avoid fragmentation
-        Segment newSegment(length * 2 - writeAvailable());
+        size_t size = length * 2 - writeAvailable();
+        // Whatever the allocation rounded up to is write space too
+        Segment *newSegment = allocateSegment(size, true);
         if (readAvailable() == 0) {
             // put the new buffer at the front if possible to avoid
             // fragmentation
@@ -278,7 +1115,7 @@ Buffer::reserve(size_t length)
                 --m_writeIt;
             }
         }
-        m_writeAvailable += newSegment.length();
+        m_writeAvailable += newSegment->length();
         invariant();
     }
 }
@@ -289,8 +1126,8 @@ Buffer::compact()
     invariant();
     if (m_writeIt != m_segments.end()) {
         if (m_writeIt->readAvailable() > 0) {
-            Segment newSegment = Segment(m_writeIt->readBuffer());
-            m_segments.insert(m_writeIt, newSegment);
+            m_segments.insert(m_writeIt,
+                new Segment(m_writeIt->readBuffer()));
         }
         m_writeIt = m_segments.erase(m_writeIt, m_segments.end());
         m_writeAvailable = 0;
@@ -359,11 +1196,11 @@ Buffer::truncate(size_t length)
         return;
     // Split any mixed read/write bufs
     if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
+        m_segments.insert(m_writeIt, new Segment(m_writeIt->readBuffer()));
         m_writeIt->consume(m_writeIt->readAvailable());
     }
     m_readAvailable = length;
-    std::list<Segment>::iterator it;
+    SegmentList::iterator it;
     for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
         Segment &segment = *it;
         if (length <= segment.readAvailable()) {
@@ -392,7 +1229,7 @@ Buffer::readBuffers(size_t length) const
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         size_t toConsume = (std::min)(it->readAvailable(), remaining);
         SegmentData data = it->readBuffer().slice(0, toConsume);
@@ -452,27 +1289,28 @@ Buffer::readBuffer(size_t length, bool coalesce) const
     if (m_writeIt != m_segments.end() && m_writeIt->writeAvailable()
         >= readAvailable()) {
         copyOut(m_writeIt->writeBuffer().start(), readAvailable());
-        Segment newSegment = Segment(m_writeIt->writeBuffer().slice(0,
+        Segment *newSegment = new Segment(m_writeIt->writeBuffer().slice(0,
             readAvailable()));
         _this->m_segments.clear();
         _this->m_segments.push_back(newSegment);
         _this->m_writeAvailable = 0;
         _this->m_writeIt = _this->m_segments.end();
         invariant();
-        SegmentData data = newSegment.readBuffer().slice(0, length);
+        SegmentData data = newSegment->readBuffer().slice(0, length);
         result.iov_base = data.start();
         result.iov_len = iovLength(data.length());
         return result;
     }
-    Segment newSegment = Segment(readAvailable());
-    copyOut(newSegment.writeBuffer().start(), readAvailable());
-    newSegment.produce(readAvailable());
+    Segment *newSegment = _this->allocateSegment(readAvailable(), false,
+        false);
+    copyOut(newSegment->writeBuffer().start(), readAvailable());
+    newSegment->produce(readAvailable());
     _this->m_segments.clear();
     _this->m_segments.push_back(newSegment);
     _this->m_writeAvailable = 0;
     _this->m_writeIt = _this->m_segments.end();
     invariant();
-    SegmentData data = newSegment.readBuffer().slice(0, length);
+    SegmentData data = newSegment->readBuffer().slice(0, length);
     result.iov_base = data.start();
     result.iov_len = iovLength(data.length());
     return result;
@@ -487,7 +1325,7 @@ Buffer::writeBuffers(size_t length)
     std::vector<iovec> result;
     result.reserve(m_segments.size());
     size_t remaining = length;
-    std::list<Segment>::iterator it = m_writeIt;
+    SegmentList::iterator it = m_writeIt;
     while (remaining > 0) {
         Segment& segment = *it;
         size_t toProduce = (std::min)(segment.writeAvailable(), remaining);
@@ -573,12 +1411,12 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
 
     // Split any mixed read/write bufs
     if (m_writeIt != m_segments.end() && m_writeIt->readAvailable() != 0) {
-        m_segments.insert(m_writeIt, Segment(m_writeIt->readBuffer()));
+        m_segments.insert(m_writeIt, new Segment(m_writeIt->readBuffer()));
         m_writeIt->consume(m_writeIt->readAvailable());
         invariant();
     }
 
-    std::list<Segment>::const_iterator it = buffer.m_segments.begin();
+    SegmentList::const_iterator it = buffer.m_segments.begin();
     while (pos != 0 && it != buffer.m_segments.end()) {
         if (pos < it->readAvailable())
             break;
@@ -588,12 +1426,23 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
     MORDOR_ASSERT(it != buffer.m_segments.end());
     for (; it != buffer.m_segments.end(); ++it) {
         size_t toConsume = (std::min)(it->readAvailable() - pos, length);
+        if (it->m_data.m_block->sizeClass == Block::INLINE) {
+            // Can't outlive the other Buffer, so can't be shared
+            copyInReadSegment((const char *)it->readBuffer().start() + pos,
+                toConsume);
+            m_readAvailable += toConsume;
+            length -= toConsume;
+            pos = 0;
+            if (length == 0)
+                break;
+            continue;
+        }
         if (m_readAvailable != 0 && it == buffer.m_segments.begin()) {
-            std::list<Segment>::iterator previousIt = m_writeIt;
+            SegmentList::iterator previousIt = m_writeIt;
             --previousIt;
             if ((char *)previousIt->readBuffer().start() +
                 previousIt->readBuffer().length() == (char *)it->readBuffer().start() + pos &&
-                previousIt->m_data.m_array.get() == it->m_data.m_array.get()) {
+                previousIt->m_data.m_block == it->m_data.m_block) {
                 MORDOR_ASSERT(previousIt->writeAvailable() == 0);
                 previousIt->extend(toConsume);
                 m_readAvailable += toConsume;
@@ -604,8 +1453,8 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
                 continue;
             }
         }
-        Segment newSegment = Segment(it->readBuffer().slice(pos, toConsume));
-        m_segments.insert(m_writeIt, newSegment);
+        m_segments.insert(m_writeIt,
+            new Segment(it->readBuffer().slice(pos, toConsume)));
         m_readAvailable += toConsume;
         length -= toConsume;
         pos = 0;
@@ -616,6 +1465,31 @@ Buffer::copyIn(const Buffer &buffer, size_t length, size_t pos)
     MORDOR_ASSERT(readAvailable() >= length);
 }
 
+void
+Buffer::copyInReadSegment(const void *data, size_t length)
+{
+    if (m_readAvailable != 0) {
+        SegmentList::iterator previousIt = m_writeIt;
+        --previousIt;
+        const unsigned char *end =
+            (const unsigned char *)previousIt->readBuffer().start() +
+            previousIt->readAvailable();
+        if (previousIt->m_data.m_block == &m_inline.block &&
+            end == m_inline.data + m_inline.used &&
+            m_inline.used + length <= sizeof(m_inline.data)) {
+            MORDOR_ASSERT(previousIt->writeAvailable() == 0);
+            memcpy(m_inline.data + m_inline.used, data, length);
+            m_inline.used += length;
+            previousIt->extend(length);
+            return;
+        }
+    }
+    Segment *newSegment = allocateSegment(length);
+    memcpy(newSegment->writeBuffer().start(), data, length);
+    newSegment->produce(length);
+    m_segments.insert(m_writeIt, newSegment);
+}
+
 void
 Buffer::copyIn(const void *data, size_t length)
 {
@@ -635,10 +1509,9 @@ Buffer::copyIn(const void *data, size_t length)
     }
 
     if (length > 0) {
-        Segment newSegment(length);
-        memcpy(newSegment.writeBuffer().start(), data, length);
-        newSegment.produce(length);
-        m_segments.push_back(newSegment);
+        // Out of write space, so m_writeIt is end(); this grows the inline
+        // segment in place if there's room, so small appends don't spill
+        copyInReadSegment(data, length);
         m_readAvailable += length;
     }
 
@@ -665,7 +1538,7 @@ Buffer::copyOut(void *buffer, size_t length, size_t pos) const
 
     MORDOR_ASSERT(length + pos <= readAvailable());
     unsigned char *next = (unsigned char*)buffer;
-    std::list<Segment>::const_iterator it = m_segments.begin();
+    SegmentList::const_iterator it = m_segments.begin();
     while (pos != 0 && it != m_segments.end()) {
         if (pos < it->readAvailable())
             break;
@@ -685,6 +1558,428 @@ Buffer::copyOut(void *buffer, size_t length, size_t pos) const
     MORDOR_ASSERT(length == 0);
 }
 
+// Search kernels for find().  Each scans one contiguous run of bytes; find()
+// stitches segments together.  Which ones run is picked once, from the CPU's
+// features and buffer.simd.
+namespace {
+
+struct FindKernels
+{
+    const char *name;
+    /// @return Offset of the first c in [p, p + n), or n
+    size_t (*findByte)(const unsigned char *p, size_t n, unsigned char c);
+    /// Find a needle of at least two bytes lying entirely within [p, p + n),
+    /// checking its first and last bytes at many positions at once; NULL if
+    /// there is no such kernel
+    /// @return Offset of the first match, or n
+    size_t (*findPair)(const unsigned char *p, size_t n,
+        const unsigned char *needle, size_t m);
+};
+
+size_t
+findByteGeneric(const unsigned char *p, size_t n, unsigned char c)
+{
+    const void *point = memchr(p, c, n);
+    return point ? (const unsigned char *)point - p : n;
+}
+
+#if defined(MORDOR_BUFFER_SSE2) || defined(MORDOR_BUFFER_AVX2)
+inline unsigned int lowestBit(unsigned int mask)
+{
+#ifdef MSVC
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+inline unsigned int lowestBit64(unsigned long long mask)
+{
+#ifdef MSVC
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+#endif
+
+#ifdef MORDOR_BUFFER_SSE2
+size_t
+findByteSse2(const unsigned char *p, size_t n, unsigned char c)
+{
+    const __m128i target = _mm_set1_epi8((char)c);
+    size_t i = 0;
+    // Four vectors per test, so the branch is taken once per 64 bytes
+    for (; i + 64 <= n; i += 64) {
+        __m128i eq0 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p + i)), target);
+        __m128i eq1 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p + i + 16)), target);
+        __m128i eq2 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p + i + 32)), target);
+        __m128i eq3 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(p + i + 48)), target);
+        __m128i any = _mm_or_si128(_mm_or_si128(eq0, eq1),
+            _mm_or_si128(eq2, eq3));
+        if (_mm_movemask_epi8(any)) {
+            unsigned long long mask =
+                (unsigned long long)_mm_movemask_epi8(eq0) |
+                ((unsigned long long)_mm_movemask_epi8(eq1) << 16) |
+                ((unsigned long long)_mm_movemask_epi8(eq2) << 32) |
+                ((unsigned long long)_mm_movemask_epi8(eq3) << 48);
+            return i + lowestBit64(mask);
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, target));
+        if (mask)
+            return i + lowestBit(mask);
+    }
+    return i + findByteGeneric(p + i, n - i, c);
+}
+
+size_t
+findPairSse2(const unsigned char *p, size_t n,
+    const unsigned char *needle, size_t m)
+{
+    MORDOR_ASSERT(m >= 2);
+    const __m128i first = _mm_set1_epi8((char)needle[0]);
+    const __m128i last = _mm_set1_epi8((char)needle[m - 1]);
+    const unsigned char *q = p;
+    if (n >= m - 1 + 32) {
+        const unsigned char *end = p + n - (m - 1) - 32;
+        while (q <= end) {
+            // Kept free of calls, so nothing has to be spilled
+            unsigned int mask;
+            do {
+                __m128i match0 = _mm_and_si128(
+                    _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)q), first),
+                    _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(q + m - 1)), last));
+                __m128i match1 = _mm_and_si128(
+                    _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(q + 16)), first),
+                    _mm_cmpeq_epi8(
+                        _mm_loadu_si128((const __m128i *)(q + 16 + m - 1)),
+                        last));
+                mask = _mm_movemask_epi8(match0) |
+                    (_mm_movemask_epi8(match1) << 16);
+                if (mask)
+                    break;
+                q += 32;
+            } while (q <= end);
+            for (; mask; mask &= mask - 1) {
+                unsigned int bit = lowestBit(mask);
+                if (memcmp(q + bit + 1, needle + 1, m - 2) == 0)
+                    return q - p + bit;
+            }
+            if (q <= end)
+                q += 32;
+        }
+    }
+    // Fewer than 32 positions left
+    for (; q + m <= p + n; ++q) {
+        if (q[0] == needle[0] && q[m - 1] == needle[m - 1] &&
+            memcmp(q + 1, needle + 1, m - 2) == 0)
+            return q - p;
+    }
+    return n;
+}
+
+const FindKernels g_sse2Kernels =
+    { "sse2", &findByteSse2, &findPairSse2 };
+#endif
+
+#ifdef MORDOR_BUFFER_AVX2
+MORDOR_TARGET_AVX2 size_t
+findByteAvx2(const unsigned char *p, size_t n, unsigned char c)
+{
+    const __m256i target = _mm256_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 128 <= n; i += 128) {
+        __m256i eq0 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(p + i)), target);
+        __m256i eq1 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(p + i + 32)), target);
+        __m256i eq2 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(p + i + 64)), target);
+        __m256i eq3 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(p + i + 96)), target);
+        __m256i any = _mm256_or_si256(_mm256_or_si256(eq0, eq1),
+            _mm256_or_si256(eq2, eq3));
+        if (_mm256_movemask_epi8(any)) {
+            unsigned long long low =
+                (unsigned int)_mm256_movemask_epi8(eq0) |
+                ((unsigned long long)(unsigned int)_mm256_movemask_epi8(eq1)
+                    << 32);
+            if (low)
+                return i + lowestBit64(low);
+            unsigned long long high =
+                (unsigned int)_mm256_movemask_epi8(eq2) |
+                ((unsigned long long)(unsigned int)_mm256_movemask_epi8(eq3)
+                    << 32);
+            return i + 64 + lowestBit64(high);
+        }
+    }
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(block, target));
+        if (mask)
+            return i + lowestBit(mask);
+    }
+    return i + findByteSse2(p + i, n - i, c);
+}
+
+MORDOR_TARGET_AVX2 size_t
+findPairAvx2(const unsigned char *p, size_t n,
+    const unsigned char *needle, size_t m)
+{
+    MORDOR_ASSERT(m >= 2);
+    if (n < m - 1 + 64)
+        return findPairSse2(p, n, needle, m);
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[m - 1]);
+    const unsigned char *q = p;
+    const unsigned char *end = p + n - (m - 1) - 64;
+    while (q <= end) {
+        unsigned long long mask;
+        do {
+            __m256i match0 = _mm256_and_si256(
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)q), first),
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)(q + m - 1)), last));
+            __m256i match1 = _mm256_and_si256(
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)(q + 32)), first),
+                _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)(q + 32 + m - 1)),
+                    last));
+            mask = (unsigned int)_mm256_movemask_epi8(match0) |
+                ((unsigned long long)(unsigned int)
+                    _mm256_movemask_epi8(match1) << 32);
+            if (mask)
+                break;
+            q += 64;
+        } while (q <= end);
+        for (; mask; mask &= mask - 1) {
+            unsigned int bit = lowestBit64(mask);
+            if (memcmp(q + bit + 1, needle + 1, m - 2) == 0)
+                return q - p + bit;
+        }
+        if (q <= end)
+            q += 64;
+    }
+    return (q - p) + findPairSse2(q, n - (q - p), needle, m);
+}
+
+const FindKernels g_avx2Kernels =
+    { "avx2", &findByteAvx2, &findPairAvx2 };
+
+bool haveAvx2()
+{
+#ifdef MSVC
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    // The CPU has AVX, and the OS saves the YMM registers
+    __cpuid(info, 1);
+    if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & 0x20) != 0;
+#else
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+#ifdef MORDOR_BUFFER_NEON
+// Narrows a byte comparison to four bits per byte, since NEON has no movemask
+inline unsigned long long neonMask(uint8x16_t eq)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+size_t
+findByteNeon(const unsigned char *p, size_t n, unsigned char c)
+{
+    const uint8x16_t target = vdupq_n_u8(c);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        unsigned long long mask = neonMask(vceqq_u8(vld1q_u8(p + i), target));
+        if (mask)
+            return i + (__builtin_ctzll(mask) >> 2);
+    }
+    return i + findByteGeneric(p + i, n - i, c);
+}
+
+size_t
+findPairNeon(const unsigned char *p, size_t n,
+    const unsigned char *needle, size_t m)
+{
+    MORDOR_ASSERT(m >= 2);
+    const uint8x16_t first = vdupq_n_u8(needle[0]);
+    const uint8x16_t last = vdupq_n_u8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        unsigned long long mask = neonMask(vandq_u8(
+            vceqq_u8(vld1q_u8(p + i), first),
+            vceqq_u8(vld1q_u8(p + i + m - 1), last)));
+        while (mask) {
+            unsigned int bit = __builtin_ctzll(mask) >> 2;
+            if (memcmp(p + i + bit + 1, needle + 1, m - 2) == 0)
+                return i + bit;
+            mask &= ~(0xfull << (bit << 2));
+        }
+    }
+    for (; i + m <= n; ++i) {
+        if (p[i] == needle[0] && p[i + m - 1] == needle[m - 1] &&
+            memcmp(p + i + 1, needle + 1, m - 2) == 0)
+            return i;
+    }
+    return n;
+}
+
+const FindKernels g_neonKernels =
+    { "neon", &findByteNeon, &findPairNeon };
+#endif
+
+const FindKernels g_genericKernels = { "none", &findByteGeneric, NULL };
+
+/// kernels.findByte, but calling memchr directly if that's what it is, as it
+/// is under auto with glibc
+inline size_t
+scanByte(const FindKernels &kernels, const unsigned char *p, size_t n,
+    unsigned char c)
+{
+    if (kernels.findByte == &findByteGeneric)
+        return findByteGeneric(p, n, c);
+    return kernels.findByte(p, n, c);
+}
+
+/// Find a needle of at least two bytes lying entirely within [p, p + n)
+/// @param partial Set, if there's no match, to the offset of the first
+/// occurrence of the needle's first byte in the last m - 1 bytes, or n
+/// @return Offset of the first match, or n
+size_t
+findString(const FindKernels &kernels, const unsigned char *p, size_t n,
+    const unsigned char *needle, size_t m, size_t &partial)
+{
+    MORDOR_ASSERT(m >= 2);
+    // Skipping to each occurrence of the first byte is fastest while it's
+    // rare; once it turns out not to be, check both ends of the needle at
+    // once instead.  The skips run to the very end, so the same scan finds
+    // where a match straddling into what follows could start.
+    size_t i = 0, falsePositives = 0;
+    while (i < n) {
+        i += scanByte(kernels, p + i, n - i, needle[0]);
+        if (i + m > n)
+            break;
+        if (memcmp(p + i + 1, needle + 1, m - 1) == 0)
+            return i;
+        ++i;
+        if (kernels.findPair && ++falsePositives >= 8 &&
+            falsePositives * 64 > i) {
+            size_t found = i + kernels.findPair(p + i, n - i, needle, m);
+            if (found < n)
+                return found;
+            i = (std::max)(i, n - (m - 1));
+            i += scanByte(kernels, p + i, n - i, needle[0]);
+            break;
+        }
+    }
+    partial = (std::min)(i, n);
+    return n;
+}
+
+const FindKernels *bestFindKernels()
+{
+#ifdef MORDOR_BUFFER_AVX2
+    if (haveAvx2())
+        return &g_avx2Kernels;
+#endif
+#ifdef MORDOR_BUFFER_SSE2
+    return &g_sse2Kernels;
+#elif defined(MORDOR_BUFFER_NEON)
+    return &g_neonKernels;
+#else
+    return &g_genericKernels;
+#endif
+}
+
+FindKernels makeAutoFindKernels()
+{
+    FindKernels result = *bestFindKernels();
+#ifdef __GLIBC__
+    // glibc's memchr already picks the widest vectors the CPU has, and
+    // unrolls further than ours
+    result.findByte = &findByteGeneric;
+#endif
+    return result;
+}
+
+const FindKernels *selectFindKernels(const std::string &name)
+{
+    if (name == "none")
+        return &g_genericKernels;
+#ifdef MORDOR_BUFFER_SSE2
+    // Every x86_64 CPU has SSE2, so it can be forced even alongside AVX2
+    if (name == "sse2")
+        return &g_sse2Kernels;
+#endif
+    const FindKernels *best = bestFindKernels();
+    if (name == best->name)
+        return best;
+    // auto, and anything this CPU can't do
+    static const FindKernels autoKernels = makeAutoFindKernels();
+    return &autoKernels;
+}
+
+bool verifyFindKernels(const std::string &name)
+{
+    return name == "auto" || name == "avx2" || name == "sse2" ||
+        name == "neon" || name == "none";
+}
+
+const FindKernels *volatile g_findKernels;
+
+void resetFindKernels(const std::string &)
+{
+    g_findKernels = NULL;
+}
+
+const FindKernels &findKernels()
+{
+    const FindKernels *kernels = g_findKernels;
+    if (!kernels) {
+        // Racing threads all pick the same thing
+        kernels = selectFindKernels(g_simd->val());
+        g_findKernels = kernels;
+    }
+    return *kernels;
+}
+
+struct FindKernelsConfig
+{
+    FindKernelsConfig()
+    {
+        g_simd->beforeChange.connect(&verifyFindKernels);
+        g_simd->onChange.connect(&resetFindKernels);
+    }
+} g_findKernelsConfig;
+
+}
+
 ptrdiff_t
 Buffer::find(char delimiter, size_t length) const
 {
@@ -692,26 +1987,24 @@ Buffer::find(char delimiter, size_t length) const
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
 
+    const FindKernels &kernels = findKernels();
     size_t totalLength = 0;
-    bool success = false;
 
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
+        // Not readBuffer(), which would take and drop a reference
+        const unsigned char *start =
+            (const unsigned char *)it->m_data.start();
         size_t toscan = (std::min)(length, it->readAvailable());
-        const void *point = memchr(start, delimiter, toscan);
-        if (point != NULL) {
-            success = true;
-            totalLength += (unsigned char*)point - (unsigned char*)start;
-            break;
-        }
+        size_t found = scanByte(kernels, start, toscan,
+            (unsigned char)delimiter);
+        if (found < toscan)
+            return totalLength + found;
         totalLength += toscan;
         length -= toscan;
         if (length == 0)
             break;
     }
-    if (success)
-        return totalLength;
     return -1;
 }
 
@@ -722,52 +2015,63 @@ Buffer::find(const std::string &string, size_t length) const
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
     MORDOR_ASSERT(!string.empty());
-
+    if (string.size() == 1)
+        return find(string[0], length);
+
+    const FindKernels &kernels = findKernels();
+    const unsigned char *needle = (const unsigned char *)string.c_str();
+    unsigned char first = needle[0];
+    size_t overlap = string.size() - 1;
+    // Bytes from before the current segment that a match might start in,
+    // followed by its first overlap bytes, so matches straddling segments
+    // can be found
+    unsigned char stackWindow[512];
+    std::vector<unsigned char> heapWindow;
+    unsigned char *window = stackWindow;
+    if (overlap * 2 > sizeof(stackWindow)) {
+        heapWindow.resize(overlap * 2);
+        window = &heapWindow[0];
+    }
+    size_t carried = 0;
     size_t totalLength = 0;
-    size_t foundSoFar = 0;
 
-    std::list<Segment>::const_iterator it;
-    for (it = m_segments.begin(); it != m_segments.end(); ++it) {
-        const void *start = it->readBuffer().start();
+    SegmentList::const_iterator it;
+    for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
+        // Not readBuffer(), which would take and drop a reference
+        const unsigned char *start =
+            (const unsigned char *)it->m_data.start();
         size_t toscan = (std::min)(length, it->readAvailable());
-        while (toscan > 0) {
-            if (foundSoFar == 0) {
-                const void *point = memchr(start, string[0], toscan);
-                if (point != NULL) {
-                    foundSoFar = 1;
-                    size_t found = (unsigned char*)point -
-                        (unsigned char*)start;
-                    toscan -= found + 1;
-                    length -= found + 1;
-                    totalLength += found;
-                    start = (unsigned char*)point + 1;
-                } else {
-                    totalLength += toscan;
-                    length -= toscan;
-                    toscan = 0;
-                    continue;
-                }
-            }
-            MORDOR_ASSERT(foundSoFar != 0);
-            size_t tocompare = (std::min)(toscan, string.size() - foundSoFar);
-            if (memcmp(start, string.c_str() + foundSoFar, tocompare) == 0) {
-                foundSoFar += tocompare;
-                toscan -= tocompare;
-                length -= tocompare;
-                if (foundSoFar == string.size())
-                    break;
-            } else {
-                totalLength += foundSoFar;
-                foundSoFar = 0;
-            }
+        size_t partial;
+        if (carried > 0) {
+            size_t head = (std::min)(overlap, toscan);
+            memcpy(window + carried, start, head);
+            size_t found = findString(kernels, window, carried + head,
+                needle, string.size(), partial);
+            if (found < carried)
+                return totalLength - carried + found;
         }
-        if (foundSoFar == string.size())
-            break;
-        if (length == 0)
-            break;
+        size_t found = findString(kernels, start, toscan, needle,
+            string.size(), partial);
+        if (found < toscan)
+            return totalLength + found;
+        // Carry the last overlap bytes scanned, from the first one that
+        // could start a match; usually there is none, and nothing to copy
+        if (toscan >= overlap) {
+            carried = toscan - partial;
+            memcpy(window, start + partial, carried);
+        } else {
+            // A short segment; what we had may still start a match
+            if (carried == 0)
+                memcpy(window, start, toscan);
+            size_t keep = (std::min)(carried + toscan, overlap);
+            const unsigned char *tail = window + carried + toscan - keep;
+            size_t skip = scanByte(kernels, tail, keep, first);
+            carried = keep - skip;
+            memmove(window, tail + skip, carried);
+        }
+        totalLength += toscan;
+        length -= toscan;
     }
-    if (foundSoFar == string.size())
-        return totalLength;
     return -1;
 }
 
@@ -830,7 +2134,7 @@ Buffer::visit(boost::function<void (const void *, size_t)> dg, size_t length) co
         length = readAvailable();
     MORDOR_ASSERT(length <= readAvailable());
 
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end() && length > 0; ++it) {
         size_t todo = (std::min)(length, it->readAvailable());
         MORDOR_ASSERT(todo != 0);
@@ -890,10 +2194,53 @@ Buffer::operator!= (const char *string) const
     return opCmp(string, length) != 0;
 }
 
+Buffer::Segment *
+Buffer::allocateSegment(size_t length, bool whole, bool limited)
+{
+    // m_inline is already paid for
+    if (length <= sizeof(m_inline.data) && m_inline.available()) {
+        m_inline.used = length;
+        return new Segment(&m_inline.block, m_inline.data, length);
+    }
+    if (limited)
+        admit(length);
+    Segment *segment = new Segment(length);
+    Block *block = segment->m_data.m_block;
+    if (whole)
+        segment->m_data.length(block->capacity());
+    BufferTally *tally = m_account ? m_account->m_tally :
+        g_accountAll ? &globalTally() : NULL;
+    if (!tally)
+        return segment;
+    if (limited) {
+        // admit() could only go by what was asked for, but what's charged is
+        // rounded up to a slab size or to pages, header included
+        try {
+            tally->enforceHardLimit(block->mapped);
+            if (g_accountAll && tally != &globalTally())
+                globalTally().enforceHardLimit(block->mapped);
+        } catch (...) {
+            delete segment;
+            throw;
+        }
+    }
+    block->charge(tally);
+    return segment;
+}
+
+void
+Buffer::admit(size_t length)
+{
+    if (m_account)
+        m_account->m_tally->admit(length);
+    if (g_accountAll)
+        globalTally().admit(length);
+}
+
 int
 Buffer::opCmp(const Buffer &rhs) const
 {
-    std::list<Segment>::const_iterator leftIt, rightIt;
+    SegmentList::const_iterator leftIt, rightIt;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)rhs.readAvailable());
     leftIt = m_segments.begin(); rightIt = rhs.m_segments.begin();
     size_t leftOffset = 0, rightOffset = 0;
@@ -929,7 +2276,7 @@ int
 Buffer::opCmp(const char *string, size_t length) const
 {
     size_t offset = 0;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     int lengthResult = (int)((ptrdiff_t)readAvailable() - (ptrdiff_t)length);
     if (lengthResult > 0)
         length = readAvailable();
@@ -953,7 +2300,7 @@ Buffer::invariant() const
     size_t read = 0;
     size_t write = 0;
     bool seenWrite = false;
-    std::list<Segment>::const_iterator it;
+    SegmentList::const_iterator it;
     for (it = m_segments.begin(); it != m_segments.end(); ++it) {
         const Segment &segment = *it;
         // Strict ordering
@@ -965,7 +2312,7 @@ Buffer::invariant() const
             MORDOR_ASSERT(m_writeIt == it);
         }
         // We should keep segments optimally merged together
-        std::list<Segment>::const_iterator nextIt = it;
+        SegmentList::const_iterator nextIt = it;
         ++nextIt;
         if (nextIt != m_segments.end()) {
             const Segment& next = *nextIt;
@@ -973,12 +2320,12 @@ Buffer::invariant() const
                 next.readAvailable() != 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.readBuffer().start() +
                     segment.readAvailable() != next.readBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block != next.m_data.m_block);
             } else if (segment.writeAvailable() != 0 &&
                 next.readAvailable() == 0) {
                 MORDOR_ASSERT((const unsigned char*)segment.writeBuffer().start() +
                     segment.writeAvailable() != next.writeBuffer().start() ||
-                    segment.m_data.m_array.get() != next.m_data.m_array.get());
+                    segment.m_data.m_block != next.m_data.m_block);
             }
         }
     }
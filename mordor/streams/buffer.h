@@ -1,19 +1,133 @@
 #ifndef __MORDOR_BUFFER_H__
 #define __MORDOR_BUFFER_H__
 
-#include <list>
 #include <vector>
 
-#include <boost/shared_array.hpp>
 #include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
 
 #include "mordor/socket.h"
 
 namespace Mordor {
 
+struct Buffer;
+// What an account holds and may hold, in buffer.cpp
+struct BufferTally;
+
+/// Bytes of Buffer segments allocated on behalf of one owner, such as a
+/// connection, a request or a tenant
+
+/// Buffers are tagged with Buffer::account().  What they allocate from then
+/// on counts against the BufferAccount (and the process-wide buffer.bytes)
+/// until the last Buffer sharing it lets go, even if that is after the
+/// BufferAccount is gone.  Buffer::reserve() and Buffer::copyIn() (and so
+/// writeBuffers(), and the streams that append through them) enforce the
+/// limits, which are approximate when several threads allocate at once.
+/// Copies readBuffer() makes to coalesce segments are charged but not held
+/// to them.
+class BufferAccount : boost::noncopyable
+{
+    friend struct Buffer;
+public:
+    typedef boost::shared_ptr<BufferAccount> ptr;
+
+public:
+    /// @param name If not empty, bytes() is also added to the statistic
+    /// buffer.bytes.<name>, which every BufferAccount of that name shares
+    /// @param softLimit See softLimit(size_t)
+    /// @param hardLimit See hardLimit(size_t)
+    BufferAccount(const std::string &name = std::string(),
+        size_t softLimit = 0, size_t hardLimit = 0);
+    ~BufferAccount();
+
+    size_t bytes() const;
+
+    size_t softLimit() const;
+    /// Once this many bytes are held, reserve() and copyIn() park the
+    /// calling Fiber until they drop back below it; 0 for no limit
+    void softLimit(size_t limit);
+    size_t hardLimit() const;
+    /// reserve() and copyIn() throw BufferLimitExceededException rather
+    /// than go over this many bytes; 0 for no limit
+    void hardLimit(size_t limit);
+
+private:
+    BufferTally *m_tally;
+};
+
 struct Buffer
 {
+    // Per-thread caches of freed allocations, in buffer.cpp
+    friend struct SlabCache;
 private:
+    // Every owned segment allocation starts with a Block, so the refcount
+    // lives next to the bytes instead of in allocations of its own; adopt()ed
+    // memory and file mappings get a lone Block that points elsewhere
+    struct Block
+    {
+        enum {
+            // Allocations below this come from per-thread slabs
+            HEAP = 6,
+            ADOPTED,
+            INLINE,
+            // Anonymous mmap; the Block is at its start
+            MAPPED,
+            // Carved from a MAPPED huge page arena, which base points to
+            ARENA,
+            // A read-only file mapping from adoptMapping()
+            FILE
+        };
+
+        // How many SegmentDatas share this allocation
+        volatile size_t refs;
+        // Index of the slab size this came from, or one of the above
+        size_t sizeClass;
+        // The whole mapping, for MAPPED and FILE; the arena, and how much
+        // was carved from it, for ARENA; just the size of the allocation
+        // (header included) for the rest of allocate()'s
+        void *base;
+        size_t mapped;
+        // Who this is charged to, if anyone, and how much
+        BufferTally *tally;
+        size_t charged;
+
+        unsigned char *data() { return (unsigned char *)(this + 1); }
+
+        /// At least length bytes of data, rounded up to a slab size or to
+        /// pages
+        static Block *allocate(size_t length);
+        static Block *adopt();
+        static Block *adoptMapping(void *base, size_t mapped);
+        /// How many bytes of data there's room for, if from allocate()
+        size_t capacity() const;
+        /// Charge the whole of this allocation (from allocate()) to tally
+        void charge(BufferTally *tally);
+        void acquire();
+        void release();
+    };
+
+    // Small payloads live inside the Buffer itself.  Segments of it are never
+    // shared with other Buffers (copyIn(const Buffer &) copies them instead),
+    // so it is free again as soon as the Buffer's own Segments let go of it.
+    struct InlineStorage : boost::noncopyable
+    {
+        InlineStorage()
+            : used(0)
+        {
+            block.refs = 1;
+            block.sizeClass = Block::INLINE;
+            block.tally = NULL;
+        }
+
+        bool available() const { return block.refs == 1; }
+
+        Block block;
+        // How much of data the current allocation from it extends over
+        size_t used;
+        unsigned char data[256];
+    };
+
     struct SegmentData
     {
         friend struct Buffer;
@@ -21,6 +135,10 @@ private:
         SegmentData();
         SegmentData(size_t length);
         SegmentData(void *buffer, size_t length);
+        SegmentData(const SegmentData &copy);
+        ~SegmentData();
+
+        SegmentData &operator =(const SegmentData &copy);
 
         SegmentData slice(size_t start, size_t length = ~0);
         const SegmentData slice(size_t start, size_t length = ~0) const;
@@ -32,21 +150,35 @@ private:
         const void *start() const { return m_start; }
         size_t length() const { return m_length; }
     private:
+        SegmentData(Block *block, void *start, size_t length);
+
         void start(void *p) { m_start = p; }
         void length(size_t l) { m_length = l; }
         void *m_start;
         size_t m_length;
     private:
-        boost::shared_array<unsigned char> m_array;
+        // Shared by every slice of the same allocation; NULL if empty
+        Block *m_block;
     };
 
-    struct Segment
+    struct SegmentLink
+    {
+        SegmentLink *m_prev, *m_next;
+    };
+
+    struct Segment : SegmentLink
     {
         friend struct Buffer;
     public:
         Segment(size_t len);
         Segment(SegmentData);
         Segment(void *buffer, size_t length);
+        /// Write space over part of an existing allocation
+        Segment(Block *block, void *start, size_t length);
+
+        // Segments come from a per-thread pool
+        static void *operator new(size_t size);
+        static void operator delete(void *p);
 
         size_t readAvailable() const;
         size_t writeAvailable() const;
@@ -66,6 +198,75 @@ private:
         void invariant() const;
     };
 
+    class SegmentList;
+
+    template <class T>
+    class SegmentIterator
+    {
+        template <class U> friend class SegmentIterator;
+        friend class SegmentList;
+    public:
+        SegmentIterator() : m_link(NULL) {}
+        explicit SegmentIterator(const SegmentLink *link)
+            : m_link(const_cast<SegmentLink *>(link))
+        {}
+        template <class U>
+        SegmentIterator(const SegmentIterator<U> &copy)
+            : m_link(copy.m_link)
+        {}
+
+        T &operator *() const { return static_cast<T &>(*m_link); }
+        T *operator ->() const { return &**this; }
+        SegmentIterator &operator ++() { m_link = m_link->m_next; return *this; }
+        SegmentIterator &operator --() { m_link = m_link->m_prev; return *this; }
+
+        template <class U>
+        bool operator ==(const SegmentIterator<U> &rhs) const
+        { return m_link == rhs.m_link; }
+        template <class U>
+        bool operator !=(const SegmentIterator<U> &rhs) const
+        { return m_link != rhs.m_link; }
+
+    private:
+        SegmentLink *m_link;
+    };
+
+    /// Intrusive, circular list of the Segments it owns; iterators behave
+    /// like std::list's, but linking a Segment in never allocates
+    class SegmentList : boost::noncopyable
+    {
+    public:
+        typedef SegmentIterator<Segment> iterator;
+        typedef SegmentIterator<const Segment> const_iterator;
+
+    public:
+        SegmentList() : m_size(0) { m_head.m_prev = m_head.m_next = &m_head; }
+        ~SegmentList() { clear(); }
+
+        iterator begin() { return iterator(m_head.m_next); }
+        const_iterator begin() const { return const_iterator(m_head.m_next); }
+        iterator end() { return iterator(&m_head); }
+        const_iterator end() const { return const_iterator(&m_head); }
+        Segment &front() { return *begin(); }
+        const Segment &front() const { return *begin(); }
+        size_t size() const { return m_size; }
+
+        /// Takes ownership of segment, inserting it before position
+        iterator insert(iterator position, Segment *segment);
+        void push_front(Segment *segment) { insert(begin(), segment); }
+        void push_back(Segment *segment) { insert(end(), segment); }
+        /// Frees the Segment at position
+        /// @return The Segment after it
+        iterator erase(iterator position);
+        iterator erase(iterator first, iterator last);
+        void pop_front() { erase(begin()); }
+        void clear() { erase(begin(), end()); }
+
+    private:
+        SegmentLink m_head;
+        size_t m_size;
+    };
+
 public:
     Buffer();
     Buffer(const Buffer &copy);
@@ -80,7 +281,24 @@ public:
     // Primarily for unit tests
     size_t segments() const;
 
+    /// Charge what this Buffer allocates from now on to account, as well as
+    /// the process-wide total, and hold reserve() and copyIn() to its
+    /// limits.  Copies of
+    /// the Buffer aren't tagged.
+    void account(BufferAccount::ptr account);
+    BufferAccount::ptr account() const;
+
     void adopt(void *buffer, size_t length);
+    /// Append [start, start + length), which lies inside the read-only
+    /// mapping [base, base + mapped), as read data without copying it.
+    /// The Buffer (and any it is copied to) unmaps it once they are done
+    /// with it.
+    void adoptMapping(void *base, size_t mapped, const void *start,
+        size_t length);
+    /// @exception BufferLimitExceededException Allocating the space would go
+    /// over the BufferAccount's or the process-wide hard limit
+    /// @note Parks the calling Fiber first while the BufferAccount or the
+    /// process is at its soft limit
     void reserve(size_t length);
     void compact();
     void clear(bool clearWriteAvailableAsWell = true);
@@ -93,6 +311,12 @@ public:
     std::vector<iovec> writeBuffers(size_t length = ~0);
     iovec writeBuffer(size_t length, bool reallocate);
 
+    /// @exception BufferLimitExceededException Allocating for whatever
+    /// doesn't fit in write space (or share buf's segments) would go over
+    /// the BufferAccount's or the process-wide hard limit; what did fit has
+    /// been copied in by then
+    /// @note Parks the calling Fiber first while the BufferAccount or the
+    /// process is at its soft limit
     void copyIn(const Buffer& buf, size_t length = ~0, size_t pos = 0);
     void copyIn(const char* string);
     void copyIn(const std::string &string);
@@ -120,10 +344,27 @@ public:
     bool operator!= (const char *str) const;
 
 private:
-    std::list<Segment> m_segments;
+    // Declared first so it outlives every Segment that refers to it
+    InlineStorage m_inline;
+    SegmentList m_segments;
     size_t m_readAvailable;
     size_t m_writeAvailable;
-    std::list<Segment>::iterator m_writeIt;
+    SegmentList::iterator m_writeIt;
+    BufferAccount::ptr m_account;
+
+    /// A Segment of length bytes of write space, from m_inline if possible
+    /// @param whole Make all of the allocation write space, not just length
+    /// bytes of it
+    /// @param limited admit() it, and hold the whole allocation, not just
+    /// length bytes of it, to the hard limits
+    Segment *allocateSegment(size_t length, bool whole = false,
+        bool limited = true);
+    /// Copy data in as a new read Segment ahead of any write space, growing
+    /// the previous one in place if it ends where m_inline's allocation does
+    void copyInReadSegment(const void *data, size_t length);
+    /// Wait for, or fail for lack of, room under the limits to allocate a
+    /// segment of length bytes
+    void admit(size_t length);
 
     int opCmp(const Buffer &rhs) const;
     int opCmp(const char *string, size_t length) const;
@@ -19,11 +19,26 @@ namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:fd");
 
+// IOManager::asyncReadv/asyncWritev at the current file position, setting
+// errno on failure like readv/writev do
+static int asyncIo(IOManager *ioManager, bool write, int fd, const iovec *iov,
+    int iovcnt)
+{
+    int rc = write ? ioManager->asyncWritev(fd, iov, iovcnt) :
+        ioManager->asyncReadv(fd, iov, iovcnt);
+    if (rc < 0) {
+        errno = -rc;
+        rc = -1;
+    }
+    return rc;
+}
+
 FDStream::FDStream()
 : m_ioManager(NULL),
   m_scheduler(NULL),
   m_fd(-1),
-  m_own(false)
+  m_own(false),
+  m_asyncFile(false)
 {}
 
 void
@@ -34,8 +49,19 @@ FDStream::init(int fd, IOManager *ioManager, Scheduler *scheduler, bool own)
     m_scheduler = scheduler;
     m_fd = fd;
     m_own = own;
+    m_asyncFile = false;
     if (m_ioManager) {
-        if (fcntl(m_fd, F_SETFL, O_NONBLOCK)) {
+        struct stat statbuf;
+        if (m_ioManager->completionIo() && !fstat(m_fd, &statbuf) &&
+            S_ISREG(statbuf.st_mode)) {
+            // Regular files are always "ready", so reading or writing them
+            // blocks the thread unless io_uring does it for us.  It would
+            // honor O_NONBLOCK by failing with EAGAIN on a page cache miss,
+            // so leave that off.  Everything else is O_NONBLOCK and waits
+            // for readiness through epoll; io_uring would (on most kernels)
+            // just hand the EAGAIN back, after a wasted trip through the ring
+            m_asyncFile = true;
+        } else if (fcntl(m_fd, F_SETFL, O_NONBLOCK)) {
             error_t error = lastError();
             if (own) {
                 ::close(m_fd);
@@ -80,7 +106,9 @@ FDStream::read(Buffer &buffer, size_t length)
     if (length > 0xfffffffe)
         length = 0xfffffffe;
     std::vector<iovec> iovs = buffer.writeBuffers(length);
-    int rc = readv(m_fd, &iovs[0], iovs.size());
+    int rc = m_asyncFile ?
+        asyncIo(m_ioManager, false, m_fd, &iovs[0], iovs.size()) :
+        readv(m_fd, &iovs[0], iovs.size());
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " readv(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -105,7 +133,11 @@ FDStream::read(void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::read(m_fd, buffer, length);
+    iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+    int rc = m_asyncFile ? asyncIo(m_ioManager, false, m_fd, &iov, 1) :
+        ::read(m_fd, buffer, length);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " read(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
@@ -129,14 +161,16 @@ FDStream::write(const Buffer &buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     length = std::min(length, (size_t)std::numeric_limits<ssize_t>::max());
     const std::vector<iovec> iovs = buffer.readBuffers(length);
-    ssize_t rc = 0;
     const int count = std::min(iovs.size(), (size_t)IOV_MAX);
-    while ((rc = writev(m_fd, &iovs[0], count)) < 0 &&
-           errno == EAGAIN && m_ioManager) {
+    ssize_t rc = m_asyncFile ?
+        asyncIo(m_ioManager, true, m_fd, &iovs[0], count) :
+        writev(m_fd, &iovs[0], count);
+    while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " writev(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
         m_ioManager->registerEvent(m_fd, IOManager::WRITE);
         Scheduler::yieldTo();
+        rc = writev(m_fd, &iovs[0], count);
     }
     error_t error = lastError();
     MORDOR_LOG_LEVEL(g_log, rc < 0 ? Log::ERROR : Log::DEBUG) << this
@@ -156,7 +190,11 @@ FDStream::write(const void *buffer, size_t length)
     MORDOR_ASSERT(m_fd >= 0);
     if (length > 0xfffffffe)
         length = 0xfffffffe;
-    int rc = ::write(m_fd, buffer, length);
+    iovec iov;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = length;
+    int rc = m_asyncFile ? asyncIo(m_ioManager, true, m_fd, &iov, 1) :
+        ::write(m_fd, buffer, length);
     while (rc < 0 && errno == EAGAIN && m_ioManager) {
         MORDOR_LOG_TRACE(g_log) << this << " write(" << m_fd << ", " << length
             << "): " << rc << " (EAGAIN)";
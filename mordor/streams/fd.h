@@ -47,6 +47,8 @@ private:
     Scheduler *m_scheduler;
     int m_fd;
     bool m_own;
+    // A regular file, which epoll can't wait on, but io_uring can
+    bool m_asyncFile;
 };
 
 typedef FDStream NativeStream;
@@ -2,13 +2,29 @@
 
 #include "file.h"
 
+#include <algorithm>
+
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "buffer.h"
 #include "mordor/assert.h"
+#include "mordor/config.h"
 #include "mordor/string.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:streams:file");
 
+#ifndef WINDOWS
+static ConfigVar<size_t>::ptr g_mmapReads = Config::lookup<size_t>(
+    "filestream.mmapreads", 0u,
+    "Reads of at least this many bytes from a read-only FileStream into a "
+    "Buffer map the file instead of copying it.  0 disables.");
+#endif
+
 FileStream::FileStream()
 : m_supportsRead(false),
   m_supportsWrite(false),
@@ -97,6 +113,40 @@ FileStream::init(const std::string &path, AccessFlags accessFlags,
     m_path = path;
 }
 
+#ifndef WINDOWS
+size_t
+FileStream::read(Buffer &buffer, size_t length)
+{
+    size_t threshold = g_mmapReads->val();
+    // Something truncating the file under the mapping would get us SIGBUS;
+    // at least make sure it isn't us
+    if (threshold == 0 || length < threshold || m_supportsWrite)
+        return NativeStream::read(buffer, length);
+    long long offset = seek(0, CURRENT);
+    long long size = this->size();
+    if (offset >= size)
+        return NativeStream::read(buffer, length);
+    length = (size_t)std::min<long long>(length, size - offset);
+    static const long long pageSize = sysconf(_SC_PAGESIZE);
+    long long aligned = offset / pageSize * pageSize;
+    size_t mapped = length + (size_t)(offset - aligned);
+    void *base = mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd(), aligned);
+    error_t error = lastError();
+    MORDOR_LOG_LEVEL(g_log, base == MAP_FAILED ? Log::WARNING : Log::DEBUG)
+        << this << " mmap(" << fd() << ", " << mapped << ", " << aligned
+        << "): " << base << " (" << error << ")";
+    if (base == MAP_FAILED)
+        return NativeStream::read(buffer, length);
+    // Start reading it in now, instead of a page fault at a time when it's
+    // used (probably by a socket write that copies straight out of it)
+    madvise(base, mapped, MADV_WILLNEED);
+    buffer.adoptMapping(base, mapped,
+        (unsigned char *)base + (offset - aligned), length);
+    seek(offset + length);
+    return length;
+}
+#endif
+
 void FileStream::setSupportFlags(AccessFlags accessFlags)
 {
     m_supportsRead = accessFlags == READ || accessFlags == READWRITE;
@@ -79,6 +79,13 @@ public:
     bool supportsWrite() { return m_supportsWrite && NativeStream::supportsWrite(); }
     bool supportsSeek() { return m_supportsSeek && NativeStream::supportsSeek(); }
 
+#ifndef WINDOWS
+    using NativeStream::read;
+    /// Maps the file instead of copying from it, if filestream.mmapreads
+    /// allows it and the file is open read-only
+    size_t read(Buffer &buffer, size_t length);
+#endif
+
     std::string path() const { return m_path; }
 
 private:
@@ -1,13 +1,30 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+
+#include "mordor/config.h"
+#include "mordor/statistics.h"
 #include "mordor/streams/buffer.h"
 #include "mordor/test/test.h"
+#include "mordor/workerpool.h"
 
 using namespace Mordor;
 using namespace Mordor::Test;
 
+// Appends string as a segment of its own; a plain copyIn would grow the
+// inline one if it fits
+static void appendSegment(Buffer &b, const std::string &string)
+{
+    b.reserve(string.size());
+    b.copyIn(string);
+    b.compact();
+}
+
 MORDOR_UNITTEST(Buffer, copyInString)
 {
     Buffer b;
@@ -75,8 +92,8 @@ MORDOR_UNITTEST(Buffer, copyInOffsetMultiSegments)
 {
     Buffer b1, b2;
     b2.copyIn("hello\n");
-    b2.copyIn("foo\n");
-    b2.copyIn("bar\n");
+    appendSegment(b2, "foo\n");
+    appendSegment(b2, "bar\n");
     MORDOR_TEST_ASSERT_EQUAL(b2.segments(), 3u);
     b1.copyIn(b2, 5, 7);
     MORDOR_TEST_ASSERT_EQUAL(b1.readAvailable(), 5u);
@@ -101,7 +118,8 @@ MORDOR_UNITTEST(Buffer, copyInStringAfterAnotherSegment)
     b.copyIn("world");
     MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 10u);
     MORDOR_TEST_ASSERT_EQUAL(b.writeAvailable(), 0u);
-    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 2u);
+    // Grown in place in the inline storage
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 1u);
     MORDOR_TEST_ASSERT(b == "helloworld");
 }
 
@@ -185,7 +203,7 @@ MORDOR_UNITTEST(Buffer, copyInMerge)
 MORDOR_UNITTEST(Buffer, copyInMergePlus)
 {
     Buffer b1, b2("hello");
-    b2.copyIn("world");
+    appendSegment(b2, "world");
     MORDOR_TEST_ASSERT_EQUAL(b2.segments(), 2u);
     b1.copyIn(b2, 2);
     b2.consume(2);
@@ -505,7 +523,7 @@ MORDOR_UNITTEST(Buffer, visitMultipleSegments)
     Buffer b;
     int sequence = 0;
     b.copyIn("a");
-    b.copyIn("bc");
+    appendSegment(b, "bc");
     b.visit(boost::bind(&visitor3, _1, _2, boost::ref(sequence)));
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 3);
 }
@@ -515,7 +533,7 @@ MORDOR_UNITTEST(Buffer, visitMultipleSegmentsPartial)
     Buffer b;
     int sequence = 0;
     b.copyIn("a");
-    b.copyIn("bcd");
+    appendSegment(b, "bcd");
     b.visit(boost::bind(&visitor3, _1, _2, boost::ref(sequence)), 3);
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 3);
 }
@@ -593,7 +611,7 @@ MORDOR_UNITTEST(Buffer, findCharSimple)
 MORDOR_UNITTEST(Buffer, findCharTwoSegments)
 {
     Buffer b("\nhe");
-    b.copyIn("llo");
+    appendSegment(b, "llo");
     MORDOR_TEST_ASSERT_EQUAL(b.segments(), 2u);
 
     MORDOR_TEST_ASSERT_EQUAL(b.find('\r'), -1);
@@ -730,7 +748,7 @@ MORDOR_UNITTEST(Buffer, findStringSimple)
 MORDOR_UNITTEST(Buffer, findStringTwoSegments)
 {
     Buffer b("hello");
-    b.copyIn("world");
+    appendSegment(b, "world");
     MORDOR_TEST_ASSERT_EQUAL(b.segments(), 2u);
 
     MORDOR_TEST_ASSERT_EQUAL(b.find("abc"), -1);
@@ -763,8 +781,8 @@ MORDOR_UNITTEST(Buffer, findStringTwoSegments)
 MORDOR_UNITTEST(Buffer, findStringAcrossMultipleSegments)
 {
     Buffer b("hello");
-    b.copyIn("world");
-    b.copyIn("foo");
+    appendSegment(b, "world");
+    appendSegment(b, "foo");
     MORDOR_TEST_ASSERT_EQUAL(b.segments(), 3u);
 
     MORDOR_TEST_ASSERT_EQUAL(b.find("lloworldfo"), 2);
@@ -780,15 +798,79 @@ MORDOR_UNITTEST(Buffer, findStringLongFalsePositive)
 MORDOR_UNITTEST(Buffer, findStringFalsePositiveAcrossMultipleSegments)
 {
     Buffer b("10");
-    b.copyIn("00");
-    b.copyIn("00");
-    b.copyIn("00");
-    b.copyIn("11");
+    appendSegment(b, "00");
+    appendSegment(b, "00");
+    appendSegment(b, "00");
+    appendSegment(b, "11");
     MORDOR_TEST_ASSERT_EQUAL(b.segments(), 5u);
 
     MORDOR_TEST_ASSERT_EQUAL(b.find("000011"), 4);
 }
 
+MORDOR_UNITTEST(Buffer, findStringRestartAcrossSegments)
+{
+    Buffer b("xaa");
+    appendSegment(b, "ab");
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 2u);
+
+    MORDOR_TEST_ASSERT_EQUAL(b.find("aab"), 2);
+}
+
+// Splits data into segments of the given lengths (cycling through them),
+// and checks every find against std::string's
+static void
+checkFindSplit(const std::string &data, const size_t *lengths, size_t count)
+{
+    Buffer b;
+    for (size_t i = 0, pos = 0; pos < data.size(); ++i) {
+        size_t length = (std::min)(lengths[i % count], data.size() - pos);
+        appendSegment(b, data.substr(pos, length));
+        pos += length;
+    }
+    const char *needles[] = { "\r", "\r\n", "\r\n\r\n", "--boundary",
+        "--boundary--", "zz", "yz" };
+    for (size_t i = 0; i < sizeof(needles) / sizeof(needles[0]); ++i) {
+        std::string needle(needles[i]);
+        size_t expected = data.find(needle);
+        ptrdiff_t found = needle.size() == 1 ? b.find(needle[0]) :
+            b.find(needle);
+        MORDOR_TEST_ASSERT_EQUAL(found, expected == std::string::npos ? -1 :
+            (ptrdiff_t)expected);
+        // Matches must lie entirely inside the requested length
+        size_t limit = data.size() / 2;
+        expected = data.substr(0, limit).find(needle);
+        found = b.find(needle, limit);
+        MORDOR_TEST_ASSERT_EQUAL(found, expected == std::string::npos ? -1 :
+            (ptrdiff_t)expected);
+    }
+}
+
+MORDOR_UNITTEST(Buffer, findKernels)
+{
+    std::string data;
+    for (size_t i = 0; i < 300; ++i)
+        data.append(1, (char)('a' + i % 23));
+    // Runs of a needle's first byte, so find gives up skipping to them
+    data.append(200, '-');
+    data.append("--boundar\r-boundary\rz");
+    data.append(100, 'y');
+    data.append(150, '\r');
+    data.append("\r\n\r--boundary--\r\n\r\nzz");
+    for (size_t i = 0; i < 300; ++i)
+        data.append(1, (char)('a' + i % 23));
+    const size_t lengths1[] = { 5000 };
+    const size_t lengths2[] = { 1, 2, 3 };
+    const size_t lengths3[] = { 17, 31, 64, 7 };
+
+    const char *kernels[] = { "none", "sse2", "avx2", "neon", "auto" };
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+        HijackConfigVar simd("buffer.simd", kernels[i]);
+        checkFindSplit(data, lengths1, 1);
+        checkFindSplit(data, lengths2, 3);
+        checkFindSplit(data, lengths3, 4);
+    }
+}
+
 MORDOR_UNITTEST(Buffer, toString)
 {
     Buffer b;
@@ -838,3 +920,285 @@ MORDOR_UNITTEST(Buffer, clearReadPortionOnly)
     MORDOR_TEST_ASSERT_EQUAL(b.readAvailable(), 0u);
     MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b.writeAvailable(), 5u);
 }
+
+MORDOR_UNITTEST(Buffer, slabReuse)
+{
+    std::string chunk(4000, 'x');
+    Buffer b;
+    b.copyIn(chunk);
+    const void *first = b.readBuffer(~0, false).iov_base;
+    b.clear();
+    b.copyIn(chunk);
+    // Freed to this thread's slab cache, then handed right back
+    MORDOR_TEST_ASSERT_EQUAL(b.readBuffer(~0, false).iov_base, first);
+    MORDOR_TEST_ASSERT(b == chunk);
+}
+
+MORDOR_UNITTEST(Buffer, slabCapacityIsWriteSpace)
+{
+    Buffer b;
+    b.reserve(3000);
+    // Over-reserved to 6000, which rounds up to the 8K slab
+    MORDOR_TEST_ASSERT_EQUAL(b.writeAvailable(), 8192u);
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 1u);
+    Buffer b2;
+    b2.reserve(65536);
+    MORDOR_TEST_ASSERT_EQUAL(b2.writeAvailable(), 131072u);
+}
+
+MORDOR_UNITTEST(Buffer, slabSharedAcrossBuffers)
+{
+    ConfigVarBase::ptr cacheSize = Config::lookup("buffer.slabcache");
+    std::string oldCacheSize = cacheSize->toString();
+    MORDOR_TEST_ASSERT(cacheSize->fromString("0"));
+    try {
+        std::string chunk(10000, 'y');
+        Buffer *b1 = new Buffer(chunk);
+        Buffer b2(*b1);
+        b2.consume(5000);
+        // b2 still refers to b1's segment after b1 is gone
+        delete b1;
+        MORDOR_TEST_ASSERT(b2 == chunk.substr(5000));
+    } catch (...) {
+        cacheSize->fromString(oldCacheSize);
+        throw;
+    }
+    cacheSize->fromString(oldCacheSize);
+}
+
+static bool insideObject(const void *p, const Buffer &buffer)
+{
+    return (const char *)p >= (const char *)&buffer &&
+        (const char *)p < (const char *)(&buffer + 1);
+}
+
+MORDOR_UNITTEST(Buffer, smallBufferInline)
+{
+    Buffer b("hello");
+    MORDOR_TEST_ASSERT(insideObject(b.readBuffer(~0, false).iov_base, b));
+    b.consume(5);
+    std::vector<iovec> iovs = b.writeBuffers(100);
+    MORDOR_TEST_ASSERT_EQUAL(iovs.size(), 1u);
+    MORDOR_TEST_ASSERT(insideObject(iovs[0].iov_base, b));
+    memcpy(iovs[0].iov_base, "world", 5);
+    b.produce(5);
+    MORDOR_TEST_ASSERT(b == "world");
+}
+
+MORDOR_UNITTEST(Buffer, smallBufferAppendsInline)
+{
+    Buffer b("GET ");
+    b.copyIn("/ HTTP/1.1\r\n");
+    MORDOR_TEST_ASSERT_EQUAL(b.segments(), 1u);
+    MORDOR_TEST_ASSERT(insideObject(b.readBuffer(~0, false).iov_base, b));
+    MORDOR_TEST_ASSERT(b == "GET / HTTP/1.1\r\n");
+}
+
+MORDOR_UNITTEST(Buffer, smallBufferSpills)
+{
+    std::string first(200, 'a'), second(200, 'b');
+    Buffer *b1 = new Buffer(first);
+    b1->copyIn(second);
+    MORDOR_TEST_ASSERT_EQUAL(b1->segments(), 2u);
+    MORDOR_TEST_ASSERT(!insideObject(b1->readBuffers()[1].iov_base, *b1));
+    Buffer b2(*b1);
+    MORDOR_TEST_ASSERT(insideObject(b2.readBuffers()[0].iov_base, b2));
+    // Only the spilled segment is shared; the inline one was copied
+    MORDOR_TEST_ASSERT_EQUAL(b2.readBuffers()[1].iov_base,
+        b1->readBuffers()[1].iov_base);
+    delete b1;
+    MORDOR_TEST_ASSERT(b2 == first + second);
+}
+
+#ifndef WINDOWS
+MORDOR_UNITTEST(Buffer, mmapSegments)
+{
+    HijackConfigVar threshold("buffer.mmapthreshold", "65536");
+    std::string chunk(200000, 'm');
+    Buffer *b1 = new Buffer(chunk);
+    b1->copyIn("tail");
+    Buffer b2(*b1);
+    delete b1;
+    MORDOR_TEST_ASSERT(b2 == chunk + "tail");
+    b2.consume(100000);
+    MORDOR_TEST_ASSERT(b2 == chunk.substr(100000) + "tail");
+}
+
+MORDOR_UNITTEST(Buffer, hugePageArena)
+{
+    HijackConfigVar threshold("buffer.mmapthreshold", "4096");
+    HijackConfigVar hugePages("buffer.hugepages", "true");
+    std::vector<Buffer *> buffers;
+    for (char c = 'a'; c <= 'z'; ++c)
+        buffers.push_back(new Buffer(std::string(10000, c)));
+    // Carved one after the other from the same huge page
+    const char *first = (const char *)buffers[0]->readBuffer(~0, false).iov_base;
+    const char *second =
+        (const char *)buffers[1]->readBuffer(~0, false).iov_base;
+    MORDOR_TEST_ASSERT_GREATER_THAN(second, first);
+    MORDOR_TEST_ASSERT_LESS_THAN(second - first, 2 * 1024 * 1024);
+    for (size_t i = 0; i < buffers.size(); i += 2)
+        delete buffers[i];
+    for (size_t i = 1; i < buffers.size(); i += 2) {
+        MORDOR_TEST_ASSERT(*buffers[i] == std::string(10000, (char)('a' + i)));
+        delete buffers[i];
+    }
+}
+
+static bool isMapped(void *p, size_t length)
+{
+    unsigned char pages[16];
+    return mincore(p, length, pages) == 0;
+}
+
+MORDOR_UNITTEST(Buffer, adoptMapping)
+{
+    size_t length = 4 * 4096;
+    void *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    MORDOR_TEST_ASSERT(base != MAP_FAILED);
+    memset(base, 'f', length);
+    memcpy(base, "head", 4);
+    mprotect(base, length, PROT_READ);
+
+    Buffer *b1 = new Buffer("before");
+    b1->reserve(100);
+    b1->adoptMapping(base, length, (char *)base + 4, length - 4);
+    b1->copyIn("after");
+    MORDOR_TEST_ASSERT_EQUAL(b1->readAvailable(), 6 + length - 4 + 5);
+    MORDOR_TEST_ASSERT(*b1 == "before" + std::string(length - 4, 'f') +
+        "after");
+    // Copies share the mapping rather than copying it
+    Buffer b2(*b1);
+    MORDOR_TEST_ASSERT_EQUAL(b2.readBuffers()[1].iov_base,
+        (void *)((char *)base + 4));
+    delete b1;
+    MORDOR_TEST_ASSERT(isMapped(base, length));
+    b2.consume(6 + length - 4);
+    MORDOR_TEST_ASSERT(!isMapped(base, length));
+    MORDOR_TEST_ASSERT(b2 == "after");
+}
+#endif
+
+static std::string statistic(const std::string &name)
+{
+    Statistic *stat = Statistics::lookup(name);
+    MORDOR_TEST_ASSERT(stat);
+    return boost::lexical_cast<std::string>(*stat);
+}
+
+MORDOR_UNITTEST(Buffer, accountTallies)
+{
+    BufferAccount::ptr account(new BufferAccount("buffertest"));
+    Buffer b1;
+    b1.account(account);
+    b1.reserve(10000);
+    size_t held = account->bytes();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(held, 20000u);
+    MORDOR_TEST_ASSERT_EQUAL(statistic("buffer.bytes.buffertest"),
+        boost::lexical_cast<std::string>(held));
+    // Accounts of the same name share the statistic
+    BufferAccount::ptr other(new BufferAccount("buffertest"));
+    Buffer b2;
+    b2.account(other);
+    b2.reserve(10000);
+    MORDOR_TEST_ASSERT_EQUAL(other->bytes(), held);
+    MORDOR_TEST_ASSERT_EQUAL(statistic("buffer.bytes.buffertest"),
+        boost::lexical_cast<std::string>(held * 2));
+    b2.clear();
+    MORDOR_TEST_ASSERT_EQUAL(other->bytes(), 0u);
+
+    // Still held by a copy, after both the tagged Buffer and the account are
+    // gone
+    b1.produce(10000);
+    Buffer copy(b1);
+    b1.clear();
+    account.reset();
+    MORDOR_TEST_ASSERT_EQUAL(statistic("buffer.bytes.buffertest"),
+        boost::lexical_cast<std::string>(held));
+    copy.clear();
+    MORDOR_TEST_ASSERT_EQUAL(statistic("buffer.bytes.buffertest"), "0");
+}
+
+MORDOR_UNITTEST(Buffer, accountHardLimit)
+{
+    BufferAccount::ptr account(new BufferAccount(std::string(), 0, 16384));
+    Buffer b1, b2;
+    b1.account(account);
+    b2.account(account);
+    // Inline storage doesn't count
+    b1.reserve(100);
+    MORDOR_TEST_ASSERT_EQUAL(account->bytes(), 0u);
+    // Over-reserved to 8000, and charged for the whole 8K slab
+    b1.reserve(4000);
+    MORDOR_TEST_ASSERT_GREATER_THAN(account->bytes(), 8192u);
+    // 8000 more would fit, but not another whole slab
+    MORDOR_TEST_ASSERT_EXCEPTION(b2.reserve(4000),
+        BufferLimitExceededException);
+    MORDOR_TEST_ASSERT_EQUAL(b2.writeAvailable(), 0u);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(account->bytes(), 16384u);
+    // Nor a slab that's too big on its own
+    b1.clear();
+    MORDOR_TEST_ASSERT_EXCEPTION(b2.reserve(7000),
+        BufferLimitExceededException);
+    MORDOR_TEST_ASSERT_EQUAL(account->bytes(), 0u);
+    b2.reserve(4000);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(b2.writeAvailable(), 4000u);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(account->bytes(), 16384u);
+}
+
+MORDOR_UNITTEST(Buffer, accountHardLimitCopyIn)
+{
+    BufferAccount::ptr account(new BufferAccount(std::string(), 0, 16384));
+    Buffer b;
+    b.account(account);
+    std::string chunk(6000, 'x');
+    b.copyIn(chunk);
+    MORDOR_TEST_ASSERT_GREATER_THAN(account->bytes(), 8192u);
+    MORDOR_TEST_ASSERT_EXCEPTION(b.copyIn(chunk),
+        BufferLimitExceededException);
+    MORDOR_TEST_ASSERT(b == chunk);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(account->bytes(), 16384u);
+    // Small enough to grow the inline storage, which is already paid for
+    Buffer small("hello");
+    small.account(account);
+    small.copyIn(" world");
+    MORDOR_TEST_ASSERT(small == "hello world");
+}
+
+MORDOR_UNITTEST(Buffer, globalHardLimit)
+{
+    HijackConfigVar limit("buffer.hardlimit", "65536");
+    Buffer b;
+    MORDOR_TEST_ASSERT_EXCEPTION(b.reserve(100000),
+        BufferLimitExceededException);
+    b.reserve(10000);
+    MORDOR_TEST_ASSERT_NOT_EQUAL(statistic("buffer.bytes"), "0");
+}
+
+static void reserveOverSoftLimit(BufferAccount::ptr account, int &sequence)
+{
+    Buffer b;
+    b.account(account);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 1);
+    b.reserve(10000);
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 3);
+}
+
+MORDOR_UNITTEST(Buffer, accountSoftLimit)
+{
+    WorkerPool pool;
+    BufferAccount::ptr account(new BufferAccount(std::string(), 4096));
+    int sequence = 0;
+    Buffer *held = new Buffer();
+    held->account(account);
+    held->reserve(10000);
+    pool.schedule(boost::bind(&reserveOverSoftLimit, account,
+        boost::ref(sequence)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 2);
+    // Freeing enough lets it go
+    delete held;
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(++sequence, 4);
+}
@@ -1,6 +1,12 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+
 #include "mordor/coroutine.h"
+#include "mordor/generator.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -63,3 +69,72 @@ MORDOR_UNITTEST(Coroutine, voidWithArg)
     for (int i = 0; i < 5; ++i)
         coro.call(i);
 }
+
+static bool countDownFrom3(int &state, int &value)
+{
+    if (state == 0)
+        return false;
+    value = state--;
+    return true;
+}
+
+MORDOR_UNITTEST(Coroutine, functionGenerator)
+{
+    int state = 3;
+    Generator<int>::ptr generator = functionGenerator<int>(
+        boost::bind(&countDownFrom3, boost::ref(state), _1));
+    int value;
+    for (int i = 3; i > 0; --i) {
+        MORDOR_TEST_ASSERT(generator->next(value));
+        MORDOR_TEST_ASSERT_EQUAL(value, i);
+    }
+    MORDOR_TEST_ASSERT(!generator->next(value));
+    MORDOR_TEST_ASSERT(!generator->next(value));
+}
+
+static int increment(int value)
+{
+    return value + 1;
+}
+
+static bool isEven(int value)
+{
+    return value % 2 == 0;
+}
+
+static std::string toString(int value)
+{
+    return boost::lexical_cast<std::string>(value);
+}
+
+MORDOR_UNITTEST(Coroutine, coroutineGeneratorPipeline)
+{
+    // Only the source has a stack; the stages run on ours
+    Generator<std::string>::ptr pipeline = mapGenerator<std::string>(
+        filterGenerator(mapGenerator<int>(
+            coroutineGenerator<int>(&countTo5), &increment), &isEven),
+        &toString);
+    std::string value;
+    MORDOR_TEST_ASSERT(pipeline->next(value));
+    MORDOR_TEST_ASSERT_EQUAL(value, "2");
+    MORDOR_TEST_ASSERT(pipeline->next(value));
+    MORDOR_TEST_ASSERT_EQUAL(value, "4");
+    MORDOR_TEST_ASSERT(pipeline->next(value));
+    MORDOR_TEST_ASSERT_EQUAL(value, "6");
+    MORDOR_TEST_ASSERT(!pipeline->next(value));
+}
+
+MORDOR_UNITTEST(Coroutine, deepGeneratorPipeline)
+{
+    std::vector<int> values(100);
+    for (int i = 0; i < 100; ++i)
+        values[i] = i;
+    Generator<int>::ptr pipeline = rangeGenerator<int>(values.begin(),
+        values.end());
+    for (int i = 0; i < 1000; ++i)
+        pipeline = mapGenerator<int>(pipeline, &increment);
+    int value, expected = 1000;
+    while (pipeline->next(value))
+        MORDOR_TEST_ASSERT_EQUAL(value, expected++);
+    MORDOR_TEST_ASSERT_EQUAL(expected, 1100);
+}
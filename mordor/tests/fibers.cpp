@@ -1,8 +1,12 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <fstream>
+
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
 #include "mordor/fiber.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
 
 using namespace Mordor;
@@ -531,6 +535,173 @@ MORDOR_UNITTEST(Fibers, resetStress)
     }
 }
 
+#ifndef WINDOWS
+MORDOR_UNITTEST(Fibers, stackCacheReuse)
+{
+    CountStatistic<unsigned long long> *hits =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+            "fiber.stackcache.hits");
+    MORDOR_TEST_ASSERT(hits);
+    Fiber::ptr f(new Fiber(&eatSomeStack, 65536));
+    f->call();
+    f.reset();
+    unsigned long long before = hits->count;
+    f.reset(new Fiber(&eatSomeStack, 65536));
+    MORDOR_TEST_ASSERT_EQUAL(hits->count, before + 1);
+    f->call();
+}
+
+MORDOR_UNITTEST(Fibers, guardPages)
+{
+    ConfigVarBase::ptr guardPages = Config::lookup("fiber.guardpages");
+    MORDOR_TEST_ASSERT(guardPages);
+    MORDOR_TEST_ASSERT(guardPages->fromString("1"));
+    try {
+        Fiber::ptr f(new Fiber(&eatSomeStack, 65536));
+        f->call();
+        f->reset(&eatSomeStack);
+        f->call();
+    } catch (...) {
+        guardPages->fromString("0");
+        throw;
+    }
+    guardPages->fromString("0");
+}
+
+#ifdef LINUX
+static void recordStack(const void **where)
+{
+    *where = __builtin_frame_address(0);
+}
+
+// The permissions of whatever is mapped immediately below the mapping that
+// address is in, or "" if nothing is
+static std::string permissionsBelow(const void *address)
+{
+    std::ifstream maps("/proc/self/maps");
+    std::string line, previousPermissions;
+    unsigned long long previousEnd = 0;
+    while (std::getline(maps, line)) {
+        unsigned long long start, end;
+        char permissions[5];
+        if (sscanf(line.c_str(), "%llx-%llx %4s", &start, &end,
+            permissions) != 3)
+            continue;
+        if ((unsigned long long)address >= start &&
+            (unsigned long long)address < end)
+            return previousEnd == start ? previousPermissions : "";
+        previousEnd = end;
+        previousPermissions = permissions;
+    }
+    return "";
+}
+
+MORDOR_UNITTEST(Fibers, guardPageIsInaccessible)
+{
+    HijackConfigVar guardPages("fiber.guardpages", "1");
+    const void *stack = NULL;
+    Fiber::ptr f(new Fiber(boost::bind(&recordStack, &stack), 65536));
+    f->call();
+    MORDOR_TEST_ASSERT_EQUAL(permissionsBelow(stack), "---p");
+    // And still there once the stack has been through the cache
+    f.reset();
+    f.reset(new Fiber(boost::bind(&recordStack, &stack), 65536));
+    f->call();
+    MORDOR_TEST_ASSERT_EQUAL(permissionsBelow(stack), "---p");
+}
+#endif
+
+#ifndef WINDOWS
+MORDOR_UNITTEST(Fibers, stackCacheTrimsOnRelease)
+{
+    CountStatistic<unsigned long long> *trims =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+            "fiber.stackcache.trims");
+    MORDOR_TEST_ASSERT(trims);
+    HijackConfigVar delay("fiber.stackcache.trimdelay", "0");
+    Fiber::ptr f(new Fiber(&eatSomeStack, 65536));
+    f->call();
+    f.reset();
+    unsigned long long before = trims->count;
+    // Freeing a stack of another size gives the first one's memory back
+    f.reset(new Fiber(&eatSomeStack, 131072));
+    f->call();
+    f.reset();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(trims->count, before + 1);
+    before = trims->count;
+    // ... and so does the thread running out of work
+    Fiber::trimStackCache();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(trims->count, before + 1);
+}
+#endif
+
+static void eatStack(size_t bytes)
+{
+    char stackEater[8192];
+    memset(stackEater, 1, sizeof(stackEater));
+    if (bytes > sizeof(stackEater))
+        eatStack(bytes - sizeof(stackEater));
+    // Don't let it turn into a tail call
+    MORDOR_TEST_ASSERT_EQUAL(stackEater[0], 1);
+}
+
+MORDOR_UNITTEST(Fibers, stackHighWatermark)
+{
+    ConfigVarBase::ptr measure = Config::lookup("fiber.stackwatermark");
+    MORDOR_TEST_ASSERT(measure);
+    Fiber::ptr unmeasured(new Fiber(boost::bind(&eatStack, 8192u), 262144));
+    MORDOR_TEST_ASSERT(measure->fromString("1"));
+    Fiber::ptr f;
+    try {
+        f.reset(new Fiber(boost::bind(&eatStack, 32768u), 262144));
+    } catch (...) {
+        measure->fromString("0");
+        throw;
+    }
+    measure->fromString("0");
+
+    unmeasured->call();
+    MORDOR_TEST_ASSERT_EQUAL(unmeasured->stackHighWatermark(), 0u);
+    f->call();
+    size_t used = f->stackHighWatermark();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(used, 32768u);
+    MORDOR_TEST_ASSERT_LESS_THAN(used, 65536u);
+    // Resetting starts the measurement over
+    f->reset(boost::bind(&eatStack, 8192u));
+    MORDOR_TEST_ASSERT_LESS_THAN(f->stackHighWatermark(), 8192u);
+    f->call();
+    used = f->stackHighWatermark();
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(used, 8192u);
+    MORDOR_TEST_ASSERT_LESS_THAN(used, 32768u);
+}
+#endif
+
+static void accumulate(volatile double &result)
+{
+    double a = 1.5, b = 0.25;
+    for (int i = 0; i < 8; ++i) {
+        a = a * 2.0 + b;
+        Fiber::yield();
+        b = b / 2.0 + a;
+    }
+    result = a + b;
+}
+
+MORDOR_UNITTEST(Fibers, registersPreservedAcrossSwitches)
+{
+    volatile double result = 0.0;
+    Fiber::ptr f(new Fiber(boost::bind(&accumulate, boost::ref(result))));
+    double a = 1.5, b = 0.25;
+    for (int i = 0; i < 8; ++i) {
+        a = a * 2.0 + b;
+        f->call();
+        b = b / 2.0 + a;
+    }
+    f->call();
+    MORDOR_TEST_ASSERT_EQUAL(f->state(), Fiber::TERM);
+    MORDOR_TEST_ASSERT_EQUAL((double)result, a + b);
+}
+
 static void gimmeYourFiber(Fiber::ptr &threadFiber)
 {
     threadFiber = Fiber::getThis();
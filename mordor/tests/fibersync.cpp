@@ -4,6 +4,7 @@
 
 #include "mordor/atomic.h"
 #include "mordor/fiber.h"
+#include "mordor/fiberchannel.h"
 #include "mordor/fibersynchronization.h"
 #include "mordor/iomanager.h"
 #include "mordor/sleep.h"
@@ -139,6 +140,30 @@ MORDOR_UNITTEST(FiberMutex, mutexPerformance)
     test_mutex_performance<FiberMutex>();
 }
 
+static void incrementLocked(FiberMutex &mutex, int &counter, int iterations)
+{
+    for (int i = 0; i < iterations; ++i) {
+        FiberMutex::ScopedLock lock(mutex);
+        ++counter;
+        if (i % 64 == 0)
+            Scheduler::yield();
+    }
+}
+
+// Exercises the races between the atomic fast paths and queueing
+MORDOR_UNITTEST(FiberMutex, multithreadedContention)
+{
+    FiberMutex mutex;
+    int counter = 0;
+    {
+        WorkerPool pool(4, false);
+        for (int i = 0; i < 8; ++i)
+            pool.schedule(boost::bind(&incrementLocked, boost::ref(mutex),
+                boost::ref(counter), 10000));
+    }
+    MORDOR_TEST_ASSERT_EQUAL(counter, 80000);
+}
+
 MORDOR_UNITTEST(RecursiveFiberMutex, basic)
 {
     test_mutex_basic<RecursiveFiberMutex>();
@@ -173,6 +198,234 @@ MORDOR_UNITTEST(RecursiveFiberMutex, unlockUnique)
     test_mutex_unlockUnique<RecursiveFiberMutex>();
 }
 
+static void readLocked(FiberRWMutex &mutex, std::vector<int> &order, int id)
+{
+    FiberRWMutex::ScopedReadLock lock(mutex);
+    order.push_back(id);
+}
+
+static void writeLocked(FiberRWMutex &mutex, std::vector<int> &order, int id)
+{
+    FiberRWMutex::ScopedWriteLock lock(mutex);
+    order.push_back(id);
+}
+
+MORDOR_UNITTEST(FiberRWMutex, sharedReaders)
+{
+    WorkerPool pool;
+    FiberRWMutex mutex;
+    std::vector<int> order;
+
+    FiberRWMutex::ScopedReadLock lock(mutex);
+    pool.schedule(boost::bind(&readLocked, boost::ref(mutex),
+        boost::ref(order), 1));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 1u);
+}
+
+MORDOR_UNITTEST(FiberRWMutex, writerPreference)
+{
+    WorkerPool pool;
+    FiberRWMutex mutex;
+    std::vector<int> order;
+
+    {
+        FiberRWMutex::ScopedReadLock lock(mutex);
+        pool.schedule(boost::bind(&writeLocked, boost::ref(mutex),
+            boost::ref(order), 1));
+        // Queues behind the waiting writer, even though only readers hold
+        // the mutex
+        pool.schedule(boost::bind(&readLocked, boost::ref(mutex),
+            boost::ref(order), 2));
+        pool.dispatch();
+        MORDOR_TEST_ASSERT(order.empty());
+    }
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(order[0], 1);
+    MORDOR_TEST_ASSERT_EQUAL(order[1], 2);
+}
+
+MORDOR_UNITTEST(FiberRWMutex, readersAdmittedTogether)
+{
+    WorkerPool pool;
+    FiberRWMutex mutex;
+    std::vector<int> order;
+
+    {
+        FiberRWMutex::ScopedWriteLock lock(mutex);
+        pool.schedule(boost::bind(&readLocked, boost::ref(mutex),
+            boost::ref(order), 1));
+        pool.schedule(boost::bind(&writeLocked, boost::ref(mutex),
+            boost::ref(order), 3));
+        pool.schedule(boost::bind(&readLocked, boost::ref(mutex),
+            boost::ref(order), 2));
+        pool.dispatch();
+        MORDOR_TEST_ASSERT(order.empty());
+    }
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 3u);
+    for (int i = 0; i < 3; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(order[i], i + 1);
+}
+
+static void readWriteLocked(FiberRWMutex &mutex, int &value, int iterations)
+{
+    for (int i = 0; i < iterations; ++i) {
+        if (i % 8 == 0) {
+            FiberRWMutex::ScopedWriteLock lock(mutex);
+            int old = value;
+            Scheduler::yield();
+            value = old + 1;
+        } else {
+            FiberRWMutex::ScopedReadLock lock(mutex);
+            MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(value, 0);
+        }
+    }
+}
+
+MORDOR_UNITTEST(FiberRWMutex, multithreaded)
+{
+    FiberRWMutex mutex;
+    int value = 0;
+    {
+        WorkerPool pool(4, false);
+        for (int i = 0; i < 8; ++i)
+            pool.schedule(boost::bind(&readWriteLocked, boost::ref(mutex),
+                boost::ref(value), 4000));
+    }
+    MORDOR_TEST_ASSERT_EQUAL(value, 8 * 500);
+}
+
+static void waitSemaphore(FiberSemaphore &semaphore, Atomic<int> &count,
+    int iterations)
+{
+    for (int i = 0; i < iterations; ++i) {
+        semaphore.wait();
+        ++count;
+    }
+}
+
+static void notifySemaphore(FiberSemaphore &semaphore, int iterations)
+{
+    for (int i = 0; i < iterations; ++i) {
+        semaphore.notify();
+        if (i % 64 == 0)
+            Scheduler::yield();
+    }
+}
+
+MORDOR_UNITTEST(FiberSemaphore, multithreaded)
+{
+    FiberSemaphore semaphore;
+    Atomic<int> count = 0;
+    {
+        WorkerPool pool(4, false);
+        for (int i = 0; i < 4; ++i) {
+            pool.schedule(boost::bind(&waitSemaphore, boost::ref(semaphore),
+                boost::ref(count), 10000));
+            pool.schedule(boost::bind(&notifySemaphore, boost::ref(semaphore),
+                10000));
+        }
+    }
+    MORDOR_TEST_ASSERT_EQUAL((int)count, 40000);
+}
+
+static void sendRange(FiberChannel<int> &channel, int first, int count)
+{
+    for (int i = first; i < first + count; ++i)
+        MORDOR_TEST_ASSERT(channel.send(i));
+}
+
+MORDOR_UNITTEST(FiberChannel, backpressure)
+{
+    WorkerPool pool;
+    FiberChannel<int> channel(2);
+
+    pool.schedule(boost::bind(&sendRange, boost::ref(channel), 0, 5));
+    pool.dispatch();
+    // The sender is stuck until there's room
+    MORDOR_TEST_ASSERT(!channel.trySend(100));
+    int value;
+    for (int i = 0; i < 5; ++i) {
+        MORDOR_TEST_ASSERT(channel.recv(value));
+        MORDOR_TEST_ASSERT_EQUAL(value, i);
+    }
+    MORDOR_TEST_ASSERT(!channel.tryRecv(value));
+    pool.dispatch();
+}
+
+static void recvAll(FiberChannel<int> &channel, std::vector<int> &received)
+{
+    int value;
+    while (channel.recv(value))
+        received.push_back(value);
+}
+
+MORDOR_UNITTEST(FiberChannel, close)
+{
+    WorkerPool pool;
+    FiberChannel<int> channel(4);
+    std::vector<int> received;
+
+    pool.schedule(boost::bind(&recvAll, boost::ref(channel),
+        boost::ref(received)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT(channel.trySend(1));
+    MORDOR_TEST_ASSERT(channel.trySend(2));
+    channel.close();
+    MORDOR_TEST_ASSERT(!channel.send(3));
+    MORDOR_TEST_ASSERT(!channel.trySend(3));
+    pool.dispatch();
+    // What was sent before closing is still delivered
+    MORDOR_TEST_ASSERT_EQUAL(received.size(), 2u);
+    MORDOR_TEST_ASSERT_EQUAL(received[0], 1);
+    MORDOR_TEST_ASSERT_EQUAL(received[1], 2);
+}
+
+static void recvBatches(FiberChannel<int> &channel, Atomic<int> &sum,
+    Atomic<int> &count)
+{
+    std::vector<int> values;
+    while (channel.recvMany(values, 16) != 0) {
+        for (size_t i = 0; i < values.size(); ++i)
+            sum += values[i];
+        count += (int)values.size();
+        values.clear();
+    }
+}
+
+static void sendAndClose(FiberChannel<int> &channel, FiberSemaphore &done,
+    int first, int count, int producers)
+{
+    sendRange(channel, first, count);
+    done.notify();
+    // The first producer closes the channel once every producer is done
+    if (first == 0) {
+        for (int i = 0; i < producers; ++i)
+            done.wait();
+        channel.close();
+    }
+}
+
+MORDOR_UNITTEST(FiberChannel, multithreaded)
+{
+    FiberChannel<int> channel(8);
+    FiberSemaphore done;
+    Atomic<int> sum = 0, count = 0;
+    {
+        WorkerPool pool(4, false);
+        for (int i = 0; i < 4; ++i) {
+            pool.schedule(boost::bind(&recvBatches, boost::ref(channel),
+                boost::ref(sum), boost::ref(count)));
+            pool.schedule(boost::bind(&sendAndClose, boost::ref(channel),
+                boost::ref(done), i * 1000, 1000, 4));
+        }
+    }
+    MORDOR_TEST_ASSERT_EQUAL((int)count, 4000);
+    MORDOR_TEST_ASSERT_EQUAL((int)sum, 3999 * 4000 / 2);
+}
+
 static void signalMe(FiberCondition &condition, int &sequence)
 {
     MORDOR_TEST_ASSERT_EQUAL(++sequence, 2);
@@ -2,6 +2,8 @@
 
 #include "mordor/pch.h"
 
+#include "mordor/config.h"
+#include "mordor/streams/buffer.h"
 #include "mordor/streams/file.h"
 #include "mordor/test/test.h"
 
@@ -133,4 +135,35 @@ MORDOR_UNITTEST(FileStream, openSymlinkToNothing)
     }
     unlink(sym.c_str());
 }
+
+MORDOR_UNITTEST(FileStream, mmapReads)
+{
+    std::string path = tempfilename();
+    std::string contents;
+    for (size_t i = 0; i < 100000; ++i)
+        contents.append(1, (char)('a' + i % 26));
+    {
+        FileStream stream(path, FileStream::WRITE, FileStream::CREATE);
+        MORDOR_TEST_ASSERT_EQUAL(stream.write(contents.c_str(),
+            contents.size()), contents.size());
+    }
+    try {
+        HijackConfigVar mmapReads("filestream.mmapreads", "4096");
+        FileStream stream(path, FileStream::READ);
+        Buffer buffer("x");
+        stream.seek(5);
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 50000), 50000u);
+        MORDOR_TEST_ASSERT_EQUAL(stream.seek(0, Stream::CURRENT), 50005);
+        // Too short to map, so read as usual
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 100), 100u);
+        // Stops at the end of the file
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 80000), 49895u);
+        MORDOR_TEST_ASSERT_EQUAL(stream.read(buffer, 80000), 0u);
+        MORDOR_TEST_ASSERT(buffer == "x" + contents.substr(5));
+    } catch (...) {
+        unlink(path.c_str());
+        throw;
+    }
+    unlink(path.c_str());
+}
 #endif
@@ -3,6 +3,7 @@
 #include <boost/bind.hpp>
 
 #include "mordor/future.h"
+#include "mordor/iomanager.h"
 #include "mordor/test/test.h"
 #include "mordor/workerpool.h"
 
@@ -248,3 +249,85 @@ MORDOR_UNITTEST(Future, waitAnyAsynchronousBoth)
     pool.schedule(boost::bind(&signal<Future<> >, boost::ref(future[1])));
     MORDOR_TEST_ASSERT_EQUAL(waitAny(future, future + 2), 0u);
 }
+
+MORDOR_UNITTEST(Future, thenBeforeSignal)
+{
+    int result = 0;
+    Future<int> future;
+    future.then(boost::bind(&setResult, boost::ref(result), _1));
+    MORDOR_TEST_ASSERT_EQUAL(result, 0);
+    future.result() = 3;
+    future.signal();
+    MORDOR_TEST_ASSERT_EQUAL(result, 3);
+}
+
+MORDOR_UNITTEST(Future, thenAfterSignal)
+{
+    bool signalled = false;
+    Future<> future;
+    future.signal();
+    future.then(boost::bind(&setTrue, boost::ref(signalled)));
+    MORDOR_TEST_ASSERT(signalled);
+}
+
+MORDOR_UNITTEST(Future, thenScheduler)
+{
+    WorkerPool pool, otherPool(1, false);
+    bool signalled = false;
+    Future<> future;
+    future.then(boost::bind(&setTrueScheduler, boost::ref(signalled),
+        &otherPool), &otherPool);
+    pool.schedule(boost::bind(&signal<Future<> >, boost::ref(future)));
+    pool.dispatch();
+    otherPool.stop();
+    MORDOR_TEST_ASSERT(signalled);
+}
+
+MORDOR_UNITTEST(Future, whenAll)
+{
+    WorkerPool pool;
+    Future<int> future[3];
+    Future<bool> all;
+    future[1].result() = 1;
+    future[1].signal();
+    whenAll(future, future + 3, all);
+    pool.schedule(boost::bind(&signal<Future<int> >, boost::ref(future[0])));
+    pool.schedule(boost::bind(&signal<Future<int> >, boost::ref(future[2])));
+    MORDOR_TEST_ASSERT(all.wait());
+}
+
+MORDOR_UNITTEST(Future, whenAllTimeout)
+{
+    IOManager ioManager;
+    Future<> future[2];
+    Future<bool> all;
+    whenAll(future, future + 2, all, &ioManager, 10000);
+    future[0].signal();
+    MORDOR_TEST_ASSERT(!all.wait());
+    // Too late to matter
+    future[1].signal();
+}
+
+MORDOR_UNITTEST(Future, whenAny)
+{
+    IOManager ioManager;
+    Future<> future[3];
+    Future<size_t> any;
+    whenAny(future, future + 3, any, &ioManager, 5000000ull);
+    ioManager.schedule(boost::bind(&signal<Future<> >,
+        boost::ref(future[2])));
+    MORDOR_TEST_ASSERT_EQUAL(any.wait(), 2u);
+    future[0].signal();
+    future[1].signal();
+}
+
+MORDOR_UNITTEST(Future, whenAnyTimeout)
+{
+    IOManager ioManager;
+    Future<> future[2];
+    Future<size_t> any;
+    whenAny(future, future + 2, any, &ioManager, 10000);
+    MORDOR_TEST_ASSERT_EQUAL(any.wait(), ~(size_t)0);
+    future[0].signal();
+    future[1].signal();
+}
@@ -2,12 +2,28 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/atomic.h"
+#include "mordor/config.h"
 #include "mordor/future.h"
 #include "mordor/iomanager.h"
+#include "mordor/semaphore.h"
 #include "mordor/test/test.h"
 #include "mordor/thread.h"
 #include "mordor/version.h"
+#include "mordor/workerpool.h"
 #include "mordor/socket.h"
+#include "mordor/statistics.h"
+
+#ifdef HAVE_CONFIG_H
+#include "autoconfig.h"
+#endif
+
+#ifdef LINUX
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#endif
 
 using namespace Mordor;
 using namespace Mordor::Test;
@@ -172,6 +188,295 @@ MORDOR_UNITTEST(IOManager, tickleDeadlock)
     manager.stop();
 }
 
+static void countDelegate(volatile size_t &count)
+{
+    atomicIncrement(count);
+}
+
+// Wakes idle threads one at a time for work scheduled from outside the
+// IOManager; every delegate must still run exactly once
+MORDOR_UNITTEST(IOManager, tickleIdleThreads)
+{
+    volatile size_t count = 0;
+    IOManager manager(4, false);
+    for (size_t i = 0; i < 1000; ++i)
+        manager.schedule(boost::bind(&countDelegate, boost::ref(count)));
+    manager.stop();
+    MORDOR_TEST_ASSERT_EQUAL(count, 1000u);
+}
+
+static void cancelRead(IOManager &manager, int fd)
+{
+    manager.cancelEvent(fd, IOManager::READ);
+}
+
+static void waitForRead(IOManager &manager, int fd, tid_t canceller,
+    tid_t &resumedOn)
+{
+    manager.registerEvent(fd, IOManager::READ);
+    if (canceller != emptytid())
+        manager.schedule(boost::bind(&cancelRead, boost::ref(manager), fd),
+            canceller);
+    Scheduler::yieldTo();
+    resumedOn = gettid();
+}
+
+// In sharded mode an fd belongs to the thread that registered it, and its
+// events resume the waiter there even if another thread triggers them
+MORDOR_UNITTEST(IOManager, shardedResumesOnHomeThread)
+{
+    IOManager manager(4, false, true, 1, false, true);
+    MORDOR_TEST_ASSERT(manager.sharded());
+    const std::vector<boost::shared_ptr<Thread> > threads = manager.threads();
+    MORDOR_TEST_ASSERT_EQUAL(threads.size(), 4u);
+    int fds[2][2];
+    tid_t resumedOn[2] = { emptytid(), emptytid() };
+    for (size_t i = 0; i < 2; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(pipe(fds[i]), 0);
+
+    // Woken by data arriving
+    manager.schedule(boost::bind(&waitForRead, boost::ref(manager),
+        fds[0][0], emptytid(), boost::ref(resumedOn[0])), threads[1]->tid());
+    MORDOR_TEST_ASSERT_EQUAL(write(fds[0][1], "a", 1), 1);
+    // Woken by a cancel on another thread
+    manager.schedule(boost::bind(&waitForRead, boost::ref(manager),
+        fds[1][0], threads[3]->tid(), boost::ref(resumedOn[1])),
+        threads[2]->tid());
+    manager.stop();
+
+    MORDOR_TEST_ASSERT_EQUAL(resumedOn[0], threads[1]->tid());
+    MORDOR_TEST_ASSERT_EQUAL(resumedOn[1], threads[2]->tid());
+    for (size_t i = 0; i < 2; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+static void countReadable(volatile size_t &count)
+{
+    atomicIncrement(count);
+}
+
+static void registerCountReadable(IOManager &manager, int fd,
+    volatile size_t &count)
+{
+    manager.registerEvent(fd, IOManager::READ,
+        boost::bind(&countReadable, boost::ref(count)));
+}
+
+// Threads that exit when the IOManager stops give up their epoll sets, so
+// fds registered after a restart (from inside the IOManager or not) are
+// still homed on sets that someone is polling
+MORDOR_UNITTEST(IOManager, shardedRestart)
+{
+    IOManager manager(2, false, true, 1, false, true);
+    int fds[4][2];
+    for (size_t i = 0; i < 4; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(pipe(fds[i]), 0);
+    volatile size_t count = 0;
+    for (int cycle = 0; cycle < 3; ++cycle) {
+        if (cycle != 0)
+            manager.start();
+        // Lets us register from outside the IOManager
+        WorkerPool pool;
+        for (size_t i = 0; i < 4; ++i) {
+            if (i % 2)
+                manager.schedule(boost::bind(&registerCountReadable,
+                    boost::ref(manager), fds[i][0], boost::ref(count)));
+            else
+                registerCountReadable(manager, fds[i][0], count);
+            MORDOR_TEST_ASSERT_EQUAL(write(fds[i][1], "a", 1), 1);
+        }
+        // Doesn't return until every event has fired
+        manager.stop();
+        // The dgs registered from outside were scheduled on the pool
+        pool.dispatch();
+        MORDOR_TEST_ASSERT_EQUAL(count, 4u * (cycle + 1));
+        for (size_t i = 0; i < 4; ++i) {
+            char c;
+            MORDOR_TEST_ASSERT_EQUAL(read(fds[i][0], &c, 1), 1);
+        }
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+static void notifyReadable(Semaphore &semaphore)
+{
+    semaphore.notify();
+}
+
+// The useCaller thread doesn't poll while its caller is busy elsewhere, so
+// the fds it registers go to worker threads
+MORDOR_UNITTEST(IOManager, shardedRootThreadRegistration)
+{
+    IOManager manager(2, true, true, 1, false, true);
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    Semaphore semaphore;
+    manager.registerEvent(fds[0], IOManager::READ,
+        boost::bind(&notifyReadable, boost::ref(semaphore)));
+    MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "a", 1), 1);
+    // Blocks this thread, so only the worker thread can deliver it
+    semaphore.wait();
+    manager.stop();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void waitForReadPriority(IOManager &manager, int fd,
+    Scheduler::Priority &resumedWith)
+{
+    manager.registerEvent(fd, IOManager::READ);
+    Scheduler::yieldTo();
+    resumedWith = Scheduler::currentPriority();
+}
+
+static void writeOne(int fd)
+{
+    MORDOR_TEST_ASSERT_EQUAL(write(fd, "a", 1), 1);
+}
+
+// A Fiber dispatched as HIGH is rescheduled as HIGH when its event fires
+MORDOR_UNITTEST(IOManager, registrationInheritsPriority)
+{
+    IOManager manager;
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    Scheduler::Priority resumedWith = Scheduler::NORMAL;
+    manager.schedule(boost::bind(&waitForReadPriority, boost::ref(manager),
+        fds[0], boost::ref(resumedWith)), emptytid(), Scheduler::HIGH);
+    manager.schedule(boost::bind(&writeOne, fds[1]));
+    manager.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(resumedWith, Scheduler::HIGH);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+#ifdef LINUX
+static void countEvent(int &count)
+{
+    ++count;
+}
+
+// With a batch of one, each ready fd needs its own epoll_wait, and every one
+// of them is satisfied while spinning
+MORDOR_UNITTEST(IOManager, busyPoll)
+{
+    ConfigVarBase::ptr batchSize = Config::lookup("iomanager.epoll.batchsize");
+    ConfigVarBase::ptr spin = Config::lookup("iomanager.epoll.spin");
+    std::string oldBatchSize = batchSize->toString(), oldSpin = spin->toString();
+    MORDOR_TEST_ASSERT(batchSize->fromString("1"));
+    MORDOR_TEST_ASSERT(spin->fromString("1000"));
+    CountStatistic<unsigned long long> *spinHits =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+            "iomanager.epoll.spinhits");
+    MORDOR_TEST_ASSERT(spinHits);
+    unsigned long long hits = spinHits->count;
+
+    int fds[2][2];
+    int count = 0;
+    {
+        IOManager manager;
+        for (size_t i = 0; i < 2; ++i) {
+            MORDOR_TEST_ASSERT_EQUAL(pipe(fds[i]), 0);
+            MORDOR_TEST_ASSERT_EQUAL(write(fds[i][1], "a", 1), 1);
+            manager.registerEvent(fds[i][0], IOManager::READ,
+                boost::bind(&countEvent, boost::ref(count)));
+        }
+        manager.dispatch();
+    }
+    batchSize->fromString(oldBatchSize);
+    spin->fromString(oldSpin);
+    MORDOR_TEST_ASSERT_EQUAL(count, 2);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(spinHits->count, hits + 2);
+    for (size_t i = 0; i < 2; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+}
+
+static void recordTime(unsigned long long &firedAt)
+{
+    firedAt = TimerManager::now();
+}
+
+// Spinning stops when the next timer comes due, instead of running the
+// timer only once the whole spin count is used up
+MORDOR_UNITTEST(IOManager, busyPollHonorsTimers)
+{
+    ConfigVarBase::ptr spin = Config::lookup("iomanager.epoll.spin");
+    std::string oldSpin = spin->toString();
+    // Seconds' worth of epoll_waits
+    MORDOR_TEST_ASSERT(spin->fromString("10000000"));
+    unsigned long long firedAt = 0, dueAt;
+    try {
+        IOManager manager;
+        dueAt = TimerManager::now() + 20000ull;
+        manager.registerTimer(20000ull,
+            boost::bind(&recordTime, boost::ref(firedAt)));
+        manager.dispatch();
+    } catch (...) {
+        spin->fromString(oldSpin);
+        throw;
+    }
+    spin->fromString(oldSpin);
+    MORDOR_TEST_ASSERT_GREATER_THAN_OR_EQUAL(firedAt, dueAt);
+    MORDOR_TEST_ASSERT_LESS_THAN(firedAt - dueAt, 200000ull);
+}
+
+// Whether the kernel has everything IOUring needs, asked directly rather
+// than through IOUring, so that a build that leaves io_uring out fails
+// completionIo instead of skipping it
+static bool kernelHasIOUring()
+{
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_FAST_POLL) && \
+    defined(__NR_io_uring_setup)
+    io_uring_params params;
+    memset(&params, 0, sizeof(io_uring_params));
+    int fd = (int)syscall(__NR_io_uring_setup, 1, &params);
+    if (fd < 0)
+        return false;
+    close(fd);
+    const unsigned int required = IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS |
+        IORING_FEAT_FAST_POLL;
+    return (params.features & required) == required;
+#else
+    return false;
+#endif
+}
+
+MORDOR_UNITTEST(IOManager, completionIo)
+{
+    ConfigVarBase::ptr ioUring = Config::lookup("iomanager.iouring");
+    std::string old = ioUring->toString();
+    MORDOR_TEST_ASSERT(ioUring->fromString("1"));
+    IOManager manager;
+    ioUring->fromString(old);
+    MORDOR_TEST_ASSERT_EQUAL(manager.completionIo(), kernelHasIOUring());
+    // Not all kernels have io_uring
+    if (!manager.completionIo())
+        throw TestSkippedException();
+
+    int fds[2];
+    MORDOR_TEST_ASSERT_EQUAL(pipe(fds), 0);
+    char buffer[4];
+    iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer);
+    // Cancelled while waiting for data
+    manager.schedule(boost::bind(&cancelRead, boost::ref(manager), fds[0]));
+    MORDOR_TEST_ASSERT_EQUAL(manager.asyncReadv(fds[0], &iov, 1), -ECANCELED);
+    MORDOR_TEST_ASSERT_EQUAL(write(fds[1], "abc", 3), 3);
+    MORDOR_TEST_ASSERT_EQUAL(manager.asyncReadv(fds[0], &iov, 1), 3);
+    MORDOR_TEST_ASSERT_EQUAL(std::string(buffer, 3), "abc");
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
+
 namespace {
     struct Connection
     {
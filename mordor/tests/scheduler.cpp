@@ -1,14 +1,22 @@
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <vector>
+
 #include <boost/bind.hpp>
 #include <boost/thread/mutex.hpp>
 
 #include "mordor/atomic.h"
+#include "mordor/config.h"
 #include "mordor/fiber.h"
 #include "mordor/iomanager.h"
 #include "mordor/parallel.h"
 #include "mordor/sleep.h"
+#include "mordor/statistics.h"
 #include "mordor/test/test.h"
+#include "mordor/timer.h"
 #include "mordor/workerpool.h"
 #include "mordor/util.h"
 
@@ -350,6 +358,100 @@ MORDOR_UNITTEST(Scheduler, parallelForEachStopShortParallel)
     MORDOR_TEST_ASSERT_LESS_THAN(sequence, 10);
 }
 
+static void countVisit(int &visits)
+{
+    atomicIncrement(visits);
+}
+
+MORDOR_UNITTEST(Scheduler, parallelForEachChunked)
+{
+    std::vector<int> visits(100000, 0);
+    WorkerPool pool(4);
+
+    // Default parallelism comes from the pool; every element must be claimed
+    // exactly once, no matter how the chunks fall
+    parallel_foreach(visits.begin(), visits.end(), &countVisit);
+    for (size_t i = 0; i < visits.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(visits[i], 1);
+
+    parallel_foreach(visits.begin(), visits.end(), &countVisit, 7);
+    for (size_t i = 0; i < visits.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(visits[i], 2);
+}
+
+MORDOR_UNITTEST(Scheduler, parallelForEachForwardIterator)
+{
+    std::list<int> values;
+    for (int i = 1; i <= 10; ++i)
+        values.push_back(i);
+    WorkerPool pool;
+
+    int sequence = 1;
+    parallel_foreach(values.begin(), values.end(), boost::bind(
+        &checkEqual, _1, boost::ref(sequence)), 4);
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 11);
+}
+
+static long long add(long long lhs, long long rhs)
+{
+    return lhs + rhs;
+}
+
+MORDOR_UNITTEST(Scheduler, parallelReduce)
+{
+    std::vector<long long> values(100000);
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = (long long)i + 1;
+    WorkerPool pool(4);
+
+    MORDOR_TEST_ASSERT_EQUAL(parallel_reduce(values.begin(), values.end(),
+        10ll, &add), 5000050010ll);
+    MORDOR_TEST_ASSERT_EQUAL(parallel_reduce(values.begin(), values.begin(),
+        10ll, &add), 10ll);
+    MORDOR_TEST_ASSERT_EQUAL(parallel_reduce(values.begin(), values.end(),
+        0ll, &add, 1), 5000050000ll);
+}
+
+static int square(int x)
+{
+    return x * x;
+}
+
+MORDOR_UNITTEST(Scheduler, parallelTransform)
+{
+    std::vector<int> values(10000), squares(10000);
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = (int)i;
+    WorkerPool pool(4);
+
+    MORDOR_TEST_ASSERT(parallel_transform(values.begin(), values.end(),
+        squares.begin(), &square) == squares.end());
+    for (size_t i = 0; i < squares.size(); ++i)
+        MORDOR_TEST_ASSERT_EQUAL(squares[i], (int)(i * i));
+}
+
+MORDOR_UNITTEST(Scheduler, parallelSort)
+{
+    std::vector<int> values(100000);
+    unsigned int seed = 1;
+    for (size_t i = 0; i < values.size(); ++i) {
+        seed = seed * 1103515245 + 12345;
+        values[i] = (int)(seed >> 8);
+    }
+    std::vector<int> expected(values);
+    std::sort(expected.begin(), expected.end());
+    WorkerPool pool(4);
+
+    // An odd number of runs leaves one without a partner in the first merge
+    std::vector<int> sorted(values);
+    parallel_sort(sorted.begin(), sorted.end(), 3);
+    MORDOR_TEST_ASSERT(sorted == expected);
+
+    parallel_sort(values.begin(), values.end(), std::greater<int>());
+    std::reverse(expected.begin(), expected.end());
+    MORDOR_TEST_ASSERT(values == expected);
+}
+
 // #ifndef NDEBUG
 // MORDOR_UNITTEST(Scheduler, scheduleForThreadNotOnScheduler)
 // {
@@ -445,6 +547,239 @@ MORDOR_UNITTEST(Scheduler, spreadTheLoadWhileStopping)
     MORDOR_TEST_ASSERT_ABOUT_EQUAL(threads.size(), 8u, 2u);
 }
 
+MORDOR_UNITTEST(Scheduler, workStealingHybridBasic)
+{
+    Fiber::ptr doNothingFiber(new Fiber(&doNothing));
+    WorkerPool pool(2, true, 1, true);
+    MORDOR_TEST_ASSERT(pool.workStealing());
+    pool.schedule(doNothingFiber);
+    Scheduler::yield();
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(doNothingFiber->state(), Fiber::TERM);
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingSpreadTheLoad)
+{
+    std::set<tid_t> threads;
+    {
+        boost::mutex mutex;
+        WorkerPool pool(8, true, 1, true);
+        // Wait for the other threads to get to idle first
+        Mordor::sleep(100000);
+
+        // Everything startTheFibers schedules lands on its own thread's
+        // queue; the other threads have to steal it
+        pool.schedule(boost::bind(&startTheFibers, boost::ref(threads),
+            boost::ref(mutex)));
+        pool.stop();
+    }
+    MORDOR_TEST_ASSERT_ABOUT_EQUAL(threads.size(), 8u, 2u);
+}
+
+MORDOR_UNITTEST(Scheduler, workStealingSwitchToThread)
+{
+    IOManager ioManager(2, true, true, 1, true);
+    tid_t rootThread = gettid();
+    tid_t otherThread = ioManager.threads()[0]->tid();
+    for (int i = 0; i < 100; ++i) {
+        ioManager.switchTo(otherThread);
+        MORDOR_TEST_ASSERT_EQUAL(gettid(), otherThread);
+        // Free to run on either thread now
+        Scheduler::yield();
+        ioManager.switchTo(rootThread);
+        MORDOR_TEST_ASSERT_EQUAL(gettid(), rootThread);
+    }
+    ioManager.stop();
+}
+
+static void slowJob(int &done)
+{
+    Mordor::sleep(1000);
+    atomicIncrement(done);
+}
+
+MORDOR_UNITTEST(Scheduler, workerPoolBoundedSubmit)
+{
+    CountStatistic<unsigned long long> *submitWaits =
+        Statistics::lookup<CountStatistic<unsigned long long> >(
+            "workerpool.submitwaits");
+    MORDOR_TEST_ASSERT(submitWaits);
+    unsigned long long waitsBefore = submitWaits->count;
+    WorkerPool caller;
+    WorkerPool pool(2, false, 1, false, 4);
+    MORDOR_TEST_ASSERT_EQUAL(pool.maxQueueDepth(), 4u);
+    int done = 0;
+    for (int i = 0; i < 50; ++i) {
+        pool.submit(boost::bind(&slowJob, boost::ref(done)));
+        MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(pool.queueDepth(), 4u);
+    }
+    pool.stop();
+    MORDOR_TEST_ASSERT_EQUAL(done, 50);
+    MORDOR_TEST_ASSERT_EQUAL(pool.queueDepth(), 0u);
+    // Two threads can't keep up with 1ms jobs; submitters had to wait
+    MORDOR_TEST_ASSERT_GREATER_THAN(submitWaits->count, waitsBefore);
+}
+
+MORDOR_UNITTEST(Scheduler, workerPoolUnboundedSubmit)
+{
+    WorkerPool pool;
+    int done = 0;
+    for (int i = 0; i < 10; ++i)
+        pool.submit(boost::bind(&increment, boost::ref(done)));
+    MORDOR_TEST_ASSERT_EQUAL(pool.queueDepth(), 10u);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(done, 10);
+    MORDOR_TEST_ASSERT_EQUAL(pool.queueDepth(), 0u);
+}
+
+static void recordOrder(std::vector<int> &order, int value)
+{
+    order.push_back(value);
+}
+
+MORDOR_UNITTEST(Scheduler, priorities)
+{
+    WorkerPool pool;
+    std::vector<int> order;
+    pool.schedule(boost::bind(&recordOrder, boost::ref(order), 4),
+        emptytid(), Scheduler::LOW);
+    pool.schedule(boost::bind(&recordOrder, boost::ref(order), 3));
+    pool.scheduleDeadline(boost::bind(&recordOrder, boost::ref(order), 2),
+        TimerManager::now() + 60000000ull);
+    pool.schedule(boost::bind(&recordOrder, boost::ref(order), 1),
+        emptytid(), Scheduler::HIGH);
+    // Already late, so it beats even HIGH work
+    pool.scheduleDeadline(boost::bind(&recordOrder, boost::ref(order), 0),
+        TimerManager::now() - 1);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 5u);
+    for (int i = 0; i < 5; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(order[i], i);
+}
+
+MORDOR_UNITTEST(Scheduler, priorityAntiStarvation)
+{
+    ConfigVarBase::ptr limit = Config::lookup("scheduler.starvationlimit");
+    std::string oldLimit = limit->toString();
+    MORDOR_TEST_ASSERT(limit->fromString("4"));
+    std::vector<int> order;
+    {
+        WorkerPool pool;
+        pool.schedule(boost::bind(&recordOrder, boost::ref(order), -1),
+            emptytid(), Scheduler::LOW);
+        for (int i = 0; i < 10; ++i)
+            pool.schedule(boost::bind(&recordOrder, boost::ref(order), i),
+                emptytid(), Scheduler::HIGH);
+        pool.dispatch();
+    }
+    limit->fromString(oldLimit);
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 11u);
+    // Passed over four times, then it goes first
+    MORDOR_TEST_ASSERT_EQUAL(order[4], -1);
+}
+
+static void schedulePriorities(std::vector<int> &order)
+{
+    // Scheduled from inside a work stealing Scheduler, so the NORMAL work
+    // goes on this thread's own queue and the rest on the shared one
+    Scheduler *scheduler = Scheduler::getThis();
+    for (int i = 3; i < 13; ++i)
+        scheduler->schedule(boost::bind(&recordOrder, boost::ref(order), i));
+    scheduler->schedule(boost::bind(&recordOrder, boost::ref(order), 13),
+        emptytid(), Scheduler::LOW);
+    scheduler->scheduleDeadline(boost::bind(&recordOrder, boost::ref(order),
+        2), TimerManager::now() + 60000000ull);
+    scheduler->schedule(boost::bind(&recordOrder, boost::ref(order), 1),
+        emptytid(), Scheduler::HIGH);
+    scheduler->scheduleDeadline(boost::bind(&recordOrder, boost::ref(order),
+        0), TimerManager::now() - 1);
+}
+
+MORDOR_UNITTEST(Scheduler, prioritiesWorkStealing)
+{
+    WorkerPool pool(1, true, 1, true);
+    std::vector<int> order;
+    pool.schedule(boost::bind(&schedulePriorities, boost::ref(order)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 14u);
+    for (int i = 0; i < 14; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(order[i], i);
+}
+
+static void scheduleStarvable(std::vector<int> &order)
+{
+    Scheduler *scheduler = Scheduler::getThis();
+    scheduler->schedule(boost::bind(&recordOrder, boost::ref(order), -1),
+        emptytid(), Scheduler::LOW);
+    for (int i = 0; i < 10; ++i)
+        scheduler->schedule(boost::bind(&recordOrder, boost::ref(order), i));
+}
+
+MORDOR_UNITTEST(Scheduler, priorityAntiStarvationWorkStealing)
+{
+    ConfigVarBase::ptr limit = Config::lookup("scheduler.starvationlimit");
+    std::string oldLimit = limit->toString();
+    MORDOR_TEST_ASSERT(limit->fromString("4"));
+    std::vector<int> order;
+    {
+        WorkerPool pool(1, true, 1, true);
+        pool.schedule(boost::bind(&scheduleStarvable, boost::ref(order)));
+        pool.dispatch();
+    }
+    limit->fromString(oldLimit);
+    MORDOR_TEST_ASSERT_EQUAL(order.size(), 11u);
+    // Local dispatches count, so it isn't stuck behind the whole local queue
+    std::vector<int>::iterator it = std::find(order.begin(), order.end(), -1);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(it - order.begin(), 5);
+}
+
+static void checkPriorityAcrossYield(Scheduler::Priority expected,
+    int &checked)
+{
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentPriority(), expected);
+    Scheduler::yield();
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentPriority(), expected);
+    ++checked;
+}
+
+MORDOR_UNITTEST(Scheduler, priorityAcrossYield)
+{
+    WorkerPool pool;
+    int checked = 0;
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentPriority(), Scheduler::NORMAL);
+    pool.schedule(boost::bind(&checkPriorityAcrossYield, Scheduler::LOW,
+        boost::ref(checked)), emptytid(), Scheduler::LOW);
+    pool.schedule(boost::bind(&checkPriorityAcrossYield, Scheduler::HIGH,
+        boost::ref(checked)), emptytid(), Scheduler::HIGH);
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(checked, 2);
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentPriority(), Scheduler::NORMAL);
+}
+
+static void checkDeadlineAcrossYield(unsigned long long expected,
+    int &checked)
+{
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentDeadline(), expected);
+    Scheduler::yield();
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentDeadline(), expected);
+    ++checked;
+}
+
+MORDOR_UNITTEST(Scheduler, deadlineAcrossYield)
+{
+    WorkerPool pool;
+    int checked = 0;
+    unsigned long long deadline = TimerManager::now() + 60000000ull;
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentDeadline(), ~0ull);
+    pool.scheduleDeadline(boost::bind(&checkDeadlineAcrossYield, deadline,
+        boost::ref(checked)), deadline);
+    pool.schedule(boost::bind(&checkDeadlineAcrossYield, ~0ull,
+        boost::ref(checked)));
+    pool.dispatch();
+    MORDOR_TEST_ASSERT_EQUAL(checked, 2);
+    MORDOR_TEST_ASSERT_EQUAL(Scheduler::currentDeadline(), ~0ull);
+}
+
 MORDOR_UNITTEST(Scheduler, tolerantException)
 {
     WorkerPool pool;
@@ -542,3 +877,51 @@ MORDOR_UNITTEST(Scheduler, allowYieldInDestructor)
             new Fiber(boost::bind(fun, boost::shared_ptr<DummyClass>(new DummyClass)))));
     pool.stop();
 }
+
+static void countStackUse(int &runs)
+{
+    char stackEater[1024];
+    memset(stackEater, 1, sizeof(stackEater));
+    if (stackEater[sizeof(stackEater) - 1] == 1)
+        ++runs;
+}
+
+MORDOR_UNITTEST(Scheduler, stackWatermarkBySite)
+{
+    ConfigVarBase::ptr measure = Config::lookup("fiber.stackwatermark");
+    ConfigVarBase::ptr adaptive = Config::lookup("scheduler.adaptivestacks");
+    Statistic *sites = Statistics::lookup("scheduler.stackwatermark");
+    MORDOR_TEST_ASSERT(measure);
+    MORDOR_TEST_ASSERT(adaptive);
+    MORDOR_TEST_ASSERT(sites);
+    sites->reset();
+    int runs = 0;
+    MORDOR_TEST_ASSERT(measure->fromString("1"));
+    MORDOR_TEST_ASSERT(adaptive->fromString("1"));
+    try {
+        WorkerPool pool;
+        // Enough runs for adaptive stacks to start shrinking the stack
+        for (int i = 0; i < 200; ++i) {
+            pool.schedule(boost::bind(&countStackUse, boost::ref(runs)));
+            pool.dispatch();
+        }
+    } catch (...) {
+        measure->fromString("0");
+        adaptive->fromString("0");
+        throw;
+    }
+    measure->fromString("0");
+    adaptive->fromString("0");
+    MORDOR_TEST_ASSERT_EQUAL(runs, 200);
+    std::ostringstream os;
+    os << *sites;
+    MORDOR_TEST_ASSERT(os.str().find("max ") != std::string::npos);
+    MORDOR_TEST_ASSERT(os.str().find("+: ") != std::string::npos);
+    // The call site above has settled on a stack smaller than the default
+    size_t stack = os.str().find("stack ");
+    MORDOR_TEST_ASSERT(stack != std::string::npos);
+    size_t stacksize = strtoul(os.str().c_str() + stack + 6, NULL, 10);
+    MORDOR_TEST_ASSERT_GREATER_THAN(stacksize, 0u);
+    MORDOR_TEST_ASSERT_LESS_THAN(stacksize, Fiber::defaultStackSize());
+    sites->reset();
+}
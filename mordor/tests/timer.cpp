@@ -2,6 +2,8 @@
 
 #include <boost/bind.hpp>
 
+#include "mordor/config.h"
+#include "mordor/iomanager.h"
 #include "mordor/timer.h"
 #include "mordor/workerpool.h"
 #include "mordor/test/test.h"
@@ -174,6 +176,181 @@ MORDOR_UNITTEST(Timer, rollover)
     TimerManager::setClock();
 }
 
+static void
+recordTimer(std::vector<int> &fired, int id)
+{
+    fired.push_back(id);
+}
+
+MORDOR_UNITTEST(Timer, timingWheel)
+{
+    static unsigned long long clock = 1000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+    const unsigned long long start = clock;
+
+    std::vector<int> fired;
+    TimerManager manager(true);
+    MORDOR_TEST_ASSERT(manager.timingWheel());
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+    // Spread across the finest level and several coarser ones
+    manager.registerTimer(500ULL,
+        boost::bind(&recordTimer, boost::ref(fired), 1));
+    manager.registerTimer(5000000ULL,
+        boost::bind(&recordTimer, boost::ref(fired), 3));
+    manager.registerTimer(7200000000ULL,
+        boost::bind(&recordTimer, boost::ref(fired), 4));
+    Timer::ptr cancelled = manager.registerTimer(10000000ULL,
+        boost::bind(&recordTimer, boost::ref(fired), 5));
+    Timer::ptr refreshed = manager.registerTimer(1000000ULL,
+        boost::bind(&recordTimer, boost::ref(fired), 2));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 500ULL);
+
+    // Timers still expire exactly on time, not on a slot boundary
+    clock += 499;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT(fired.empty());
+    clock += 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 1u);
+    MORDOR_TEST_ASSERT(cancelled->cancel());
+
+    clock += 500000;
+    MORDOR_TEST_ASSERT(refreshed->refresh());
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(manager.nextTimer(), 1000000ULL);
+    clock += 999999;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 1u);
+    clock += 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 2u);
+
+    clock = start + 5000000ULL;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 3u);
+    clock = start + 7200000000ULL - 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 3u);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 1ULL);
+    clock += 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 4u);
+    for (int i = 0; i < 4; ++i)
+        MORDOR_TEST_ASSERT_EQUAL(fired[i], i + 1);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), ~0ull);
+
+    TimerManager::setClock();
+}
+
+MORDOR_UNITTEST(Timer, slack)
+{
+    static unsigned long long clock = 1000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+
+    std::vector<int> fired;
+    TimerManager manager;
+    manager.registerTimer(1000, boost::bind(&recordTimer, boost::ref(fired), 1),
+        false, 1000);
+    // Both of these round up to the same expiration
+    manager.registerTimer(1500, boost::bind(&recordTimer, boost::ref(fired), 2),
+        false, 1000);
+    manager.registerTimer(1800, boost::bind(&recordTimer, boost::ref(fired), 3),
+        false, 1000);
+    Timer::ptr refreshed = manager.registerTimer(10000,
+        boost::bind(&recordTimer, boost::ref(fired), 4), false, 10000);
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 1000ULL);
+    clock += 1999;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 1u);
+    clock += 1;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(fired.size(), 3u);
+
+    MORDOR_TEST_ASSERT(refreshed->refresh());
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 18000ULL);
+    // Still within the same window, so it stays put
+    clock += 5000;
+    MORDOR_TEST_ASSERT(refreshed->refresh());
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 13000ULL);
+    clock += 4000;
+    MORDOR_TEST_ASSERT(refreshed->refresh());
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 19000ULL);
+    refreshed->cancel();
+
+    TimerManager::setClock();
+}
+
+MORDOR_UNITTEST(Timer, coarseClock)
+{
+    static unsigned long long clock = 1000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+    ConfigVarBase::ptr coarseClock = Config::lookup("timer.coarseclock");
+    std::string old = coarseClock->toString();
+    MORDOR_TEST_ASSERT(coarseClock->fromString("1"));
+    int sequence = 0;
+    TimerManager manager;
+    coarseClock->fromString(old);
+    MORDOR_TEST_ASSERT(manager.coarseClock());
+
+    manager.executeTimers();
+    clock += 500;
+    // Relative to when timers were last processed, not the current time
+    Timer::ptr timer = manager.registerTimer(1000,
+        boost::bind(&singleTimer, boost::ref(sequence), 1));
+    MORDOR_TEST_ASSERT_EQUAL(manager.nextTimer(), 500ULL);
+    clock += 500;
+    manager.executeTimers();
+    MORDOR_TEST_ASSERT_EQUAL(sequence, 1);
+
+    TimerManager::setClock();
+}
+
+static void doNothing() {}
+
+// Each piece of work takes a millisecond (of fake time), and the last one
+// registers a timer and sees how far away it is
+static void busyWork(IOManager &manager, unsigned long long &clock,
+    int remaining, unsigned long long &nextTimer)
+{
+    clock += 1000;
+    if (remaining) {
+        manager.schedule(boost::bind(&busyWork, boost::ref(manager),
+            boost::ref(clock), remaining - 1, boost::ref(nextTimer)));
+        return;
+    }
+    Timer::ptr timer = manager.registerTimer(100000, &doNothing);
+    nextTimer = manager.nextTimer();
+    timer->cancel();
+}
+
+// An IOManager too busy to go idle still refreshes its coarse clock, so
+// timers registered after 200ms of work don't expire 200ms early
+MORDOR_UNITTEST(Timer, coarseClockUnderLoad)
+{
+    static unsigned long long clock = 1000000000ULL;
+    TimerManager::setClock(boost::bind(&fakeClock, boost::ref(clock)));
+    ConfigVarBase::ptr coarseClock = Config::lookup("timer.coarseclock");
+    std::string old = coarseClock->toString();
+    MORDOR_TEST_ASSERT(coarseClock->fromString("1"));
+    unsigned long long nextTimer = 0;
+    try {
+        IOManager manager;
+        coarseClock->fromString(old);
+        MORDOR_TEST_ASSERT(manager.coarseClock());
+        manager.executeTimers();
+        manager.schedule(boost::bind(&busyWork, boost::ref(manager),
+            boost::ref(clock), 200, boost::ref(nextTimer)));
+        manager.dispatch();
+    } catch (...) {
+        coarseClock->fromString(old);
+        TimerManager::setClock();
+        throw;
+    }
+    TimerManager::setClock();
+    // Refreshed at least every 64 dispatches
+    MORDOR_TEST_ASSERT_GREATER_THAN(nextTimer, 100000ULL - 64 * 1000ULL);
+    MORDOR_TEST_ASSERT_LESS_THAN_OR_EQUAL(nextTimer, 100000ULL);
+}
+
 namespace {
 // anonymous namespace so that the class is only visible in this compiling unit
 class TestTimerClass
@@ -34,10 +34,50 @@ static Logger::ptr g_log = Log::lookup("mordor:timer");
 static ConfigVar<unsigned long long>::ptr g_clockRolloverThreshold =
     Config::lookup<unsigned long long>("timer.clockrolloverthreshold", 5000000ULL,
     "Expire all timers if the clock goes backward by >= this amount");
+static ConfigVar<bool>::ptr g_coarseClock = Config::lookup<bool>(
+    "timer.coarseclock", false,
+    "Register timers relative to when timers were last processed instead of "
+    "reading the clock every time");
+static ConfigVar<bool>::ptr g_timingWheel = Config::lookup<bool>(
+    "timer.wheel", false,
+    "Keep timers in a hierarchical timing wheel instead of a sorted set");
+static ConfigVar<unsigned long long>::ptr g_wheelResolution =
+    Config::lookup<unsigned long long>("timer.wheel.resolution", 1000ULL,
+    "Microseconds covered by each slot of the finest level of a timing wheel");
+
+// The finest level of the wheel has 256 slots, and each coarser level 64
+// slots that each cover all of the level below; with the default resolution
+// that spans 49 days, and timers further out than that are cascaded back up
+// to the top level until they're close enough
+static const size_t g_wheelLevels = 5;
+static const size_t g_wheelNearBits = 8;
+static const size_t g_wheelFarBits = 6;
+static const size_t g_wheelNearSlots = 1 << g_wheelNearBits;
+static const size_t g_wheelFarSlots = 1 << g_wheelFarBits;
+
+static inline size_t wheelShift(size_t level)
+{
+    return level == 0 ? 0 : g_wheelNearBits + g_wheelFarBits * (level - 1);
+}
+
+static inline size_t wheelOffset(size_t level)
+{
+    return level == 0 ? 0 : g_wheelNearSlots + g_wheelFarSlots * (level - 1);
+}
 
 static void
 stubOnTimer(boost::weak_ptr<void> weakCond, boost::function<void ()> dg);
 
+// Round next up to a multiple of slack
+static inline unsigned long long
+coalesce(unsigned long long next, unsigned long long slack)
+{
+    if (slack <= 1 || next > ~0ull - slack)
+        return next;
+    unsigned long long remainder = next % slack;
+    return remainder ? next + slack - remainder : next;
+}
+
 #ifdef WINDOWS
 static unsigned long long queryFrequency()
 {
@@ -87,18 +127,26 @@ TimerManager::now()
 }
 
 Timer::Timer(unsigned long long us, boost::function<void ()> dg, bool recurring,
-             TimerManager *manager)
+             TimerManager *manager, unsigned long long slack)
     : m_recurring(recurring),
+      m_next(0),
       m_us(us),
+      m_slack(slack),
       m_dg(dg),
-      m_manager(manager)
+      m_manager(manager),
+      m_wheelPrev(NULL),
+      m_wheelNext(NULL),
+      m_wheelSlot(0)
 {
     MORDOR_ASSERT(m_dg);
-    m_next = TimerManager::now() + m_us;
 }
 
 Timer::Timer(unsigned long long next)
-    : m_next(next)
+    : m_next(next),
+      m_slack(0),
+      m_wheelPrev(NULL),
+      m_wheelNext(NULL),
+      m_wheelSlot(0)
 {}
 
 bool
@@ -108,10 +156,7 @@ Timer::cancel()
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (m_dg) {
         m_dg = NULL;
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            m_manager->m_timers.find(shared_from_this());
-        MORDOR_ASSERT(it != m_manager->m_timers.end());
-        m_manager->m_timers.erase(it);
+        m_manager->erase(shared_from_this());
         return true;
     }
     return false;
@@ -123,12 +168,13 @@ Timer::refresh()
     boost::mutex::scoped_lock lock(m_manager->m_mutex);
     if (!m_dg)
         return false;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
-    m_next = TimerManager::now() + m_us;
-    m_manager->m_timers.insert(shared_from_this());
+    unsigned long long next = coalesce(m_manager->timerNow() + m_us, m_slack);
+    if (next == m_next)
+        return true;
+    Timer::ptr self = shared_from_this();
+    m_manager->erase(self);
+    m_next = next;
+    m_manager->insert(self);
     lock.unlock();
     MORDOR_LOG_DEBUG(g_log) << this << " refresh";
     return true;
@@ -143,19 +189,16 @@ Timer::reset(unsigned long long us, bool fromNow)
     // No change
     if (us == m_us && !fromNow)
         return true;
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_manager->m_timers.find(shared_from_this());
-    MORDOR_ASSERT(it != m_manager->m_timers.end());
-    m_manager->m_timers.erase(it);
+    Timer::ptr self = shared_from_this();
+    m_manager->erase(self);
     unsigned long long start;
     if (fromNow)
-        start = TimerManager::now();
+        start = m_manager->timerNow();
     else
         start = m_next - m_us;
     m_us = us;
-    m_next = start + m_us;
-    it = m_manager->m_timers.insert(shared_from_this()).first;
-    bool atFront = (it == m_manager->m_timers.begin()) && !m_manager->m_tickled;
+    m_next = coalesce(start + m_us, m_slack);
+    bool atFront = m_manager->insert(self) && !m_manager->m_tickled;
     if (atFront)
         m_manager->m_tickled = true;
     lock.unlock();
@@ -167,27 +210,69 @@ Timer::reset(unsigned long long us, bool fromNow)
 
 TimerManager::TimerManager()
 : m_tickled(false),
-  m_previousTime(0ull)
-{}
+  m_previousTime(0ull),
+  m_coarseClock(g_coarseClock->val()),
+  m_coarseNow(0ull),
+  m_timingWheel(g_timingWheel->val()),
+  m_wheelResolution(std::max(1ull, g_wheelResolution->val())),
+  m_wheelTick(0ull),
+  m_wheelCascaded(~0ull),
+  m_wheelEarliest(~0ull),
+  m_wheelCount(0),
+  m_wheelNear(0)
+{
+    if (m_timingWheel) {
+        m_wheelSlots.resize(wheelOffset(g_wheelLevels), NULL);
+        m_wheelSlotMin.resize(wheelOffset(g_wheelLevels), ~0ull);
+    }
+}
+
+TimerManager::TimerManager(bool timingWheel)
+: m_tickled(false),
+  m_previousTime(0ull),
+  m_coarseClock(g_coarseClock->val()),
+  m_coarseNow(0ull),
+  m_timingWheel(timingWheel),
+  m_wheelResolution(std::max(1ull, g_wheelResolution->val())),
+  m_wheelTick(0ull),
+  m_wheelCascaded(~0ull),
+  m_wheelEarliest(~0ull),
+  m_wheelCount(0),
+  m_wheelNear(0)
+{
+    if (m_timingWheel) {
+        m_wheelSlots.resize(wheelOffset(g_wheelLevels), NULL);
+        m_wheelSlotMin.resize(wheelOffset(g_wheelLevels), ~0ull);
+    }
+}
 
 TimerManager::~TimerManager()
 {
 #ifndef NDEBUG
     boost::mutex::scoped_lock lock(m_mutex);
     MORDOR_NOTHROW_ASSERT(m_timers.empty());
+    MORDOR_NOTHROW_ASSERT(m_wheelCount == 0);
 #endif
+    // Like destroying m_timers, let go of anything still registered
+    for (std::vector<Timer *>::iterator it = m_wheelSlots.begin();
+        it != m_wheelSlots.end();
+        ++it) {
+        while (Timer *timer = *it) {
+            unlink(timer);
+            timer->m_self.reset();
+        }
+    }
 }
 
 Timer::ptr
 TimerManager::registerTimer(unsigned long long us, boost::function<void ()> dg,
-        bool recurring)
+        bool recurring, unsigned long long slack)
 {
     MORDOR_ASSERT(dg);
-    Timer::ptr result(new Timer(us, dg, recurring, this));
+    Timer::ptr result(new Timer(us, dg, recurring, this, slack));
     boost::mutex::scoped_lock lock(m_mutex);
-    std::set<Timer::ptr, Timer::Comparator>::iterator it =
-        m_timers.insert(result).first;
-    bool atFront = (it == m_timers.begin()) && !m_tickled;
+    result->m_next = coalesce(timerNow() + us, slack);
+    bool atFront = insert(result) && !m_tickled;
     if (atFront)
         m_tickled = true;
     lock.unlock();
@@ -202,11 +287,12 @@ Timer::ptr
 TimerManager::registerConditionTimer(unsigned long long us,
     boost::function<void ()> dg,
     boost::weak_ptr<void> weakCond,
-    bool recurring)
+    bool recurring,
+    unsigned long long slack)
 {
     return registerTimer(us,
         boost::bind(stubOnTimer, weakCond, dg),
-        recurring);
+        recurring, slack);
 }
 
 static void
@@ -226,17 +312,21 @@ TimerManager::nextTimer()
 {
     boost::mutex::scoped_lock lock(m_mutex);
     m_tickled = false;
-    if (m_timers.empty()) {
+    unsigned long long next;
+    if (m_timingWheel)
+        next = m_wheelEarliest = nextWheelTimer();
+    else
+        next = m_timers.empty() ? ~0ull : (*m_timers.begin())->m_next;
+    if (next == ~0ull) {
         MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): ~0ull";
         return ~0ull;
     }
-    const Timer::ptr &next = *m_timers.begin();
     unsigned long long nowUs = now();
     unsigned long long result;
-    if (nowUs >= next->m_next)
+    if (nowUs >= next)
         result = 0;
     else
-        result = next->m_next - nowUs;
+        result = next - nowUs;
     MORDOR_LOG_DEBUG(g_log) << this << " nextTimer(): " << result;
     return result;
 }
@@ -269,20 +359,27 @@ TimerManager::processTimers()
     unsigned long long nowUs = now();
     {
         boost::mutex::scoped_lock lock(m_mutex);
-        if (m_timers.empty())
-            return result;
-        bool rollover = detectClockRollover(nowUs);
-        if (!rollover && (*m_timers.begin())->m_next > nowUs)
-            return result;
-        Timer nowTimer(nowUs);
-        Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
-        // Find all timers that are expired
-        std::set<Timer::ptr, Timer::Comparator>::iterator it =
-            rollover ? m_timers.end() : m_timers.lower_bound(nowTimerPtr);
-        while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
-        // Copy to expired, remove from m_timers;
-        expired.insert(expired.begin(), m_timers.begin(), it);
-        m_timers.erase(m_timers.begin(), it);
+        m_coarseNow = nowUs;
+        if (m_timingWheel) {
+            if (m_wheelCount == 0)
+                return result;
+            expireWheel(nowUs, detectClockRollover(nowUs), expired);
+        } else {
+            if (m_timers.empty())
+                return result;
+            bool rollover = detectClockRollover(nowUs);
+            if (!rollover && (*m_timers.begin())->m_next > nowUs)
+                return result;
+            Timer nowTimer(nowUs);
+            Timer::ptr nowTimerPtr(&nowTimer, &nop<Timer *>);
+            // Find all timers that are expired
+            std::set<Timer::ptr, Timer::Comparator>::iterator it =
+                rollover ? m_timers.end() : m_timers.lower_bound(nowTimerPtr);
+            while (it != m_timers.end() && (*it)->m_next == nowUs ) ++it;
+            // Copy to expired, remove from m_timers;
+            expired.insert(expired.begin(), m_timers.begin(), it);
+            m_timers.erase(m_timers.begin(), it);
+        }
         result.reserve(expired.size());
         // Look at expired timers and re-register recurring timers
         // (while under the same lock)
@@ -294,8 +391,8 @@ TimerManager::processTimers()
             result.push_back(timer->m_dg);
             if (timer->m_recurring) {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired and refreshed";
-                timer->m_next = nowUs + timer->m_us;
-                m_timers.insert(timer);
+                timer->m_next = coalesce(nowUs + timer->m_us, timer->m_slack);
+                insert(timer);
             } else {
                 MORDOR_LOG_TRACE(g_log) << timer << " expired";
                 timer->m_dg = NULL;
@@ -317,6 +414,209 @@ TimerManager::executeTimers()
     }
 }
 
+void
+TimerManager::refreshCoarseClock()
+{
+    if (!m_coarseClock)
+        return;
+    unsigned long long nowUs = now();
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_coarseNow = nowUs;
+}
+
+unsigned long long
+TimerManager::timerNow()
+{
+    return m_coarseClock && m_coarseNow ? m_coarseNow : now();
+}
+
+bool
+TimerManager::insert(const Timer::ptr &timer)
+{
+    if (!m_timingWheel)
+        return m_timers.insert(timer).first == m_timers.begin();
+    // Nothing to walk past; start from now
+    if (m_wheelCount == 0)
+        m_wheelTick = now() / m_wheelResolution;
+    timer->m_self = timer;
+    link(timer.get());
+    if (timer->m_next >= m_wheelEarliest)
+        return false;
+    m_wheelEarliest = timer->m_next;
+    return true;
+}
+
+void
+TimerManager::erase(const Timer::ptr &timer)
+{
+    if (!m_timingWheel) {
+        std::set<Timer::ptr, Timer::Comparator>::iterator it =
+            m_timers.find(timer);
+        MORDOR_ASSERT(it != m_timers.end());
+        m_timers.erase(it);
+        return;
+    }
+    MORDOR_ASSERT(timer->m_self);
+    unlink(timer.get());
+    timer->m_self.reset();
+}
+
+void
+TimerManager::link(Timer *timer)
+{
+    unsigned long long tick = timer->m_next / m_wheelResolution;
+    // Already expired; goes in the slot that will be looked at next
+    if (tick < m_wheelTick)
+        tick = m_wheelTick;
+    unsigned long long delta = tick - m_wheelTick;
+    size_t level = 0;
+    while (level + 1 < g_wheelLevels &&
+        delta >= (1ull << wheelShift(level + 1)))
+        ++level;
+    // Beyond the top level; park it as far out as possible, and it will be
+    // placed again when that slot is cascaded
+    if (level + 1 == g_wheelLevels &&
+        delta >= (1ull << wheelShift(g_wheelLevels))) {
+        tick = m_wheelTick + (1ull << wheelShift(g_wheelLevels)) - 1;
+    }
+    size_t slots = level == 0 ? g_wheelNearSlots : g_wheelFarSlots;
+    size_t slot = wheelOffset(level) +
+        (size_t)((tick >> wheelShift(level)) & (slots - 1));
+    Timer *&head = m_wheelSlots[slot];
+    unsigned long long &slotMin = m_wheelSlotMin[slot];
+    slotMin = head ? std::min(slotMin, timer->m_next) : timer->m_next;
+    timer->m_wheelSlot = slot;
+    timer->m_wheelPrev = NULL;
+    timer->m_wheelNext = head;
+    if (head)
+        head->m_wheelPrev = timer;
+    head = timer;
+    ++m_wheelCount;
+    if (level == 0)
+        ++m_wheelNear;
+}
+
+void
+TimerManager::unlink(Timer *timer)
+{
+    if (timer->m_wheelPrev)
+        timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+    else
+        m_wheelSlots[timer->m_wheelSlot] = timer->m_wheelNext;
+    if (timer->m_wheelNext)
+        timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+    timer->m_wheelPrev = timer->m_wheelNext = NULL;
+    --m_wheelCount;
+    if (timer->m_wheelSlot < g_wheelNearSlots)
+        --m_wheelNear;
+}
+
+void
+TimerManager::cascade(size_t level)
+{
+    size_t slot = wheelOffset(level) +
+        (size_t)((m_wheelTick >> wheelShift(level)) & (g_wheelFarSlots - 1));
+    std::vector<Timer *> timers;
+    while (Timer *timer = m_wheelSlots[slot]) {
+        unlink(timer);
+        timers.push_back(timer);
+    }
+    for (std::vector<Timer *>::iterator it = timers.begin();
+        it != timers.end();
+        ++it)
+        link(*it);
+}
+
+void
+TimerManager::expireWheel(unsigned long long nowUs, bool rollover,
+    std::vector<Timer::ptr> &expired)
+{
+    unsigned long long nowTick = nowUs / m_wheelResolution;
+    if (rollover) {
+        for (std::vector<Timer *>::iterator it = m_wheelSlots.begin();
+            it != m_wheelSlots.end();
+            ++it) {
+            while (Timer *timer = *it) {
+                unlink(timer);
+                expired.push_back(Timer::ptr());
+                expired.back().swap(timer->m_self);
+            }
+        }
+        m_wheelTick = nowTick;
+        return;
+    }
+    std::vector<Timer *> notYet;
+    while (m_wheelTick <= nowTick) {
+        if (m_wheelCascaded != m_wheelTick) {
+            m_wheelCascaded = m_wheelTick;
+            for (size_t level = 1; level < g_wheelLevels &&
+                (m_wheelTick & ((1ull << wheelShift(level)) - 1)) == 0;
+                ++level)
+                cascade(level);
+        }
+        Timer *&head = m_wheelSlots[m_wheelTick & (g_wheelNearSlots - 1)];
+        while (Timer *timer = head) {
+            unlink(timer);
+            // Only possible in the slot for the current tick
+            if (timer->m_next > nowUs) {
+                notYet.push_back(timer);
+                continue;
+            }
+            expired.push_back(Timer::ptr());
+            expired.back().swap(timer->m_self);
+        }
+        for (std::vector<Timer *>::iterator it = notYet.begin();
+            it != notYet.end();
+            ++it)
+            link(*it);
+        notYet.clear();
+        if (m_wheelTick == nowTick)
+            break;
+        if (m_wheelCount == 0) {
+            m_wheelTick = nowTick;
+            break;
+        }
+        // Skip straight to the next cascade if the finest level is empty
+        if (m_wheelNear == 0)
+            m_wheelTick = std::min(nowTick,
+                (m_wheelTick | (g_wheelNearSlots - 1)) + 1);
+        else
+            ++m_wheelTick;
+    }
+}
+
+unsigned long long
+TimerManager::nextWheelTimer()
+{
+    if (m_wheelCount == 0)
+        return ~0ull;
+    // Slots of a level cover successive ranges, so the first occupied slot
+    // of each level holds that level's soonest timer
+    unsigned long long result = ~0ull;
+    if (m_wheelNear != 0) {
+        for (size_t i = 0; i < g_wheelNearSlots; ++i) {
+            size_t slot = (size_t)((m_wheelTick + i) & (g_wheelNearSlots - 1));
+            if (m_wheelSlots[slot]) {
+                result = m_wheelSlotMin[slot];
+                break;
+            }
+        }
+    }
+    for (size_t level = 1; level < g_wheelLevels && m_wheelNear != m_wheelCount;
+        ++level) {
+        unsigned long long block = m_wheelTick >> wheelShift(level);
+        for (size_t i = 1; i <= g_wheelFarSlots; ++i) {
+            size_t slot = wheelOffset(level) +
+                (size_t)((block + i) & (g_wheelFarSlots - 1));
+            if (m_wheelSlots[slot]) {
+                result = std::min(result, m_wheelSlotMin[slot]);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
 void
 TimerManager::setClock(boost::function<unsigned long long()> dg)
 {
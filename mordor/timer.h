@@ -24,7 +24,7 @@ public:
 
 private:
     Timer(unsigned long long us, boost::function<void ()> dg,
-        bool recurring, TimerManager *manager);
+        bool recurring, TimerManager *manager, unsigned long long slack);
     // Constructor for dummy object
     Timer(unsigned long long next);
 
@@ -34,6 +34,8 @@ public:
     bool cancel();
 
     /// Refresh the timer from now
+    /// @note Does nothing if the new expiration coalesces with the current
+    /// one
     /// @return If it was refreshed before firing
     bool refresh();
     /// Reset the timer to the new delay
@@ -47,8 +49,14 @@ private:
     bool m_recurring;
     unsigned long long m_next;
     unsigned long long m_us;
+    unsigned long long m_slack;
     boost::function<void ()> m_dg;
     TimerManager *m_manager;
+    // Intrusive list of the timing wheel slot this Timer is in
+    Timer *m_wheelPrev, *m_wheelNext;
+    size_t m_wheelSlot;
+    // Keeps the Timer alive while it's in the timing wheel
+    Timer::ptr m_self;
 
 private:
     struct Comparator
@@ -62,11 +70,31 @@ class TimerManager : public boost::noncopyable
 {
     friend class Timer;
 public:
+    /// Uses a timing wheel if timer.wheel is set
     TimerManager();
+    /// @param timingWheel If timers should be kept in a hierarchical timing
+    /// wheel (O(1) register, cancel, refresh and reset, but nextTimer() may
+    /// report an earlier time than the next timer actually expires) instead
+    /// of a sorted set
+    TimerManager(bool timingWheel);
     virtual ~TimerManager();
 
+    bool timingWheel() const { return m_timingWheel; }
+    /// If timers are registered and refreshed relative to the time the
+    /// timers were last processed (once per idle loop of an IOManager),
+    /// rather than reading the clock each time
+    /// @note Timers registered by a thread that has been busy for a while
+    /// will expire early by up to that long; IOManagers bound it by
+    /// refreshing the clock every 64 dispatches of a thread that hasn't
+    /// gone idle
+    bool coarseClock() const { return m_coarseClock; }
+
+    /// @param slack How late the timer may fire; expirations are rounded up
+    /// to a multiple of it, so that timers expiring close together fire
+    /// together, and refreshing doesn't have to move the timer every time
     virtual Timer::ptr registerTimer(unsigned long long us,
-        boost::function<void ()> dg, bool recurring = false);
+        boost::function<void ()> dg, bool recurring = false,
+        unsigned long long slack = 0);
 
     /// Conditionally execute the dg callback function only when weakCond is
     /// still in valid status, which means, the original object managed by the
@@ -76,7 +104,8 @@ public:
     Timer::ptr registerConditionTimer(unsigned long long us,
         boost::function<void ()> dg,
         boost::weak_ptr<void> weakCond,
-        bool recurring = false);
+        bool recurring = false,
+        unsigned long long slack = 0);
 
     /// @return How long until the next timer expires; ~0ull if no timers
     unsigned long long nextTimer();
@@ -98,14 +127,58 @@ public:
 protected:
     virtual void onTimerInsertedAtFront() {}
     std::vector<boost::function<void ()> > processTimers();
+    /// Bring the coarse clock (if it's in use) up to date without
+    /// processing timers
+    void refreshCoarseClock();
 
 private:
     static boost::function<unsigned long long ()> ms_clockDg;
     bool detectClockRollover(unsigned long long nowUs);
+    /// @return The time to register timers relative to
+    /// @pre m_mutex is locked
+    unsigned long long timerNow();
+    /// @return If timer is now the soonest to expire
+    /// @pre m_mutex is locked
+    bool insert(const Timer::ptr &timer);
+    /// @pre m_mutex is locked, and timer is registered
+    void erase(const Timer::ptr &timer);
+    /// Put timer in the wheel slot for its expiration
+    void link(Timer *timer);
+    void unlink(Timer *timer);
+    /// Move the timers in a slot of a coarser level to finer slots
+    void cascade(size_t level);
+    /// Advance the wheel up to nowUs, collecting expired timers
+    void expireWheel(unsigned long long nowUs, bool rollover,
+        std::vector<Timer::ptr> &expired);
+    /// @return When the next timer in the wheel expires, or earlier if
+    /// that timer has since been cancelled or moved
+    unsigned long long nextWheelTimer();
+
+private:
     std::set<Timer::ptr, Timer::Comparator> m_timers;
     boost::mutex m_mutex;
     bool m_tickled;
     unsigned long long m_previousTime;
+    bool m_coarseClock;
+    // When timers were last processed; 0 until then
+    unsigned long long m_coarseNow;
+    bool m_timingWheel;
+    // Microseconds per tick of the finest level of the wheel
+    unsigned long long m_wheelResolution;
+    // The tick the wheel has been advanced to
+    unsigned long long m_wheelTick;
+    // The last tick at which coarser levels were cascaded
+    unsigned long long m_wheelCascaded;
+    // What the last nextTimer() told the caller, updated as sooner timers
+    // are registered
+    unsigned long long m_wheelEarliest;
+    // Timers in the wheel, and in its finest level
+    size_t m_wheelCount, m_wheelNear;
+    // Heads of every slot of every level
+    std::vector<Timer *> m_wheelSlots;
+    // The soonest expiration of any timer linked into each slot since it
+    // was last empty
+    std::vector<unsigned long long> m_wheelSlotMin;
 };
 
 }
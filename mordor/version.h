@@ -54,6 +54,8 @@
 #       define PPC
 #   elif defined(__arm__)
 #       define ARM
+#   elif defined(__aarch64__)
+#       define ARM64
 #   endif
 #endif
 
@@ -2,19 +2,66 @@
 
 #include "workerpool.h"
 
+#include <boost/bind.hpp>
+
+#include "assert.h"
+#include "atomic.h"
 #include "fiber.h"
+#include "fibersynchronization.h"
 #include "log.h"
+#include "statistics.h"
 
 namespace Mordor {
 
 static Logger::ptr g_log = Log::lookup("mordor:workerpool");
 
-WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize)
-    : Scheduler(threads, useCaller, batchSize)
+static AverageMinMaxStatistic<unsigned long long> &g_statQueueDepth =
+    Statistics::registerStatistic("workerpool.queuedepth",
+    AverageMinMaxStatistic<unsigned long long>("items"));
+static CountStatistic<unsigned long long> &g_statSubmitWaits =
+    Statistics::registerStatistic("workerpool.submitwaits",
+    CountStatistic<unsigned long long>());
+
+WorkerPool::WorkerPool(size_t threads, bool useCaller, size_t batchSize,
+    bool workStealing, size_t maxQueueDepth)
+    : Scheduler(threads, useCaller, batchSize, workStealing),
+      m_tickles(0),
+      m_maxQueueDepth(maxQueueDepth),
+      m_queueDepth(0)
 {
+    if (m_maxQueueDepth)
+        m_queueSlots.reset(new FiberSemaphore(m_maxQueueDepth));
     start();
 }
 
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+void
+WorkerPool::submit(boost::function<void ()> dg)
+{
+    if (m_queueSlots) {
+        if (m_queueDepth >= m_maxQueueDepth)
+            g_statSubmitWaits.increment();
+        m_queueSlots->wait();
+    }
+    g_statQueueDepth.update(atomicIncrement(m_queueDepth));
+    schedule(boost::bind(&WorkerPool::runSubmitted, this, dg));
+}
+
+void
+WorkerPool::runSubmitted(boost::function<void ()> dg)
+{
+    // It's out of the queue now; let the next submitter in before running
+    // what could be a long job
+    atomicDecrement(m_queueDepth);
+    if (m_queueSlots)
+        m_queueSlots->notify();
+    dg();
+}
+
 void
 WorkerPool::idle()
 {
@@ -23,6 +70,7 @@ WorkerPool::idle()
             return;
         }
         m_semaphore.wait();
+        atomicDecrement(m_tickles);
         try {
             Fiber::yield();
         } catch (OperationAbortedException &) {
@@ -34,6 +82,13 @@ WorkerPool::idle()
 void
 WorkerPool::tickle()
 {
+    // Once there's a signal pending for every thread, any thread that is or
+    // is about to be waiting will wake anyway; more would just be a storm of
+    // spurious wakeups after a burst of scheduling
+    if (atomicIncrement(m_tickles) > threadCount()) {
+        atomicDecrement(m_tickles);
+        return;
+    }
     MORDOR_LOG_DEBUG(g_log) << this << " tickling";
     m_semaphore.notify();
 }
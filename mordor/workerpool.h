@@ -2,31 +2,63 @@
 #define __MORDOR_WORKERPOOL_H__
 // Copyright (c) 2009 - Mozy, Inc.
 
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+
 #include "scheduler.h"
 #include "semaphore.h"
 
 namespace Mordor {
 
+class FiberSemaphore;
+
 /// Generic Scheduler
 
 /// A WorkerPool is a generic Scheduler that does nothing when there is no work
 /// to be done.
+///
+/// Work handed over with submit() (as opposed to schedule()) can be bounded:
+/// with a maxQueueDepth, a submitter whose work would overflow the queue
+/// waits, as a Fiber, until a worker starts on something, so a burst of
+/// offloaded work (compression, hashing, ...) throttles its producers instead
+/// of piling up.  Combine with workStealing to keep work submitted from
+/// inside the pool on the submitting thread until someone idle steals it.
 class WorkerPool : public Scheduler
 {
 public:
-    WorkerPool(size_t threads = 1, bool useCaller = true, size_t batchSize = 1);
-    ~WorkerPool() { stop(); }
+    /// @param maxQueueDepth How many submit()ted items may be waiting to
+    /// start at once; 0 for no limit
+    WorkerPool(size_t threads = 1, bool useCaller = true, size_t batchSize = 1,
+        bool workStealing = false, size_t maxQueueDepth = 0);
+    ~WorkerPool();
+
+    /// Schedule dg, first waiting for room in the queue if it is bounded
+    /// @pre maxQueueDepth() == 0 || Scheduler::getThis() != NULL
+    void submit(boost::function<void ()> dg);
+
+    size_t maxQueueDepth() const { return m_maxQueueDepth; }
+    /// How many submit()ted items haven't started yet
+    size_t queueDepth() const { return m_queueDepth; }
 
 protected:
     /// The idle Fiber for a WorkerPool simply loops waiting on a Semaphore,
     /// and yields whenever that Semaphore is signalled, returning if
     /// stopping() is true.
     void idle();
-    /// Signals the semaphore so that the idle Fiber will yield.
+    /// Signals the semaphore so that the idle Fiber will yield; does nothing
+    /// if every thread already has a signal waiting for it
     void tickle();
 
+private:
+    void runSubmitted(boost::function<void ()> dg);
+
 private:
     Semaphore m_semaphore;
+    // Signals given to m_semaphore that haven't been consumed yet
+    volatile size_t m_tickles;
+    size_t m_maxQueueDepth;
+    volatile size_t m_queueDepth;
+    boost::scoped_ptr<FiberSemaphore> m_queueSlots;
 };
 
 }